@@ -0,0 +1,214 @@
+/**
+ * Micro-benchmark of the effect kernels on synthetic frames of every
+ * layout (packed RGB24 and RGBA, planar GBRP and YUV420P), without
+ * any video file or codec involved. Prints one JSON document.
+ *
+ *	./bench_effects [-j <threads>] [<output.json>]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ctve.h"
+#include "blur.h"
+#include "effects.h"
+#include "pool.h"
+#include "util.h"
+
+/* Every case runs for about this long, within these many samples. */
+#define BENCH_SECONDS		0.5
+#define BENCH_MIN_SAMPLES	5
+#define BENCH_MAX_SAMPLES	1000
+
+/* Below this many samples the 99th percentile is just the slowest one: p99 is null. */
+#define BENCH_P99_SAMPLES	100
+
+typedef struct
+{
+	const char *name;
+	uint16_t width;
+	uint16_t height;
+} bench_resolution_t;
+
+static const bench_resolution_t resolutions[] = {
+	{ "480p", 854, 480 },
+	{ "720p", 1280, 720 },
+	{ "1080p", 1920, 1080 },
+	{ "4k", 3840, 2160 },
+};
+
+/* Layouts every case runs on; YUV420P is the one chains take by default. */
+static const ctve_frame_pixel_t layouts[] = { RGB, RGBA, GBRP, YUV420P };
+
+/* Blur sizes and passes, each one a case of its own. */
+static const int blurs[][2] = { { 3, 1 }, { 9, 1 }, { 21, 1 }, { 9, 3 } };
+
+typedef void (*bench_func)(ctve_frame_t *frame, void *arg);
+
+static void bench_bw(ctve_frame_t *frame, void *arg)
+{
+	effects_apply_bw(frame);
+}
+
+static void bench_sepia(ctve_frame_t *frame, void *arg)
+{
+	effects_apply_sepia(frame);
+}
+
+static void bench_saturation(ctve_frame_t *frame, void *arg)
+{
+	effects_saturation(frame, 1.2f, 1.05f, 1.05f);
+}
+
+static void bench_blur(ctve_frame_t *frame, void *arg)
+{
+	blur_apply(frame);
+}
+
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Deterministic noise, so every run and every kernel sees the same input. */
+static void bench_fill(ctve_frame_t *frame)
+{
+	uint32_t seed = 12345;
+
+	for(int p = 0; p < ctve_frame_planes(frame->pixel_type); ++p) {
+		for(int i = 0; i < ctve_frame_plane_height(frame, p); ++i) {
+			uint8_t *row = ctve_frame_plane(frame, p) + i * ctve_frame_linesize(frame, p);
+
+			for(int j = 0; j < ctve_frame_plane_width(frame, p); ++j) {
+				seed = seed * 1103515245 + 12345;
+				row[j] = seed >> 24;
+			}
+		}
+	}
+}
+
+/**
+ * Time func on a fresh copy of the input, one sample per call. Figures
+ * are reported for the fastest, median and slowest sample, and the 99th
+ * percentile when there are enough samples for it to mean anything. Times
+ * go by value (min is the fastest); Mpix/s goes by sample, "best" and
+ * "worst", so "p99" and "worst" are the slow tail either way.
+ */
+static void bench_case(FILE *out, int *first, const char *effect, const char *params,
+	const bench_resolution_t *res, ctve_frame_pixel_t layout, bench_func func, void *arg)
+{
+	double samples[BENCH_MAX_SAMPLES];
+	double start = bench_now();
+	int count = 0;
+
+	ctve_frame_t *frame = ctve_create_frame_empty(res->width, res->height, layout);
+	if(frame == NULL) {
+		fprintf(stderr, "Could not allocate a %s frame\n", res->name);
+		exit(1);
+	}
+
+	/* Warm up caches, pool threads and the blur's scratch. */
+	bench_fill(frame);
+	func(frame, arg);
+
+	while(count < BENCH_MAX_SAMPLES && (count < BENCH_MIN_SAMPLES || bench_now() - start < BENCH_SECONDS)) {
+		bench_fill(frame);
+
+		double begin = bench_now();
+		func(frame, arg);
+		samples[count++] = bench_now() - begin;
+	}
+
+	ctve_free_frame(frame);
+	free(frame);
+
+	qsort(samples, count, sizeof(double), bench_compare);
+
+	double mpix = res->width * res->height / 1e6;
+	double best = samples[0];
+	double median = samples[count / 2];
+	double worst = samples[count - 1];
+	char p99[2][32] = { "null", "null" };
+
+	if(count >= BENCH_P99_SAMPLES) {
+		double p = samples[(int)(count * 0.99)];
+
+		snprintf(p99[0], sizeof(p99[0]), "%.3f", p * 1e3);
+		snprintf(p99[1], sizeof(p99[1]), "%.1f", mpix / p);
+	}
+
+	fprintf(out, "%s\n    { \"effect\": \"%s\", \"params\": \"%s\", \"layout\": \"%s\", \"resolution\": \"%s\", "
+		"\"width\": %d, \"height\": %d, \"samples\": %d,\n"
+		"      \"ms\": { \"min\": %.3f, \"median\": %.3f, \"p99\": %s, \"max\": %.3f },\n"
+		"      \"mpix_s\": { \"best\": %.1f, \"median\": %.1f, \"p99\": %s, \"worst\": %.1f } }",
+		*first ? "" : ",", effect, params, ctve_frame_layout_name(layout), res->name, res->width, res->height, count,
+		best * 1e3, median * 1e3, p99[0], worst * 1e3, mpix / best, mpix / median, p99[1], mpix / worst);
+	fflush(out);
+
+	*first = 0;
+}
+
+int main(int argc, char **argv)
+{
+	FILE *out = stdout;
+	int threads = 0;
+	int first = 1;
+
+	for(int i = 1; i < argc; ++i) {
+		if(strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+			threads = atoi(argv[++i]);
+		} else if((out = fopen(argv[i], "w")) == NULL) {
+			fprintf(stderr, "Could not open %s\n", argv[i]);
+			return -1;
+		}
+	}
+
+	pool_init(threads);
+	effects_init();
+
+	fprintf(out, "{\n  \"kernels\": \"%s\",\n  \"threads\": %d,\n  \"results\": [",
+		effects_kernels_name(), pool_threads(pool_get()));
+
+	for(int r = 0; r < sizeof(resolutions) / sizeof(resolutions[0]); ++r) {
+		for(int l = 0; l < sizeof(layouts) / sizeof(layouts[0]); ++l) {
+			const bench_resolution_t *res = &resolutions[r];
+			ctve_frame_pixel_t layout = layouts[l];
+
+			bench_case(out, &first, "bw", "", res, layout, bench_bw, NULL);
+			bench_case(out, &first, "sepia", "", res, layout, bench_sepia, NULL);
+			bench_case(out, &first, "saturation", "1.2,1.05,1.05", res, layout, bench_saturation, NULL);
+
+			for(int b = 0; b < sizeof(blurs) / sizeof(blurs[0]); ++b) {
+				char params[32];
+
+				snprintf(params, sizeof(params), "%d,%d", blurs[b][0], blurs[b][1]);
+				blur_init(blurs[b][0], blurs[b][1]);
+				bench_case(out, &first, "blur", params, res, layout, bench_blur, NULL);
+			}
+		}
+	}
+
+	fprintf(out, "\n  ]\n}\n");
+
+	if(out != stdout)
+		fclose(out);
+
+	blur_free();
+	pool_shutdown();
+
+	return 0;
+}
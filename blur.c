@@ -1,61 +1,392 @@
 #include "blur.h"
+#include "pool.h"
 #include "util.h"
 
-static int bRadius;
-static int bRadiusSq;
-static int *bDirRow;
-static int *bDirCol;
+/* Kernel used by blur_init() / blur_apply(). */
+static blur_kernel_t *bDefault;
 
-void blur_init(int radius)
+/**
+ * Per-thread working set: a band plus halo rows, twice, and column sums.
+ * `saved` keeps the rows around band edges of a blur_kernel_apply() call
+ * on this thread when the frame has no pooled buffer to swap in.
+ */
+typedef struct
 {
-	int index = 0;
-	
-	if(radius < 0)
+	uint8_t *tmp[2];
+	uint32_t len;
+	int *acc;
+	uint32_t accLen;
+	uint8_t *saved;
+	uint32_t savedLen;
+} blur_scratch_t;
+
+static pthread_key_t bScratchKey;
+static pthread_once_t bScratchOnce = PTHREAD_ONCE_INIT;
+
+/* Band split of one plane of a blur_kernel_apply() call. */
+typedef struct
+{
+	blur_kernel_t *kernel;
+	uint8_t *data;
+	int width;
+	int height;
+	/* Bytes per pixel: 3 for packed RGB, 4 for RGBA, 1 for a plane of planar layouts. */
+	int channels;
+	/* Bytes from a row to the next, in data and out alike. */
+	int stride;
+	uint8_t *out;
+	int bands;
+
+	blur_rows_func pre;
+	blur_rows_func post;
+	void *arg;
+
+	/* In place (out == data): 2 * halo rows of len bytes around each band edge. */
+	uint8_t *saved;
+	int halo;
+} blur_job_t;
+
+static void blur_scratch_free(void *p)
+{
+	blur_scratch_t *scratch = (blur_scratch_t*)p;
+
+	if(scratch == NULL)
 		return;
-	else if(radius % 2 == 0)
+
+	free(scratch->tmp[0]);
+	free(scratch->tmp[1]);
+	free(scratch->acc);
+	free(scratch->saved);
+	free(scratch);
+}
+
+static void blur_scratch_key(void)
+{
+	pthread_key_create(&bScratchKey, blur_scratch_free);
+}
+
+/* Calling thread's scratch, grown to hold at least len bytes and accLen sums. */
+static blur_scratch_t *blur_scratch(uint32_t len, uint32_t accLen)
+{
+	blur_scratch_t *scratch = (blur_scratch_t*)pthread_getspecific(bScratchKey);
+
+	if(scratch == NULL) {
+		scratch = (blur_scratch_t*)calloc(1, sizeof(blur_scratch_t));
+		pthread_setspecific(bScratchKey, scratch);
+	}
+
+	if(scratch->len < len) {
+		free(scratch->tmp[0]);
+		free(scratch->tmp[1]);
+		scratch->tmp[0] = (uint8_t*)malloc(len);
+		scratch->tmp[1] = (uint8_t*)malloc(len);
+		scratch->len = len;
+	}
+
+	if(scratch->accLen < accLen) {
+		free(scratch->acc);
+		scratch->acc = (int*)malloc(accLen * sizeof(int));
+		scratch->accLen = accLen;
+	}
+
+	return scratch;
+}
+
+static blur_kernel_t *blur_kernel_alloc(int radius, int passes)
+{
+	if(radius % 2 == 0)
 		radius++;
-	
-	bRadius = radius;
-	bRadiusSq = radius * radius;
-
-	bDirRow = (int*)malloc((bRadiusSq + 1) * sizeof(int));
-	bDirCol = (int*)malloc((bRadiusSq + 1) * sizeof(int));
-
-	for(int i = -radius / 2; i <= radius / 2; ++i) 
-		for(int j = -radius / 2; j <= radius / 2; ++j) {
-			bDirRow[index] 	= i;
-			bDirCol[index] = j;
-			++index;
-		}
+
+	blur_kernel_t *kernel = (blur_kernel_t*)malloc(sizeof(blur_kernel_t));
+
+	kernel->radius = radius;
+	kernel->passes = MAX(1, passes);
+	kernel->chroma = NULL;
+
+	/* A window sum never exceeds 255 * radius. */
+	kernel->div = (uint8_t*)malloc(255 * radius + 1);
+	for(int sum = 0; sum <= 255 * radius; ++sum)
+		kernel->div[sum] = (sum + radius / 2) / radius;
+
+	return kernel;
 }
 
-void blur_free()
+blur_kernel_t *blur_kernel_create(int radius, int passes)
 {
-	free(bDirRow);
-	free(bDirCol);
+	if(radius < 0)
+		return NULL;
+
+	pthread_once(&bScratchOnce, blur_scratch_key);
+
+	blur_kernel_t *kernel = blur_kernel_alloc(radius, passes);
+
+	/* Half-size chroma planes get a half-size kernel, at least 3 so they blur too. */
+	if(kernel->radius > 1)
+		kernel->chroma = blur_kernel_alloc(MAX(3, kernel->radius / 2), passes);
+
+	return kernel;
 }
 
-void blur_apply(ctve_frame_t *frame)
+void blur_kernel_free(blur_kernel_t *kernel)
+{
+	if(kernel == NULL)
+		return;
+
+	blur_kernel_free(kernel->chroma);
+	free(kernel->div);
+	free(kernel);
+}
+
+int blur_kernel_halo(blur_kernel_t *kernel)
+{
+	return kernel->passes * (kernel->radius / 2);
+}
+
+void blur_init(int radius, int passes)
 {
-	if(!frame || !bDirCol || !bDirCol)
+	blur_kernel_t *kernel = blur_kernel_create(radius, passes);
+
+	if(kernel == NULL)
 		return;
 
-	for(int i = 0; i < frame->height; ++i) {
-		for(int j = 0; j < 3 * frame->width; j += 3) {
-			float r = 0, g = 0, b = 0;
+	blur_kernel_free(bDefault);
+	bDefault = kernel;
+}
+
+void blur_free()
+{
+	blur_kernel_free(bDefault);
+	bDefault = NULL;
 
-			for(int dir = 0; dir < bRadiusSq; ++dir) {
-				int newY = MAX(0, MIN(i + bDirRow[dir], frame->height - 1));
-				int newX = MAX(0, MIN(j + 3 * bDirCol[dir], 3 * frame->width - 1));
+	/* Pool workers release theirs when they exit. */
+	pthread_once(&bScratchOnce, blur_scratch_key);
+	blur_scratch_free(pthread_getspecific(bScratchKey));
+	pthread_setspecific(bScratchKey, NULL);
+}
 
-				r += (float)frame->data[newY * 3 * frame->width + newX] / (float)bRadiusSq;
-				g += (float)frame->data[newY * 3 * frame->width + newX + 1] / (float)bRadiusSq;
-				b += (float)frame->data[newY * 3 * frame->width + newX + 2] / (float)bRadiusSq;
+/* Running-sum box filter along each row, src rows stride bytes apart -> packed dst. */
+static void blur_horizontal(blur_kernel_t *kernel, const uint8_t *src, int stride, uint8_t *dst, int width, int rows, int channels)
+{
+	const uint8_t *div = kernel->div;
+	int half = kernel->radius / 2;
+	int n = channels;
+
+	for(int i = 0; i < rows; ++i) {
+		const uint8_t *s = src + i * stride;
+		uint8_t *d = dst + i * n * width;
+
+		for(int c = 0; c < n; ++c) {
+			int sum = 0;
+
+			for(int k = -half; k <= half; ++k)
+				sum += s[n * MAX(0, MIN(k, width - 1)) + c];
+
+			for(int j = 0; j < width; ++j) {
+				d[n * j + c] = div[sum];
+				sum += s[n * MIN(j + half + 1, width - 1) + c] - s[n * MAX(j - half, 0) + c];
 			}
+		}
+	}
+}
 
-			frame->data[i * 3 * frame->width + j] = r;
-			frame->data[i * 3 * frame->width + j + 1] = g;
-			frame->data[i * 3 * frame->width + j + 2] = b;
+/**
+ * Running-sum box filter along each column of a rows-high block of len-byte
+ * rows, walking row by row. Only output rows [from, to) are stored at dst,
+ * stride bytes apart.
+ */
+static void blur_vertical(blur_kernel_t *kernel, const uint8_t *src, uint8_t *dst, int len, int stride, int rows, int from, int to, int *acc)
+{
+	const uint8_t *div = kernel->div;
+	int half = kernel->radius / 2;
+
+	for(int j = 0; j < len; ++j)
+		acc[j] = 0;
+
+	for(int k = from - half; k <= from + half; ++k) {
+		const uint8_t *s = src + MAX(0, MIN(k, rows - 1)) * len;
+		for(int j = 0; j < len; ++j)
+			acc[j] += s[j];
+	}
+
+	for(int i = from; i < to; ++i) {
+		const uint8_t *add = src + MIN(i + half + 1, rows - 1) * len;
+		const uint8_t *sub = src + MAX(i - half, 0) * len;
+		uint8_t *d = dst + (i - from) * stride;
+
+		for(int j = 0; j < len; ++j) {
+			d[j] = div[acc[j]];
+			acc[j] += add[j] - sub[j];
+		}
+	}
+}
+
+/**
+ * Input row r of a band. In place, the halo rows of the bands around it
+ * come from the copies blur_save_edge() made before any band was stored.
+ */
+static const uint8_t *blur_row(blur_job_t *job, int task, int r)
+{
+	int len = job->channels * job->width;
+	int from = job->height * task / job->bands;
+	int to = job->height * (task + 1) / job->bands;
+
+	if(job->out != job->data || (r >= from && r < to))
+		return job->data + r * job->stride;
+	if(r < from)
+		return job->saved + ((task - 1) * 2 * job->halo + r - (from - job->halo)) * len;
+
+	return job->saved + (task * 2 * job->halo + job->halo + r - to) * len;
+}
+
+/**
+ * Blurs one band of rows into the output frame. The band is widened by a
+ * halo of passes * radius / 2 rows: every pass pulls wrong values from the
+ * cut in by radius / 2 rows, so after the last one the band itself is exact.
+ */
+static void blur_band(void *arg, int task)
+{
+	blur_job_t *job = (blur_job_t*)arg;
+	blur_kernel_t *kernel = job->kernel;
+
+	int len = job->channels * job->width;
+	int from = job->height * task / job->bands;
+	int to = job->height * (task + 1) / job->bands;
+	int top = MAX(0, from - blur_kernel_halo(kernel));
+	int rows = MIN(job->height, to + blur_kernel_halo(kernel)) - top;
+
+	blur_scratch_t *scratch = blur_scratch(rows * len, len);
+
+	/* Effects running before the blur see each row once, while it's hot. */
+	for(int i = 0; i < rows; ++i) {
+		const uint8_t *row = blur_row(job, task, top + i);
+
+		if(job->pre != NULL) {
+			memcpy(scratch->tmp[1] + i * len, row, len);
+			job->pre(scratch->tmp[1] + i * len, job->width, 1, job->arg);
+			row = scratch->tmp[1] + i * len;
+		}
+
+		blur_horizontal(kernel, row, len, scratch->tmp[0] + i * len, job->width, 1, job->channels);
+	}
+
+	for(int pass = 0; pass < kernel->passes; ++pass) {
+		if(pass > 0)
+			blur_horizontal(kernel, scratch->tmp[1], len, scratch->tmp[0], job->width, rows, job->channels);
+
+		if(pass == kernel->passes - 1)
+			blur_vertical(kernel, scratch->tmp[0], job->out + from * job->stride, len, job->stride, rows, from - top, to - top, scratch->acc);
+		else
+			blur_vertical(kernel, scratch->tmp[0], scratch->tmp[1], len, len, rows, 0, rows, scratch->acc);
+	}
+
+	for(int i = from; i < to && job->post != NULL; ++i)
+		job->post(job->out + i * job->stride, job->width, 1, job->arg);
+}
+
+/* Keeps the rows the bands on either side of edge task + 1 read from each other. */
+static void blur_save_edge(void *arg, int task)
+{
+	blur_job_t *job = (blur_job_t*)arg;
+
+	int len = job->channels * job->width;
+	int edge = job->height * (task + 1) / job->bands;
+	uint8_t *dst = job->saved + task * 2 * job->halo * len;
+
+	for(int r = edge - job->halo; r < edge + job->halo; ++r, dst += len)
+		memcpy(dst, job->data + r * job->stride, len);
+}
+
+/**
+ * Blurs one plane of channels-byte pixels into out, see blur_kernel_apply().
+ * With out NULL the plane is blurred in place: only the halo rows around
+ * band edges are copied first, since each band reads its own rows before
+ * it stores them. Returns the bytes that took, for ctve_count_copy().
+ */
+static uint32_t blur_plane(blur_kernel_t *kernel, uint8_t *data, uint8_t *out, int width, int height, int channels, int stride, blur_rows_func pre, blur_rows_func post, void *arg)
+{
+	uint32_t length = stride * height;
+	uint32_t saved = 0;
+
+	/**
+	 * Bands of about L2_TILE_BYTES so each stays in L2 between the
+	 * horizontal and vertical passes, at least one per thread, but never
+	 * so thin that the halo would outweigh the band (so a band's halo
+	 * never reaches past the bands next to it).
+	 */
+	pool_t *pool = pool_get();
+	int halo = blur_kernel_halo(kernel);
+	int bands = MAX(pool_threads(pool), (int)(length / L2_TILE_BYTES));
+	blur_job_t job = { kernel, data, width, height, channels, stride, out != NULL ? out : data, 0, pre, post, arg, NULL, halo };
+
+	job.bands = MAX(1, MIN(bands, height / MAX(1, 2 * halo)));
+
+	if(out == NULL && job.bands > 1 && halo > 0) {
+		blur_scratch_t *scratch = blur_scratch(0, 0);
+
+		saved = (job.bands - 1) * 2 * halo * channels * width;
+		if(scratch->savedLen < saved) {
+			free(scratch->saved);
+			scratch->saved = (uint8_t*)malloc(saved);
+			scratch->savedLen = saved;
+		}
+
+		job.saved = scratch->saved;
+		pool_run(pool, job.bands - 1, blur_save_edge, &job);
+	}
+
+	pool_run(pool, job.bands, blur_band, &job);
+
+	return saved;
+}
+
+void blur_kernel_apply(blur_kernel_t *kernel, ctve_frame_t *frame, blur_rows_func pre, blur_rows_func post, void *arg)
+{
+	if(!kernel || !frame)
+		return;
+
+	/**
+	 * A pooled frame is blurred into a fresh buffer that then replaces
+	 * its own, instead of through scratch and back.
+	 */
+	ctve_frame_t out = *frame;
+	int swap = frame->buf != NULL && ctve_frame_alloc(&out) == 0;
+	uint64_t copied = 0;
+
+	if(frame->pixel_type == GBRP) {
+		/* Three full-size planes, each on its own; the hooks only understand packed rows. */
+		for(int p = 0; p < 3; ++p)
+			copied += blur_plane(kernel, ctve_frame_plane(frame, p), swap ? ctve_frame_plane(&out, p) : NULL, frame->width, frame->height, 1, frame->stride, NULL, NULL, NULL);
+	} else if(frame->pixel_type != YUV420P) {
+		copied += blur_plane(kernel, frame->data, swap ? out.data : NULL, frame->width, frame->height, (int)frame->pixel_type, frame->stride, pre, post, arg);
+	} else {
+		/* Each plane on its own; the hooks only understand packed RGB rows. */
+		copied += blur_plane(kernel, frame->data, swap ? out.data : NULL, frame->width, frame->height, 1, frame->stride, NULL, NULL, NULL);
+
+		for(int p = 1; p < 3; ++p) {
+			uint8_t *src = ctve_frame_plane(frame, p);
+			uint8_t *dst = swap ? ctve_frame_plane(&out, p) : NULL;
+			int width = ctve_frame_plane_width(frame, p);
+			int height = ctve_frame_plane_height(frame, p);
+			int stride = ctve_frame_linesize(frame, p);
+
+			if(kernel->chroma != NULL) {
+				copied += blur_plane(kernel->chroma, src, dst, width, height, 1, stride, NULL, NULL, NULL);
+			} else if(swap) {
+				memcpy(dst, src, stride * height);
+				copied += width * height;
+			}
 		}
 	}
+
+	ctve_count_copy(frame->counters, copied);
+
+	if(swap) {
+		ctve_frame_unref(frame);
+		*frame = out;
+	}
+}
+
+void blur_apply(ctve_frame_t *frame)
+{
+	blur_kernel_apply(bDefault, frame, NULL, NULL, NULL);
 }
@@ -3,8 +3,51 @@
 
 #include "ctve.h"
 
-/* Initialize internal kernel. */
-void blur_init(int radius);
+/**
+ * A box blur of a given size, repeated `passes` times. Each pass is a
+ * separable running-sum filter whose cost does not depend on radius;
+ * 3 passes approximate a Gaussian.
+ */
+typedef struct blur_kernel
+{
+	/* Kernel size, always odd. */
+	int radius;
+	int passes;
+
+	/* Division table: div[sum] = round(sum / radius). */
+	uint8_t *div;
+
+	/* Half-size kernel for the chroma planes of YUV420P frames, NULL for radius 1. */
+	struct blur_kernel *chroma;
+} blur_kernel_t;
+
+/**
+ * Hook run on `count` consecutive packed RGB or RGBA rows in place, used
+ * to fuse point-wise effects into the blur's own pass over memory.
+ */
+typedef void (*blur_rows_func)(uint8_t *rows, int width, int count, void *arg);
+
+/* Create a kernel. NULL if radius is negative. */
+blur_kernel_t *blur_kernel_create(int radius, int passes);
+
+/* Release a kernel. */
+void blur_kernel_free(blur_kernel_t *kernel);
+
+/* Rows a band needs on each side so its own rows come out exact. */
+int blur_kernel_halo(blur_kernel_t *kernel);
+
+/**
+ * Blur a RGB, RGBA, GBRP or YUV420P frame. pre runs on the input rows
+ * before they are blurred, post on the blurred rows before they are
+ * stored; both may be NULL and are only used for packed frames.
+ */
+void blur_kernel_apply(blur_kernel_t *kernel, ctve_frame_t *frame, blur_rows_func pre, blur_rows_func post, void *arg);
+
+/**
+ * Initialize internal kernel, see blur_kernel_create(). It is shared by
+ * the whole process: jobs running at the same time create their own.
+ */
+void blur_init(int radius, int passes);
 
 /* Release internal memory used by the kernel. */
 void blur_free();
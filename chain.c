@@ -0,0 +1,386 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "chain.h"
+#include "effects.h"
+#include "pool.h"
+#include "util.h"
+
+/* Effects [from, to) of a chain, run on whole rows. */
+typedef struct
+{
+	chain_t *chain;
+	int from;
+	int to;
+} chain_range_t;
+
+/* Point-wise effects before and after a blur, on packed rows of this layout. */
+typedef struct
+{
+	chain_range_t pre;
+	chain_range_t post;
+	ctve_frame_pixel_t layout;
+} chain_stage_t;
+
+/* Band split of a point-wise-only run. */
+typedef struct
+{
+	chain_range_t range;
+	ctve_frame_t *frame;
+	int bands;
+} chain_job_t;
+
+static int chain_parse_effect(chain_effect_t *effect, char *text)
+{
+	char *params = strchr(text, ':');
+	int count = 0;
+
+	if(params != NULL) {
+		*params++ = '\0';
+		count = sscanf(params, "%f,%f,%f", &effect->value[0], &effect->value[1], &effect->value[2]);
+	}
+
+	/* Every effect so far works on every layout. */
+	effect->layouts = CHAIN_LAYOUT_RGB | CHAIN_LAYOUT_RGBA | CHAIN_LAYOUT_GBRP | CHAIN_LAYOUT_YUV420P;
+
+	/* Colour effects default to the identity on YUV. */
+	memset(effect->yuv, 0, sizeof(effect->yuv));
+	effect->yuv[0] = effect->yuv[4] = effect->yuv[8] = 1.f;
+
+	if(strcmp(text, "bw") == 0) {
+		/* Keep luma, drop chroma. */
+		effect->type = CHAIN_BW;
+		effect->yuv[4] = effect->yuv[8] = 0.f;
+	} else if(strcmp(text, "sepia") == 0) {
+		effect->type = CHAIN_SEPIA;
+		effects_yuv_matrix(effects_sepia_rgb, effect->yuv);
+	} else if(strcmp(text, "saturation") == 0) {
+		if(count != 3) {
+			fprintf(stderr, "saturation needs three factors, e.g. saturation:1.2,1,1\n");
+			return -1;
+		}
+
+		float rgb[9] = { effect->value[0], 0, 0, 0, effect->value[1], 0, 0, 0, effect->value[2] };
+
+		effect->type = CHAIN_SATURATION;
+		for(int i = 0; i < 3; ++i)
+			effect->k[i] = effects_q15(effect->value[i]);
+		effects_yuv_matrix(rgb, effect->yuv);
+	} else if(strcmp(text, "blur") == 0) {
+		/* Default size is 5, a single pass. */
+		if(count < 1)
+			effect->value[0] = 5;
+		if(count < 2)
+			effect->value[1] = 1;
+
+		effect->type = CHAIN_BLUR;
+		effect->blur = blur_kernel_create((int)effect->value[0], (int)effect->value[1]);
+		if(effect->blur == NULL) {
+			fprintf(stderr, "Invalid blur size %f\n", effect->value[0]);
+			return -1;
+		}
+	} else if(strcmp(text, "average") == 0 || strcmp(text, "denoise") == 0) {
+		int denoise = text[0] == 'd';
+
+		/* Defaults: 3 frames of motion blur, denoise over 5 frames within 10 levels. */
+		if(count < 1)
+			effect->value[0] = denoise ? 5 : 3;
+		if(count < 2)
+			effect->value[1] = 10;
+
+		effect->type = denoise ? CHAIN_DENOISE : CHAIN_AVERAGE;
+		effect->temporal = temporal_create(denoise ? TEMPORAL_DENOISE : TEMPORAL_AVERAGE, (int)effect->value[0], (int)effect->value[1]);
+		if(effect->temporal == NULL) {
+			fprintf(stderr, "Invalid frame count %f, at most %d\n", effect->value[0], TEMPORAL_MAX);
+			return -1;
+		}
+	} else {
+		fprintf(stderr, "Unknown effect '%s'\n", text);
+		return -1;
+	}
+
+	return 0;
+}
+
+chain_t *chain_parse(const char *spec)
+{
+	chain_t *chain = (chain_t*)calloc(1, sizeof(chain_t));
+	char *copy = strdup(spec);
+	char *save = NULL;
+	int failed = 0;
+
+	for(char *text = strtok_r(copy, "+", &save); text != NULL && !failed; text = strtok_r(NULL, "+", &save)) {
+		if(chain->length == CHAIN_MAX) {
+			fprintf(stderr, "At most %d effects can be chained\n", CHAIN_MAX);
+			failed = 1;
+		} else if(chain_parse_effect(&chain->effects[chain->length], text) < 0) {
+			failed = 1;
+		} else {
+			chain->length++;
+		}
+	}
+
+	free(copy);
+
+	if(failed || chain->length == 0) {
+		chain_free(chain);
+		return NULL;
+	}
+
+	return chain;
+}
+
+void chain_free(chain_t *chain)
+{
+	if(chain == NULL)
+		return;
+
+	for(int i = 0; i < CHAIN_MAX; ++i) {
+		blur_kernel_free(chain->effects[i].blur);
+		temporal_free(chain->effects[i].temporal);
+	}
+
+	free(chain);
+}
+
+/**
+ * Runs a range of point-wise effects on `count` rows stride bytes apart,
+ * one row at a time. planes holds the first row of each plane: one for
+ * packed layouts, G, B and R for GBRP.
+ */
+static void chain_rows(chain_range_t *range, ctve_frame_pixel_t layout, uint8_t **planes, int width, int stride, int count)
+{
+	for(int i = 0; i < count; ++i) {
+		uint8_t *row = planes[0] + i * stride;
+
+		for(int e = range->from; e < range->to; ++e) {
+			chain_effect_t *effect = &range->chain->effects[e];
+
+			if(layout == GBRP) {
+				uint8_t *g = row, *b = planes[1] + i * stride, *r = planes[2] + i * stride;
+
+				if(effect->type == CHAIN_BW)
+					effects_row_bw_planar(r, g, b, width);
+				else if(effect->type == CHAIN_SEPIA)
+					effects_row_sepia_planar(r, g, b, width);
+				else if(effect->type == CHAIN_SATURATION)
+					effects_row_saturation_planar(r, g, b, width, effect->k);
+			} else if(layout == RGBA) {
+				if(effect->type == CHAIN_BW)
+					effects_row_bw_rgba(row, width);
+				else if(effect->type == CHAIN_SEPIA)
+					effects_row_sepia_rgba(row, width);
+				else if(effect->type == CHAIN_SATURATION)
+					effects_row_saturation_rgba(row, width, effect->k);
+			} else {
+				if(effect->type == CHAIN_BW)
+					effects_row_bw(row, width);
+				else if(effect->type == CHAIN_SEPIA)
+					effects_row_sepia(row, width);
+				else if(effect->type == CHAIN_SATURATION)
+					effects_row_saturation(row, width, effect->k);
+			}
+		}
+	}
+}
+
+static void chain_pre_rows(uint8_t *rows, int width, int count, void *arg)
+{
+	chain_stage_t *stage = (chain_stage_t*)arg;
+
+	chain_rows(&stage->pre, stage->layout, &rows, width, (int)stage->layout * width, count);
+}
+
+static void chain_post_rows(uint8_t *rows, int width, int count, void *arg)
+{
+	chain_stage_t *stage = (chain_stage_t*)arg;
+
+	chain_rows(&stage->post, stage->layout, &rows, width, (int)stage->layout * width, count);
+}
+
+static void chain_band(void *arg, int task)
+{
+	chain_job_t *job = (chain_job_t*)arg;
+	ctve_frame_t *frame = job->frame;
+	int from = frame->height * task / job->bands;
+	int to = frame->height * (task + 1) / job->bands;
+	uint8_t *planes[3];
+
+	for(int p = 0; p < ctve_frame_planes(frame->pixel_type); ++p)
+		planes[p] = ctve_frame_plane(frame, p) + from * ctve_frame_linesize(frame, p);
+
+	chain_rows(&job->range, frame->pixel_type, planes, frame->width, frame->stride, to - from);
+}
+
+/* Whether an effect can't be fused into a row by row pass. */
+static int chain_barrier(chain_effect_t *effect)
+{
+	return effect->type == CHAIN_BLUR || effect->temporal != NULL;
+}
+
+/* First blur or temporal effect at or after `from`, or the chain length. */
+static int chain_next_barrier(chain_t *chain, int from)
+{
+	while(from < chain->length && !chain_barrier(&chain->effects[from]))
+		from++;
+
+	return from;
+}
+
+/* Bit of a layout, see chain_effect_t.layouts. */
+static int chain_layout_bit(ctve_frame_pixel_t layout)
+{
+	switch(layout) {
+	case RGBA:
+		return CHAIN_LAYOUT_RGBA;
+	case GBRP:
+		return CHAIN_LAYOUT_GBRP;
+	case YUV420P:
+		return CHAIN_LAYOUT_YUV420P;
+	case RGB:
+		return CHAIN_LAYOUT_RGB;
+	default:
+		return 0;
+	}
+}
+
+int chain_supports(chain_t *chain, ctve_frame_pixel_t layout)
+{
+	for(int e = 0; e < chain->length; ++e) {
+		if(!(chain->effects[e].layouts & chain_layout_bit(layout)))
+			return 0;
+	}
+
+	return 1;
+}
+
+ctve_frame_pixel_t chain_layout(chain_t *chain, int rgb)
+{
+	/* Fewest conversions first, then the layouts that vectorise best. */
+	static const ctve_frame_pixel_t preferred[] = { YUV420P, GBRP, RGBA };
+
+	for(int i = rgb ? 1 : 0; i < (int)(sizeof(preferred) / sizeof(preferred[0])); ++i) {
+		if(chain_supports(chain, preferred[i]))
+			return preferred[i];
+	}
+
+	return RGB;
+}
+
+void chain_reset(chain_t *chain)
+{
+	for(int e = 0; e < chain->length; ++e)
+		temporal_reset(chain->effects[e].temporal);
+}
+
+int chain_temporal(chain_t *chain)
+{
+	for(int e = 0; e < chain->length; ++e) {
+		if(chain->effects[e].temporal != NULL)
+			return 1;
+	}
+
+	return 0;
+}
+
+int chain_halo(chain_t *chain)
+{
+	int halo = 0;
+
+	for(int e = 0; e < chain->length; ++e) {
+		blur_kernel_t *blur = chain->effects[e].blur;
+
+		/* The chroma kernel of a small blur can reach further, in pixels, than the luma one. */
+		if(blur != NULL)
+			halo += MAX(blur_kernel_halo(blur), blur->chroma != NULL ? 2 * blur_kernel_halo(blur->chroma) : 0);
+	}
+
+	return halo;
+}
+
+/**
+ * YUV420P: colour effects between two blurs or temporal effects become one
+ * matrix, clamped to the RGB gamut at its end rather than after each one.
+ */
+static void chain_apply_yuv(chain_t *chain, ctve_frame_t *frame)
+{
+	float m[9] = { 1, 0, 0, 0, 1, 0, 0, 0, 1 };
+	int pending = 0;
+
+	for(int e = 0; e < chain->length; ++e) {
+		chain_effect_t *effect = &chain->effects[e];
+
+		if(!chain_barrier(effect)) {
+			effects_matrix_mul(effect->yuv, m, m);
+			pending = 1;
+			continue;
+		}
+
+		if(pending)
+			effects_apply_yuv(frame, m);
+
+		if(effect->type == CHAIN_BLUR)
+			blur_kernel_apply(effect->blur, frame, NULL, NULL, NULL);
+		else
+			temporal_apply(effect->temporal, frame);
+
+		memset(m, 0, sizeof(m));
+		m[0] = m[4] = m[8] = 1.f;
+		pending = 0;
+	}
+
+	if(pending)
+		effects_apply_yuv(frame, m);
+}
+
+void chain_apply(chain_t *chain, ctve_frame_t *frame)
+{
+	if(!chain || !frame)
+		return;
+
+	if(frame->pixel_type == YUV420P) {
+		chain_apply_yuv(chain, frame);
+		return;
+	}
+
+	int start = 0;
+
+	while(start < chain->length) {
+		int barrier = chain_next_barrier(chain, start);
+		chain_effect_t *effect = &chain->effects[barrier];
+
+		/**
+		 * Each blur takes the point-wise effects before it and up to the next
+		 * barrier. Anything else gets its point-wise effects in a pass of its
+		 * own, and so does a blur on GBRP: its hooks only see packed rows.
+		 */
+		if(barrier < chain->length && effect->type == CHAIN_BLUR && frame->pixel_type != GBRP) {
+			int next = chain_next_barrier(chain, barrier + 1);
+			chain_stage_t stage = { { chain, start, barrier }, { chain, barrier + 1, next }, frame->pixel_type };
+
+			blur_kernel_apply(effect->blur, frame,
+				start < barrier ? chain_pre_rows : NULL,
+				barrier + 1 < next ? chain_post_rows : NULL,
+				&stage);
+
+			start = next;
+			continue;
+		}
+
+		/* A single fused point-wise pass in L2-sized bands. */
+		if(start < barrier) {
+			pool_t *pool = pool_get();
+			int bands = MAX(4 * pool_threads(pool), (int)(frame->length / L2_TILE_BYTES));
+			chain_job_t job = { { chain, start, barrier }, frame, MIN(frame->height, bands) };
+
+			pool_run(pool, job.bands, chain_band, &job);
+		}
+
+		if(barrier < chain->length && effect->type == CHAIN_BLUR)
+			blur_kernel_apply(effect->blur, frame, NULL, NULL, NULL);
+		else if(barrier < chain->length)
+			temporal_apply(effect->temporal, frame);
+
+		start = barrier + 1;
+	}
+}
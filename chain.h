@@ -0,0 +1,100 @@
+#ifndef CHAIN_H
+#define CHAIN_H
+
+#include "ctve.h"
+#include "blur.h"
+#include "temporal.h"
+
+#define CHAIN_MAX 16
+
+typedef enum
+{
+	CHAIN_BW,
+	CHAIN_SEPIA,
+	CHAIN_SATURATION,
+	CHAIN_BLUR,
+	CHAIN_AVERAGE,
+	CHAIN_DENOISE,
+} chain_type_t;
+
+/* Frame layouts, as bits of chain_effect_t.layouts. */
+#define CHAIN_LAYOUT_RGB	(1 << 0)
+#define CHAIN_LAYOUT_RGBA	(1 << 1)
+#define CHAIN_LAYOUT_GBRP	(1 << 2)
+#define CHAIN_LAYOUT_YUV420P	(1 << 3)
+
+/* One effect of a chain and its parameters. */
+typedef struct
+{
+	chain_type_t type;
+	float value[3];
+
+	/* Layouts the effect works on, CHAIN_LAYOUT_* bits. */
+	int layouts;
+
+	/* Saturation factors in Q15. */
+	uint16_t k[3];
+	/* Colour effects as a matrix on centered YUV, see effects_yuv_matrix(). */
+	float yuv[9];
+	/* Blur kernel, for CHAIN_BLUR. */
+	blur_kernel_t *blur;
+	/* Window and running sums, for CHAIN_AVERAGE and CHAIN_DENOISE. */
+	temporal_t *temporal;
+} chain_effect_t;
+
+/**
+ * A list of effects applied in order, e.g. "saturation:1.2,1,1+sepia+blur:7".
+ * Point-wise effects are fused into one loop per row; a blur takes the
+ * point-wise effects around it into its own L2-sized bands, so a frame is
+ * read from memory once per blur rather than once per effect. Temporal
+ * effects keep state from frame to frame: a chain with one of them must
+ * see every frame, in order.
+ */
+typedef struct
+{
+	chain_effect_t effects[CHAIN_MAX];
+	int length;
+} chain_t;
+
+/**
+ * Parse a chain: effects separated by '+', parameters after ':' separated
+ * by ','. bw, sepia, saturation:<r>,<g>,<b>, blur[:<size>[,<passes>]],
+ * average[:<frames>], denoise[:<frames>[,<threshold>]].
+ * Returns NULL and prints why on a malformed chain.
+ */
+chain_t *chain_parse(const char *spec);
+
+/* Release a chain. */
+void chain_free(chain_t *chain);
+
+/* Whether every effect of the chain works on this layout. */
+int chain_supports(chain_t *chain, ctve_frame_pixel_t layout);
+
+/**
+ * Frame layout the chain prefers: YUV420P when every effect supports it,
+ * which spares the conversions to and from RGB, otherwise the first RGB
+ * layout they all support, planar GBRP before RGBA before packed RGB.
+ * With rgb set, YUV420P is passed over.
+ */
+ctve_frame_pixel_t chain_layout(chain_t *chain, int rgb);
+
+/* Start every temporal effect over, for another video. */
+void chain_reset(chain_t *chain);
+
+/* Whether the chain has a temporal effect, and so must see every frame in order. */
+int chain_temporal(chain_t *chain);
+
+/**
+ * Pixels of input the chain reads around each output pixel: the halos of
+ * its blurs added up. A part of a frame processed with that much of the
+ * frame around it comes out as in the whole frame.
+ */
+int chain_halo(chain_t *chain);
+
+/**
+ * Apply every effect of the chain on a frame of a layout it supports. On
+ * YUV420P, consecutive colour effects are merged into a single matrix.
+ */
+void chain_apply(chain_t *chain, ctve_frame_t *frame);
+
+#endif
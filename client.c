@@ -0,0 +1,88 @@
+/**
+ * Submits a job to a running daemon (./main --daemon <socket>) and waits
+ * for its result, see daemon.h.
+ *
+ *	./ctve_client <socket> <input_file> <output_file> <effect_chain>
+ *
+ * Exits with 0 once the job went fine.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "daemon.h"
+
+/* The daemon has its own working directory: send absolute paths. */
+static void client_path(char *out, int size, const char *path)
+{
+	char cwd[DAEMON_PATH_MAX];
+
+	if(path[0] == '/' || getcwd(cwd, sizeof(cwd)) == NULL)
+		snprintf(out, size, "%s", path);
+	else
+		snprintf(out, size, "%s/%s", cwd, path);
+}
+
+int main(int argc, char **argv)
+{
+	struct sockaddr_un addr;
+	char inFile[DAEMON_PATH_MAX], outFile[DAEMON_PATH_MAX];
+	char request[2 * DAEMON_PATH_MAX + 512];
+	char reply[512];
+	int length = 0;
+
+	if(argc != 5) {
+		printf("Usage: %s <socket> <input_file> <output_file> <effect_chain>\n", argv[0]);
+		return -1;
+	}
+
+	if(strlen(argv[1]) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long: %s\n", argv[1]);
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, argv[1]);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		perror(argv[1]);
+		return -1;
+	}
+
+	client_path(inFile, sizeof(inFile), argv[2]);
+	client_path(outFile, sizeof(outFile), argv[3]);
+	snprintf(request, sizeof(request), "%s\t%s\t%s\n", inFile, outFile, argv[4]);
+
+	if(write(fd, request, strlen(request)) < 0) {
+		perror("write");
+		return -1;
+	}
+
+	/* One line back, once the job is done. */
+	while(length < sizeof(reply) - 1) {
+		ssize_t n = read(fd, reply + length, sizeof(reply) - 1 - length);
+
+		if(n <= 0)
+			break;
+
+		length += n;
+	}
+
+	reply[length] = '\0';
+	close(fd);
+
+	if(length == 0) {
+		fprintf(stderr, "No answer from the daemon\n");
+		return -1;
+	}
+
+	printf("%s", reply);
+
+	return strncmp(reply, "ok", 2) == 0 ? 0 : 1;
+}
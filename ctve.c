@@ -1,16 +1,602 @@
+#include <stdarg.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "ctve.h"
+#include "pool.h"
+#include "queue.h"
+#include "rawio.h"
+#include "util.h"
+
+/* Frames an encoder may hold on to, for the input pts of its keyframes. */
+#define CTVE_PTS_RING 512
+
+/**
+ * Video output: the encoder, and a muxer that takes its packets along
+ * with those of the input streams copied through untouched.
+ */
+typedef struct
+{
+    /* Context the output writes for, with the options and stats it uses. */
+    ctve_context_t *ctx;
+    AVFormatContext *format;
+    AVCodecContext *codec;
+    AVStream *video;
+    /**
+     * Output stream of every input stream, -1 for the dropped ones, for
+     * the streamCount the input had when the output was opened.
+     */
+    int *streams;
+    int streamCount;
+    /* RGB frames are converted into frame, YUV420P ones are pointed at by planes. */
+    struct SwsContext *sws;
+    AVFrame *frame;
+    AVFrame *planes;
+    /* Time base of the input video stream, and the last pts handed to the encoder. */
+    AVRational timeBase;
+    int64_t lastPts;
+    /* Encoded and copied packets come from different threads when pipelined. */
+    pthread_mutex_t lock;
+    /* 0 for the main output, which alone counts frames; k for renditions[k - 1]. */
+    int rendition;
+    /* Raw video written instead, with no codec or muxer; sws and frame convert to its layout. */
+    rawio_t *raw;
+    /* Input pts of the last frames handed to the encoder, by encoder pts; see ctve_checkpoint(). */
+    int64_t ringPts[CTVE_PTS_RING];
+    int64_t ringInput[CTVE_PTS_RING];
+    /* Checkpointed: dts of the last packet muxed of every copied input stream. NULL otherwise. */
+    int64_t *copied;
+    int copiedCount;
+} ctve_output_t;
+
+/* Where a checkpoint has the output stand, see ctve_options_t. */
+typedef struct
+{
+    /* First frame not in the output, in the input video stream's time base. */
+    int64_t inputPts;
+    /* Bytes of output before it, -1 for no checkpoint. */
+    int64_t offset;
+    /* Last pts handed to the encoder before it. */
+    int64_t lastPts;
+    /* Dts of the last packet of every input stream copied into the output, AV_NOPTS_VALUE for none. */
+    int64_t *copied;
+    int copiedCount;
+} ctve_checkpoint_t;
+
+/**
+ * Everything one video is processed with. Contexts share nothing but
+ * the frame buffer pools below and the worker pool, so videos of
+ * different contexts can go through at the same time.
+ */
+struct ctve_context
+{
+    /* Called on every batch with user, see ctve_context_process(). */
+    ctve_process_func func;
+    void *user;
+
+    /* Processing options, see ctve_context_set_options(). */
+    ctve_options_t options;
+
+    ctve_output_t output;
+
+    /* Encoders of the options' renditions, fed the main output's frames. */
+    ctve_output_t renditions[CTVE_MAX_RENDITIONS];
+    int renditionCount;
+
+    /* Pipelined mode: decode -> effect -> encode, joined by bounded queues. */
+    queue_t *pipeFree;
+    queue_t *pipeEffect;
+    queue_t *pipeEncode;
+    ctve_video_t *pipeBatch;
+    int pipeBatches;
+    pthread_t pipeEffectThread;
+    pthread_t pipeEncodeThread;
+
+    /* Pts range of the input video stream the algorithm runs on, AV_NOPTS_VALUE for no bound. */
+    int64_t rangeFrom;
+    int64_t rangeTo;
+
+    /* Start and time base of the input video stream, for the frames' time. */
+    int64_t videoStart;
+    AVRational videoTimeBase;
+
+    /**
+     * Checkpoints of the main output: the file, empty for none, and the
+     * encoder pts between two and of the next one due (a step of 0 takes
+     * none). The checkpoint resumed from, with an offset of -1 if none.
+     */
+    char checkpointPath[1040];
+    int64_t checkpointStep;
+    int64_t checkpointNext;
+    ctve_checkpoint_t resume;
+
+    /**
+     * See ctve_context_stats(). Segments share the timers, hence the lock;
+     * the run's frames count copies and reuse straight in here.
+     */
+    ctve_stats_t stats;
+    uint64_t statsDecoded;
+    pthread_mutex_t statsLock;
+
+    /**
+     * Set once anything of the run fails, along with why: what is under
+     * way winds down, and ctve_context_process() returns NULL.
+     */
+    int failed;
+    char error[256];
+};
+
+/**
+ * Frame buffers, handed out by ctve_frame_alloc() and recycled on unref.
+ * One pool per buffer size. A pool makes room for a new size only once
+ * all of its buffers are back; while every pool has some out, as with
+ * contexts of several sizes at once, the table grows instead.
+ */
+#define FRAME_POOLS 4
+
+typedef struct ctve_frame_pool {
+    int size;
+    int out;        /* buffers handed out and not back yet */
+    uint8_t *kept;  /* buffers back, each holding the next one's address */
+} ctve_frame_pool_t;
+
+static ctve_frame_pool_t **framePools;
+static int framePoolCount;
+static int framePoolNext;
+static pthread_mutex_t framePoolLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Context of ctve_set_options() and ctve_load_and_process_video(), and their callback. */
+static ctve_context_t *defaultContext;
+static cvte_algorithm_func defaultFunc;
+static pthread_once_t defaultOnce = PTHREAD_ONCE_INIT;
+
+/* Formats and codecs get registered once per process, not once per video. */
+static pthread_once_t registerOnce = PTHREAD_ONCE_INIT;
+
+void ctve_default_options(ctve_options_t *opts)
+{
+    ctve_options_t defaults = CTVE_DEFAULT_OPTIONS;
+
+    *opts = defaults;
+}
+
+ctve_context_t *ctve_context_create(const ctve_options_t *opts)
+{
+    ctve_context_t *ctx = (ctve_context_t*)calloc(1, sizeof(ctve_context_t));
+
+    ctve_default_options(&ctx->options);
+    if(opts != NULL)
+        ctve_context_set_options(ctx, opts);
+
+    ctx->rangeFrom = AV_NOPTS_VALUE;
+    ctx->rangeTo = AV_NOPTS_VALUE;
+    ctx->resume.offset = -1;
+    pthread_mutex_init(&ctx->statsLock, NULL);
+
+    return ctx;
+}
+
+void ctve_context_free(ctve_context_t *ctx)
+{
+    if(ctx == NULL)
+        return;
+
+    pthread_mutex_destroy(&ctx->statsLock);
+    free(ctx);
+}
+
+void ctve_context_set_options(ctve_context_t *ctx, const ctve_options_t *opts)
+{
+    ctx->options = *opts;
+
+    if(ctx->options.queue_depth < 1)
+        ctx->options.queue_depth = 1;
+}
+
+static void ctve_default_create(void)
+{
+    defaultContext = ctve_context_create(NULL);
+}
+
+/* The context behind the functions that take none, created on first use. */
+static ctve_context_t *ctve_default_context(void)
+{
+    pthread_once(&defaultOnce, ctve_default_create);
+
+    return defaultContext;
+}
+
+void ctve_set_options(const ctve_options_t *opts)
+{
+    ctve_context_set_options(ctve_default_context(), opts);
+}
+
+int ctve_options_profile(ctve_options_t *opts, const char *profile)
+{
+    /* Codecs always thread by frames and slices, the profiles trade encoding effort. */
+    opts->decode_threads = 0;
+    opts->encode_threads = 0;
+    opts->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+
+    if(strcmp(profile, "fast") == 0)
+        opts->preset = "veryfast";
+    else if(strcmp(profile, "balanced") == 0)
+        opts->preset = "medium";
+    else if(strcmp(profile, "quality") == 0)
+        opts->preset = "slow";
+    else
+        return -1;
+
+    return 0;
+}
+
+uint32_t ctve_frame_stride(uint16_t width, ctve_frame_pixel_t pixel_type)
+{
+    /* Chroma rows take half of it, and must stay aligned too. */
+    if(pixel_type == YUV420P)
+        return FFALIGN(width, 2 * CTVE_FRAME_ALIGN);
+
+    /* A byte per sample in every plane. */
+    if(pixel_type == GBRP)
+        return FFALIGN(width, CTVE_FRAME_ALIGN);
+
+    return FFALIGN(width * (int)pixel_type, CTVE_FRAME_ALIGN);
+}
+
+uint32_t ctve_frame_size(uint16_t width, uint16_t height, ctve_frame_pixel_t pixel_type)
+{
+    uint32_t stride = ctve_frame_stride(width, pixel_type);
+
+    if(pixel_type == YUV420P)
+        return stride * height + 2 * (stride / 2) * ((height + 1) / 2);
+
+    if(pixel_type == GBRP)
+        return 3 * stride * height;
+
+    return stride * height;
+}
+
+int ctve_frame_planes(ctve_frame_pixel_t pixel_type)
+{
+    return pixel_type == YUV420P || pixel_type == GBRP ? 3 : 1;
+}
+
+enum AVPixelFormat ctve_frame_pix_fmt(ctve_frame_pixel_t pixel_type)
+{
+    switch(pixel_type) {
+    case BW:
+        return AV_PIX_FMT_GRAY8;
+    case RGBA:
+        return AV_PIX_FMT_RGBA;
+    case YUV420P:
+        return AV_PIX_FMT_YUV420P;
+    case GBRP:
+        return AV_PIX_FMT_GBRP;
+    default:
+        return AV_PIX_FMT_RGB24;
+    }
+}
+
+const char *ctve_frame_layout_name(ctve_frame_pixel_t pixel_type)
+{
+    switch(pixel_type) {
+    case BW:
+        return "gray";
+    case RGBA:
+        return "rgba";
+    case YUV420P:
+        return "yuv420p";
+    case GBRP:
+        return "gbrp";
+    default:
+        return "rgb24";
+    }
+}
+
+int ctve_frame_linesize(ctve_frame_t *frame, int plane)
+{
+    return plane == 0 || frame->pixel_type != YUV420P ? frame->stride : frame->stride / 2;
+}
+
+int ctve_frame_plane_width(ctve_frame_t *frame, int plane)
+{
+    if(frame->pixel_type == YUV420P)
+        return plane == 0 ? frame->width : (frame->width + 1) / 2;
+
+    if(frame->pixel_type == GBRP)
+        return frame->width;
+
+    return frame->width * (int)frame->pixel_type;
+}
+
+int ctve_frame_plane_height(ctve_frame_t *frame, int plane)
+{
+    return plane == 0 || frame->pixel_type != YUV420P ? frame->height : (frame->height + 1) / 2;
+}
+
+/* Rows a frame's buffer has for the first plane, see ctve_frame_t.rows. */
+static uint16_t ctve_frame_rows(ctve_frame_t *frame)
+{
+    return MAX(frame->rows, frame->height);
+}
+
+uint8_t *ctve_frame_plane(ctve_frame_t *frame, int plane)
+{
+    uint8_t *p = frame->data;
+    int rows = ctve_frame_rows(frame);
+
+    for(int i = 0; i < plane; ++i)
+        p += ctve_frame_linesize(frame, i) * (i == 0 || frame->pixel_type != YUV420P ? rows : (rows + 1) / 2);
+
+    return p;
+}
+
+/* Buffers come back to their pool, for the next ctve_frame_alloc() of its size. */
+static void ctve_frame_pool_release(void *opaque, uint8_t *data)
+{
+    ctve_frame_pool_t *pool = (ctve_frame_pool_t*)opaque;
+
+    pthread_mutex_lock(&framePoolLock);
+    *(uint8_t**)data = pool->kept;
+    pool->kept = data;
+    pool->out--;
+    pthread_mutex_unlock(&framePoolLock);
+}
+
+/* Drop the buffers a pool kept: only ever with none of them out. */
+static void ctve_frame_pool_drain(ctve_frame_pool_t *pool)
+{
+    while(pool->kept != NULL) {
+        uint8_t *next = *(uint8_t**)pool->kept;
+
+        free(pool->kept);
+        pool->kept = next;
+    }
+}
+
+/* The pool of buffers of size bytes, under framePoolLock. NULL if out of memory. */
+static ctve_frame_pool_t *ctve_frame_pool_get(int size)
+{
+    ctve_frame_pool_t *pool = NULL;
+    ctve_frame_pool_t **pools;
+    int i;
+
+    for(i = 0; i < framePoolCount; ++i) {
+        if(framePools[i]->size == size)
+            return framePools[i];
+    }
+
+    /* Full: the next pool with all its buffers back makes room. */
+    for(i = 0; i < framePoolCount && framePoolCount >= FRAME_POOLS && pool == NULL; ++i) {
+        int next = (framePoolNext + i) % framePoolCount;
+
+        if(framePools[next]->out == 0) {
+            pool = framePools[next];
+            framePoolNext = (next + 1) % framePoolCount;
+            ctve_frame_pool_drain(pool);
+        }
+    }
+
+    if(pool == NULL) {
+        pools = (ctve_frame_pool_t**)realloc(framePools, (framePoolCount + 1) * sizeof(*pools));
+        if(pools == NULL)
+            return NULL;
+        framePools = pools;
+
+        pool = (ctve_frame_pool_t*)calloc(1, sizeof(*pool));
+        if(pool == NULL)
+            return NULL;
+        framePools[framePoolCount++] = pool;
+    }
+
+    pool->size = size;
+
+    return pool;
+}
+
+int ctve_frame_alloc(ctve_frame_t *frame)
+{
+    ctve_frame_pool_t *pool;
+    uint8_t *data = NULL;
+    void *block;
+
+    frame->stride = ctve_frame_stride(frame->width, frame->pixel_type);
+    frame->length = ctve_frame_size(frame->width, ctve_frame_rows(frame), frame->pixel_type);
+    frame->buf = NULL;
+
+    /* Counted out before it is, so the pool can't make room meanwhile. */
+    pthread_mutex_lock(&framePoolLock);
+    pool = ctve_frame_pool_get(frame->length);
+    if(pool != NULL) {
+        pool->out++;
+        if((data = pool->kept) != NULL)
+            pool->kept = *(uint8_t**)data;
+    }
+    pthread_mutex_unlock(&framePoolLock);
+
+    if(pool == NULL)
+        return -1;
+
+    /* CTVE_FRAME_ALIGN aligned, whatever av_malloc() was built with. */
+    if(data == NULL && posix_memalign(&block, CTVE_FRAME_ALIGN, frame->length) == 0)
+        data = (uint8_t*)block;
+
+    if(data != NULL)
+        frame->buf = av_buffer_create(data, frame->length, ctve_frame_pool_release, pool, 0);
+
+    if(frame->buf == NULL) {
+        if(data != NULL) {
+            ctve_frame_pool_release(pool, data);
+        } else {
+            pthread_mutex_lock(&framePoolLock);
+            pool->out--;
+            pthread_mutex_unlock(&framePoolLock);
+        }
+        return -1;
+    }
+
+    frame->data = frame->buf->data;
+
+    return 0;
+}
+
+void ctve_frame_unref(ctve_frame_t *frame)
+{
+    av_buffer_unref(&frame->buf);
+    frame->data = NULL;
+}
+
+void ctve_count_copy(ctve_stats_t *counters, uint64_t bytes)
+{
+    if(counters != NULL)
+        __sync_fetch_and_add(&counters->bytes_copied, bytes);
+}
+
+void ctve_count_reuse(ctve_stats_t *counters, uint64_t frames, uint64_t tiles, uint64_t hashed)
+{
+    if(counters == NULL)
+        return;
+
+    __sync_fetch_and_add(&counters->frames_reused, frames);
+    __sync_fetch_and_add(&counters->tiles_reused, tiles);
+    __sync_fetch_and_add(&counters->tiles_hashed, hashed);
+}
+
+int ctve_options_scaler(ctve_options_t *opts, const char *name)
+{
+    static const struct { const char *name; int flags; } scalers[] = {
+        { "point", SWS_POINT },
+        { "fast_bilinear", SWS_FAST_BILINEAR },
+        { "bilinear", SWS_BILINEAR },
+        { "bicubic", SWS_BICUBIC },
+        { "area", SWS_AREA },
+        { "lanczos", SWS_LANCZOS },
+    };
+
+    for(int i = 0; i < sizeof(scalers) / sizeof(scalers[0]); ++i) {
+        if(strcmp(name, scalers[i].name) == 0) {
+            opts->scaler = scalers[i].flags;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+int ctve_options_encode_format(ctve_options_t *opts, const char *name)
+{
+    enum AVPixelFormat pixFmt = av_get_pix_fmt(name);
+
+    if(pixFmt == AV_PIX_FMT_NONE)
+        return -1;
+
+    opts->encode_pix_fmt = pixFmt;
+
+    return 0;
+}
+
+/**
+ * Size asked of a picture of inWidth x inHeight, as in ctve_options_t:
+ * the options' for the frames, a rendition's for its encoder. The input's
+ * own size is kept as it is, odd or not.
+ */
+static void ctve_fit_size(int inWidth, int inHeight, int64_t w, int64_t h, double scale, uint16_t *width, uint16_t *height)
+{
+    if(w <= 0 && h <= 0 && scale > 0) {
+        w = llrint(inWidth * scale);
+        h = llrint(inHeight * scale);
+    } else if(w <= 0 && h > 0) {
+        w = h * inWidth / inHeight;
+    } else if(h <= 0 && w > 0) {
+        h = w * inHeight / inWidth;
+    } else if(w <= 0 && h <= 0) {
+        *width = inWidth;
+        *height = inHeight;
+        return;
+    }
+
+    *width = MIN(65534, MAX(2, (w + 1) & ~1));
+    *height = MIN(65534, MAX(2, (h + 1) & ~1));
+}
+
+/* Start of a timed stage: now, or 0 when stats are off. */
+static uint64_t ctve_clock(ctve_context_t *ctx)
+{
+    return ctx->options.stats ? stats_now() : 0;
+}
+
+/* Account the time since `since` to stage, over count frames, and return now. */
+static uint64_t ctve_lap(ctve_context_t *ctx, stats_stage_t stage, uint64_t since, int count)
+{
+    uint64_t now;
+
+    if(!ctx->options.stats)
+        return 0;
+
+    now = stats_now();
+    pthread_mutex_lock(&ctx->statsLock);
+    stats_timer_add(&ctx->stats.stages[stage], now - since, count);
+    pthread_mutex_unlock(&ctx->statsLock);
+
+    return now;
+}
+
+/**
+ * Threads for a codec: as asked, else libavcodec's one per core; with
+ * segments, every segment's codecs get their share of the cores.
+ */
+static int ctve_codec_threads(ctve_context_t *ctx, int threads)
+{
+    if(threads > 0 || ctx->options.segments < 2)
+        return threads;
+
+    return MAX(1, (int)sysconf(_SC_NPROCESSORS_ONLN) / ctx->options.segments);
+}
+
+/**
+ * Fail the context's run, printing why; the first reason is the one kept
+ * for ctve_context_error(). Any thread of the run may call it.
+ */
+static void ctve_failv(ctve_context_t *ctx, const char *format, va_list args)
+{
+    char message[sizeof(ctx->error)];
+
+    vsnprintf(message, sizeof(message), format, args);
+    fprintf(stderr, "%s\n", message);
+
+    if(__sync_bool_compare_and_swap(&ctx->failed, 0, 1))
+        memcpy(ctx->error, message, sizeof(message));
+}
+
+static void ctve_fail(ctve_context_t *ctx, const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    ctve_failv(ctx, format, args);
+    va_end(args);
+}
+
+/* Whether the context's run failed, see ctve_fail(). */
+static int ctve_failed(ctve_context_t *ctx)
+{
+    return __sync_fetch_and_add(&ctx->failed, 0);
+}
+
+const char *ctve_context_error(ctve_context_t *ctx)
+{
+    return ctve_failed(ctx) ? ctx->error : NULL;
+}
 
-static cvte_algorithm_func algorithm_func = NULL;
+void ctve_context_stats(ctve_context_t *ctx, ctve_stats_t *out)
+{
+    *out = ctx->stats;
+}
 
-/* Video output. */
-static FILE *outFile;
-static AVFrame *outFrame;
-static AVPacket outPkt;
-static AVCodec *outCodec;
-static AVCodecContext *outContext;
-static struct SwsContext *outSwsContext;
-static uint8_t outEndcode[] = { 0, 0, 1, 0xb7 };
-static int outWrites        = 0;
+void ctve_get_stats(ctve_stats_t *out)
+{
+    ctve_context_stats(ctve_default_context(), out);
+}
 
 ctve_frame_t *ctve_create_frame_empty(uint16_t width, uint16_t height, ctve_frame_pixel_t pixel_type)
 {
@@ -19,23 +605,43 @@ ctve_frame_t *ctve_create_frame_empty(uint16_t width, uint16_t height, ctve_fram
     /* Initialize frame. */
     frame->width = width;
     frame->height = height;
+    frame->rows = 0;
     frame->pixel_type = pixel_type;
-    frame->length = width * height * (int)pixel_type;
+    frame->pts = AV_NOPTS_VALUE;
+    frame->time = -1;
+    frame->counters = NULL;
 
-    /* Alloc buffer. */
-    frame->data = (uint8_t*)malloc(frame->length * sizeof(uint8_t));
+    /* Get a buffer. */
+    if(ctve_frame_alloc(frame) < 0) {
+        free(frame);
+        return NULL;
+    }
 
     return frame;
 }
 
+/* Copy packed rows into the padded planes of a frame. */
+static void ctve_copy_packed(ctve_frame_t *frame, const uint8_t *data)
+{
+    for(int p = 0; p < ctve_frame_planes(frame->pixel_type); ++p) {
+        uint8_t *dst = ctve_frame_plane(frame, p);
+        int len = ctve_frame_plane_width(frame, p);
+
+        for(int i = 0; i < ctve_frame_plane_height(frame, p); ++i) {
+            memcpy(dst + i * ctve_frame_linesize(frame, p), data, len);
+            data += len;
+        }
+    }
+}
+
 ctve_frame_t *ctve_create_frame(uint8_t *data, uint16_t width, uint16_t height, ctve_frame_pixel_t pixel_type)
 {
     /* Creates an empty frame. */
     ctve_frame_t *frame = ctve_create_frame_empty(width, height, pixel_type);
 
     /* Copy the data into the frame. */
-    int bytes = width * height * (int)pixel_type;
-    memcpy(frame->data, data, bytes);
+    if(frame != NULL)
+        ctve_copy_packed(frame, data);
 
     return frame;
 }
@@ -45,14 +651,14 @@ void ctve_init_frame(ctve_frame_t *frame, uint8_t *data, uint16_t width, uint16_
     /* Initialize frame. */
     frame->width = width;
     frame->height = height;
+    frame->rows = 0;
     frame->pixel_type = pixel_type;
-    frame->length = width * height * (int)pixel_type;
-
-    /* Alloc buffer. */
-    frame->data = (uint8_t*)malloc(frame->length * sizeof(uint8_t));
+    frame->pts = AV_NOPTS_VALUE;
+    frame->time = -1;
 
-    /* Copy the data into the frame. */
-    memcpy(frame->data, data, frame->length);
+    /* Get a buffer and copy the data into the frame. */
+    if(ctve_frame_alloc(frame) == 0)
+        ctve_copy_packed(frame, data);
 }
 
 void ctve_free_frame(ctve_frame_t *frame)
@@ -60,8 +666,9 @@ void ctve_free_frame(ctve_frame_t *frame)
     if(frame == NULL)
         return;
 
-    if(frame->data != NULL)
-        free(frame->data);
+    /* Back to the pool; data not from the pool stays with its owner. */
+    if(frame->buf != NULL)
+        ctve_frame_unref(frame);
 
     //free(frame);
 }
@@ -73,6 +680,7 @@ ctve_video_t *ctve_create_video_empty(uint16_t width, uint16_t height, float fra
 
     /* Init fields. */
     video->length       = 0;
+    video->capacity     = 0;
     video->frames       = NULL;
     video->width        = width;
     video->height       = height;
@@ -104,187 +712,1095 @@ void ctve_free_video(ctve_video_t *video)
     if(video == NULL)
         return;
 
-    /* Firstly, free up frames.*/
-    for(int i = 0; i < video->length; ++i)
+    /* Firstly, free up frames, all of them if they are the video's own.*/
+    for(int i = 0; i < MAX(video->length, video->capacity); ++i)
         ctve_free_frame(&video->frames[i]);
 
+    if(video->capacity > 0)
+        free(video->frames);
+
     free(video);
 }
 
-static void ctve_open_out_file(const char *outfile, AVCodecContext *codecCtx, ctve_video_t *video, int codec_id)
+/* Whether an encoder takes pictures in this format. */
+static int ctve_encoder_takes(const AVCodec *codec, enum AVPixelFormat pixFmt)
 {
+    for(const enum AVPixelFormat *fmt = codec->pix_fmts; fmt != NULL && *fmt != AV_PIX_FMT_NONE; ++fmt) {
+        if(*fmt == pixFmt)
+            return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Open outfile to write on at offset, cut back to there: see the
+ * checkpoints. Returns a negative value if that fails.
+ */
+static int ctve_open_append(AVIOContext **pb, const char *outfile, int64_t offset)
+{
+    AVDictionary *opts = NULL;
+    struct stat st;
     int ret;
-    printf("Encode video file %s\n", outfile);
 
-    /* find the video encoder */
-    outCodec = avcodec_find_encoder(codec_id);
-    if (!outCodec) {
-        fprintf(stderr, "Codec not found\n");
-        exit(1);
+    if (stat(outfile, &st) < 0 || st.st_size < offset || truncate(outfile, offset) < 0) {
+        fprintf(stderr, "%s is shorter than its checkpoint\n", outfile);
+        return -1;
     }
 
-    outContext = avcodec_alloc_context3(outCodec);
-    if (!outContext) {
-        fprintf(stderr, "Could not allocate video outCodec context\n");
-        exit(1);
+    /* The file protocol would empty it otherwise. */
+    av_dict_set(&opts, "truncate", "0", 0);
+    ret = avio_open2(pb, outfile, AVIO_FLAG_WRITE, NULL, &opts);
+    av_dict_free(&opts);
+
+    if (ret >= 0 && avio_seek(*pb, offset, SEEK_SET) < 0) {
+        avio_closep(pb);
+        ret = -1;
     }
 
+    return ret;
+}
+
+/* Release what an output holds, however far opening it got. */
+static void ctve_free_out_file(ctve_output_t *out)
+{
+    if (out->format != NULL && !(out->format->oformat->flags & AVFMT_NOFILE))
+        avio_closep(&out->format->pb);
+
+    avformat_free_context(out->format);
+    out->format = NULL;
+    free(out->streams);
+    out->streams = NULL;
+    out->streamCount = 0;
+    free(out->copied);
+    out->copied = NULL;
+    out->copiedCount = 0;
+
+    avcodec_close(out->codec);
+    av_free(out->codec);
+    out->codec = NULL;
+
+    if (out->frame != NULL)
+        av_freep(&out->frame->data[0]);
+    av_frame_free(&out->frame);
+    av_frame_free(&out->planes);
+    sws_freeContext(out->sws);
+    out->sws = NULL;
+    pthread_mutex_destroy(&out->lock);
+}
+
+/* Give up opening an output: fail the run with why and release the output. Returns -1. */
+static int ctve_open_failed(ctve_output_t *out, const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    ctve_failv(out->ctx, format, args);
+    va_end(args);
+
+    ctve_free_out_file(out);
+
+    return -1;
+}
+
+/**
+ * Open an encoder and a muxer writing to outfile. With like set, the
+ * encoder takes the codec and headers of that output's, and only the
+ * video goes out: see the segments. With copyVideo, the video stream
+ * is the input's, so its packets can be copied, and the encoder uses
+ * the same codec and pixel format, its headers kept aside to compare
+ * with the input's: see the smart cut. With
+ * rendition set, the encoder takes its size, bit rate and preset, and
+ * frames get scaled to that size on the way in. Returns -1, having
+ * failed the run and released the output, if it can't be opened.
+ */
+static int ctve_open_out_file(ctve_context_t *ctx, ctve_output_t *out, const char *outfile, AVFormatContext *inFormat, int videoStream, ctve_video_t *video, const ctve_output_t *like, int copyVideo, const ctve_rendition_t *rendition)
+{
+    AVStream *inStream = inFormat->streams[videoStream];
+    AVCodecContext *codecCtx = inStream->codec;
+    AVRational rate = av_guess_frame_rate(inFormat, inStream, NULL);
+    AVOutputFormat *format;
+    AVCodec *codec;
+    const char *preset = ctx->options.preset;
+    uint16_t width = video->width, height = video->height;
+    int codec_id, ret;
+
+    if (like == NULL)
+        printf("Encode video file %s\n", outfile);
+
+    memset(out, 0, sizeof(*out));
+    out->ctx = ctx;
+    pthread_mutex_init(&out->lock, NULL);
+
+    /* The container follows the file name. */
+    avformat_alloc_output_context2(&out->format, NULL, NULL, outfile);
+    if (!out->format)
+        return ctve_open_failed(out, "Could not guess a container for %s", outfile);
+
+    format = out->format->oformat;
+
+    /* Keep the input's codec when the container takes it. */
+    codec_id = codecCtx->codec_id;
+    if (like != NULL)
+        codec_id = like->codec->codec_id;
+    else if (!copyVideo && avformat_query_codec(format, codec_id, FF_COMPLIANCE_NORMAL) != 1)
+        codec_id = format->video_codec;
+
+    /* find the video encoder */
+    codec = avcodec_find_encoder(codec_id);
+    if (!codec)
+        return ctve_open_failed(out, "Codec not found");
+
+    out->codec = avcodec_alloc_context3(codec);
+    if (!out->codec)
+        return ctve_open_failed(out, "Could not allocate video codec context");
+
+    /* Some containers don't know their frame rate. */
+    if (rate.num <= 0 || rate.den <= 0)
+        rate = (AVRational){30, 1};
+
+    video->frame_rate = av_q2d(rate);
+
     /* put sample parameters */
-    outContext->bit_rate = codecCtx->bit_rate;
-    /* resolution must be a multiple of two */
-    outContext->width = video->width;
-    outContext->height = video->height;
-    /* frames per second */
-    outContext->time_base = (AVRational){1, video->frame_rate};
-    outContext->gop_size = codecCtx->gop_size;
-    outContext->max_b_frames = codecCtx->max_b_frames;
-    outContext->pix_fmt = AV_PIX_FMT_YUV420P;
+    out->codec->bit_rate = codecCtx->bit_rate;
 
-    if (codec_id == AV_CODEC_ID_H264)
-        av_opt_set(outContext->priv_data, "preset", "slow", 0);
+    if (rendition != NULL) {
+        ctve_fit_size(video->width, video->height, rendition->width, rendition->height, 0, &width, &height);
 
-    /* open it */
-    if (avcodec_open2(outContext, outCodec, NULL) < 0) {
-        fprintf(stderr, "Could not open outCodec\n");
-        exit(1);
+        if (rendition->bit_rate > 0)
+            out->codec->bit_rate = rendition->bit_rate;
+        if (rendition->preset != NULL)
+            preset = rendition->preset;
     }
 
-    outFile = fopen(outfile, "wb");
-    if (!outFile) {
-        fprintf(stderr, "Could not open %s\n", outfile);
-        exit(1);
+    /* resolution must be a multiple of two */
+    out->codec->width = width;
+    out->codec->height = height;
+    out->codec->sample_aspect_ratio = codecCtx->sample_aspect_ratio;
+    /* Stretched one way more than the other: pixels change shape, the picture doesn't. */
+    if (out->codec->sample_aspect_ratio.num > 0 && (width != codecCtx->width || height != codecCtx->height))
+        out->codec->sample_aspect_ratio = av_mul_q(out->codec->sample_aspect_ratio,
+            (AVRational){ codecCtx->width * height, codecCtx->height * width });
+    /* frames per second */
+    out->codec->time_base = av_inv_q(rate);
+    out->codec->framerate = rate;
+    out->codec->gop_size = codecCtx->gop_size;
+    out->codec->max_b_frames = codecCtx->max_b_frames;
+    out->codec->pix_fmt = AV_PIX_FMT_YUV420P;
+
+    /**
+     * YUV420P unless the options ask for another format: the effects'
+     * layout only decides whether frames need converting on the way in.
+     * Segments and cut parts keep the format of what they join.
+     */
+    if (like != NULL)
+        out->codec->pix_fmt = like->codec->pix_fmt;
+    else if (copyVideo && ctve_encoder_takes(codec, codecCtx->pix_fmt))
+        out->codec->pix_fmt = codecCtx->pix_fmt;
+    else if (!copyVideo && ctx->options.encode_pix_fmt != AV_PIX_FMT_NONE) {
+        if (!ctve_encoder_takes(codec, ctx->options.encode_pix_fmt))
+            return ctve_open_failed(out, "%s can't encode %s", codec->name, av_get_pix_fmt_name(ctx->options.encode_pix_fmt));
+        out->codec->pix_fmt = ctx->options.encode_pix_fmt;
     }
+    out->codec->thread_count = ctve_codec_threads(ctx, ctx->options.encode_threads);
+    out->codec->thread_type = ctx->options.thread_type;
 
-    outFrame = av_frame_alloc();
-    if (!outFrame) {
-        fprintf(stderr, "Could not allocate video outFrame\n");
-        exit(1);
-    }
+    if (like != NULL ? (like->codec->flags & AV_CODEC_FLAG_GLOBAL_HEADER) : (copyVideo || (format->flags & AVFMT_GLOBALHEADER)))
+        out->codec->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
 
-    outFrame->format = outContext->pix_fmt;
-    outFrame->width  = outContext->width;
-    outFrame->height = outContext->height;
+    if (codec_id == AV_CODEC_ID_H264 && preset != NULL)
+        av_opt_set(out->codec->priv_data, "preset", preset, 0);
 
-    outSwsContext = sws_getContext(
-        outFrame->width, 
-        outFrame->height,
-        AV_PIX_FMT_RGB24, 
-        outFrame->width, 
-        outFrame->height,
-        AV_PIX_FMT_YUV420P, SWS_BICUBIC, 0, 0, 0);
+    /* Nothing after a checkpoint's keyframe may refer to what came before it. */
+    if (out == &ctx->output && ctx->checkpointPath[0] != '\0')
+        out->codec->flags |= AV_CODEC_FLAG_CLOSED_GOP;
 
-    /* the image can be allocated by any means and av_image_alloc() is
-     * just the most convenient way if av_malloc() is to be used */
-    ret = av_image_alloc(
-        outFrame->data, 
-        outFrame->linesize, 
-        outContext->width, 
-        outContext->height,
-        outContext->pix_fmt, 
-        32
-    );
+    /* open it */
+    if (avcodec_open2(out->codec, codec, NULL) < 0)
+        return ctve_open_failed(out, "Could not open codec");
 
-    if (ret < 0) {
-        fprintf(stderr, "Could not allocate raw picture buffer\n");
-        exit(1);
-    }
-}
+    out->video = avformat_new_stream(out->format, NULL);
+    if (!out->video || (copyVideo ? avcodec_parameters_copy(out->video->codecpar, inStream->codecpar) :
+        avcodec_parameters_from_context(out->video->codecpar, out->codec)) < 0)
+        return ctve_open_failed(out, "Could not add the video stream");
 
-static void ctve_write_out_file(ctve_video_t *video)
-{
-    int got_output, i;
-    static int last = 0;
-    int inLineSize[1] = {3 * video->width};
-    
-    /* encode 1 second of video */
-    for (i = 0; i < video->length; i++) {
-        av_init_packet(&outPkt);
-        outPkt.data = NULL;    // packet data will be allocated by the encoder
-        outPkt.size = 0;
-        
-        uint8_t *inData[1] = {video->frames[i].data};
+    if (copyVideo)
+        out->video->codecpar->codec_tag = 0;
 
-        sws_scale(
-            outSwsContext, 
-            (const uint8_t * const *)inData,
-            inLineSize, 
-            0,
-            video->height, 
-            outFrame->data, 
-            outFrame->linesize
-        );
+    out->video->time_base = out->codec->time_base;
+    out->video->avg_frame_rate = rate;
 
-        outFrame->pts = last++;
+    /* Audio and subtitles go through as they are, if the container takes them. */
+    out->streams = (int*)malloc(inFormat->nb_streams * sizeof(int));
+    out->streamCount = inFormat->nb_streams;
 
-        /* encode the image */
-        int ret = avcodec_encode_video2(outContext, &outPkt, outFrame, &got_output);
-        if (ret < 0) {
-            fprintf(stderr, "Error encoding outFrame1\n");
-            exit(1);
-        }
+    for (int i = 0; i < inFormat->nb_streams; ++i) {
+        AVStream *in = inFormat->streams[i];
+        AVStream *copy;
 
-        if (got_output) {
-            fwrite(outPkt.data, 1, outPkt.size, outFile);
-            av_packet_unref(&outPkt);
+        out->streams[i] = -1;
+
+        if (i == videoStream) {
+            out->streams[i] = out->video->index;
+            continue;
         }
-    }
-}
 
-static void ctve_save_frame(ctve_video_t *video, uint8_t *data, int linesize)
-{
-    if(video == NULL || data == NULL)
-        return;
+        if (like != NULL)
+            continue;
 
-    if(video->frames == NULL) {
-        /* First chunk of frames. */
-        video->frames = (ctve_frame_t*)malloc(FRAMES_COUNT * sizeof(ctve_frame_t));
+        if (in->codecpar->codec_type != AVMEDIA_TYPE_AUDIO && in->codecpar->codec_type != AVMEDIA_TYPE_SUBTITLE)
+            continue;
 
-        for(int i = 0; i < FRAMES_COUNT; ++i) {
-            /* Init frame. */
-            video->frames[i].width = video->width;
-            video->frames[i].height = video->height;
-            video->frames[i].pixel_type = RGB;
-            video->frames[i].length = video->width * video->height * (int)RGB;
-            video->frames[i].data = (uint8_t*)malloc(video->frames[i].length);
+        if (avformat_query_codec(format, in->codecpar->codec_id, FF_COMPLIANCE_NORMAL) == 0) {
+            fprintf(stderr, "Dropping stream %d, %s can't hold it\n", i, format->name);
+            continue;
         }
+
+        copy = avformat_new_stream(out->format, NULL);
+        if (!copy || avcodec_parameters_copy(copy->codecpar, in->codecpar) < 0)
+            return ctve_open_failed(out, "Could not copy stream %d", i);
+
+        /* The input container's tag may mean nothing to this one. */
+        copy->codecpar->codec_tag = 0;
+        copy->time_base = in->time_base;
+        out->streams[i] = copy->index;
     }
 
-    if(video->length == FRAMES_COUNT) {
-        /* Process these frames. */
-        if(algorithm_func != NULL)
-            algorithm_func(video);
+    if (!(format->flags & AVFMT_NOFILE) && (out == &ctx->output && ctx->resume.offset >= 0 ?
+        ctve_open_append(&out->format->pb, outfile, ctx->resume.offset) : avio_open(&out->format->pb, outfile, AVIO_FLAG_WRITE)) < 0)
+        return ctve_open_failed(out, "Could not open %s", outfile);
 
-        /* Write these frames into output file.*/
-        ctve_write_out_file(video);
+    /* The muxer may pick other stream time bases here. */
+    if (avformat_write_header(out->format, NULL) < 0)
+        return ctve_open_failed(out, "Could not write the header of %s", outfile);
 
-        /* Reset length for the next 30 frames. */
-        video->length = 0;
-    }
+    out->timeBase = inStream->time_base;
+    out->lastPts = -1;
 
-    /* Access current frame. */
-    ctve_frame_t *frame = &video->frames[video->length];
+    if (out == &ctx->output && ctx->checkpointPath[0] != '\0') {
+        out->copiedCount = inFormat->nb_streams;
+        out->copied = (int64_t*)malloc(out->copiedCount * sizeof(int64_t));
 
-    /* Copy data from AVFrame into frame's local data. */
-    uint8_t *p = frame->data;
+        /* Resumed: the encoder's pts go on from the checkpoint's, and so do the copied streams. */
+        for (int i = 0; i < out->copiedCount; ++i)
+            out->copied[i] = ctx->resume.offset >= 0 && i < ctx->resume.copiedCount ? ctx->resume.copied[i] : AV_NOPTS_VALUE;
 
-    int len = frame->width * (int)frame->pixel_type;
-    for(int i = 0; i < frame->height; ++i) {
-        memcpy(p, data + i * linesize, len);
-        p += len;
+        if (ctx->resume.offset >= 0)
+            out->lastPts = ctx->resume.lastPts;
+
+        ctx->checkpointStep = ctx->options.checkpoint > 0 ? MAX(1, llrint(ctx->options.checkpoint / av_q2d(out->codec->time_base))) : 0;
+        ctx->checkpointNext = out->lastPts + 1 + ctx->checkpointStep;
     }
 
-    /* Increment the number of frames.*/
-    video->length++;
-}
+    out->frame = av_frame_alloc();
+    if (!out->frame)
+        return ctve_open_failed(out, "Could not allocate video frame");
 
-void SaveFrame(AVFrame *pFrame, int width, int height, int iFrame) {
-  FILE *pFile;
-  char szFilename[32];
-  int  y;
-  
-  // Open file
-  sprintf(szFilename, "frame%d.ppm", iFrame);
-  pFile=fopen(szFilename, "wb");
+    out->frame->format = out->codec->pix_fmt;
+    out->frame->width  = out->codec->width;
+    out->frame->height = out->codec->height;
+
+    /* Points straight at the planes of frames in the encoder's format, it owns no buffer. */
+    out->planes = av_frame_alloc();
+    if (!out->planes)
+        return ctve_open_failed(out, "Could not allocate video planes");
+
+    out->planes->format = out->codec->pix_fmt;
+    out->planes->width  = out->codec->width;
+    out->planes->height = out->codec->height;
+
+    out->sws = sws_getContext(
+        video->width,
+        video->height,
+        ctve_frame_pix_fmt(ctx->options.pixel_type),
+        out->frame->width, 
+        out->frame->height,
+        out->codec->pix_fmt, ctx->options.scaler, 0, 0, 0);
+
+    /* the image can be allocated by any means and av_image_alloc() is
+     * just the most convenient way if av_malloc() is to be used */
+    ret = av_image_alloc(
+        out->frame->data, 
+        out->frame->linesize, 
+        out->codec->width, 
+        out->codec->height,
+        out->codec->pix_fmt, 
+        32
+    );
+
+    if (ret < 0 || out->sws == NULL)
+        return ctve_open_failed(out, "Could not allocate raw picture buffer");
+
+    return 0;
+}
+
+/**
+ * Hand a packet over to the muxer, which takes its reference. A packet
+ * copied from input stream `stream` (-1 for others) with that dts there
+ * is kept track of for the checkpoints.
+ */
+static void ctve_mux_packet(ctve_output_t *out, AVPacket *pkt, int stream, int64_t dts)
+{
+    pthread_mutex_lock(&out->lock);
+    if (stream >= 0 && out->copied != NULL && dts != AV_NOPTS_VALUE)
+        out->copied[stream] = dts;
+    if (av_interleaved_write_frame(out->format, pkt) < 0)
+        fprintf(stderr, "Error writing a packet of stream %d\n", pkt->stream_index);
+    pthread_mutex_unlock(&out->lock);
+}
+
+/* Write an encoded packet to the output video stream. */
+static void ctve_write_packet(ctve_output_t *out, AVPacket *pkt)
+{
+    av_packet_rescale_ts(pkt, out->codec->time_base, out->video->time_base);
+    pkt->stream_index = out->video->index;
+
+    ctve_mux_packet(out, pkt, -1, AV_NOPTS_VALUE);
+}
+
+/**
+ * Output stream of an input stream, -1 if it isn't copied. Streams that
+ * showed up in the input after the output was opened have none.
+ */
+static int ctve_output_stream(ctve_output_t *out, int index)
+{
+    return out->streams != NULL && index >= 0 && index < out->streamCount ? out->streams[index] : -1;
+}
+
+/* Write a packet of a copied input stream, without decoding it. Packets of other streams are dropped. */
+static void ctve_copy_packet(ctve_output_t *out, AVPacket *pkt, AVStream *in)
+{
+    int index = pkt->stream_index;
+
+    if (ctve_output_stream(out, index) < 0) {
+        av_free_packet(pkt);
+        return;
+    }
+
+    AVStream *stream = out->format->streams[out->streams[index]];
+    int64_t dts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+
+    av_packet_rescale_ts(pkt, in->time_base, stream->time_base);
+    pkt->stream_index = stream->index;
+    pkt->pos = -1;
+
+    ctve_mux_packet(out, pkt, index, dts);
+}
+
+/* Slot of the pts ring an encoder pts goes to. */
+static int ctve_ring_slot(int64_t pts)
+{
+    return (int)((pts % CTVE_PTS_RING + CTVE_PTS_RING) % CTVE_PTS_RING);
+}
+
+/**
+ * At a keyframe of the main output, before it is written: a step past
+ * the last checkpoint, flush the muxer and save where the output stands.
+ * The file is renamed into place, so it is always whole.
+ */
+static void ctve_checkpoint(ctve_output_t *out, AVPacket *pkt)
+{
+    ctve_context_t *ctx = out->ctx;
+    int slot = ctve_ring_slot(pkt->pts);
+    char path[1048];
+    int64_t offset;
+    FILE *file;
+
+    if (ctx->checkpointStep == 0 || pkt->pts == AV_NOPTS_VALUE || pkt->pts < ctx->checkpointNext ||
+        out->ringPts[slot] != pkt->pts || out->ringInput[slot] == AV_NOPTS_VALUE)
+        return;
+
+    pthread_mutex_lock(&out->lock);
+
+    /* Whatever the muxers hold goes to the file: interleaving queue, then the container's own buffers. */
+    av_interleaved_write_frame(out->format, NULL);
+    av_write_frame(out->format, NULL);
+    avio_flush(out->format->pb);
+    offset = avio_tell(out->format->pb);
+
+    snprintf(path, sizeof(path), "%s.tmp", ctx->checkpointPath);
+    file = fopen(path, "w");
+
+    if (file != NULL) {
+        fprintf(file, "input_pts %lld\noutput_offset %lld\npts %lld\n",
+            (long long)out->ringInput[slot], (long long)offset, (long long)(pkt->pts - 1));
+
+        for (int i = 0; i < out->copiedCount; ++i) {
+            if (out->copied[i] != AV_NOPTS_VALUE)
+                fprintf(file, "copied %d %lld\n", i, (long long)out->copied[i]);
+        }
+
+        if (fclose(file) != 0 || rename(path, ctx->checkpointPath) != 0)
+            fprintf(stderr, "Could not write the checkpoint %s\n", ctx->checkpointPath);
+    }
+
+    pthread_mutex_unlock(&out->lock);
+
+    ctx->checkpointNext = pkt->pts + ctx->checkpointStep;
+}
+
+/* A frame on its way out: counted once, however many renditions it goes to. */
+static void ctve_count_frame(ctve_output_t *out, ctve_frame_t *frame)
+{
+    ctve_context_t *ctx = out->ctx;
+
+    if(out->rendition != 0)
+        return;
+
+    if(__sync_fetch_and_add(&ctx->stats.frames, 1) == 0)
+        ctx->stats.latency_frames = __sync_fetch_and_add(&ctx->statsDecoded, 0);
+
+    if(ctx->options.stats)
+        ctve_lap(ctx, STATS_LATENCY, frame->decoded, 1);
+}
+
+/**
+ * Open raw output at the frames' size: frames already in its layout are
+ * written as they are, others get converted first. Returns -1 like
+ * ctve_open_out_file().
+ */
+static int ctve_open_raw_out(ctve_context_t *ctx, ctve_output_t *out, const char *outfile, ctve_video_t *video, AVRational rate)
+{
+    enum AVPixelFormat pixFmt;
+
+    memset(out, 0, sizeof(*out));
+    out->ctx = ctx;
+    out->lastPts = -1;
+    pthread_mutex_init(&out->lock, NULL);
+
+    /* Opened first: written to stdout, it moves the messages off it. */
+    out->raw = rawio_open_output(outfile, (rawio_format_t)ctx->options.raw_out, video->width, video->height, rate.num, rate.den);
+    if(out->raw == NULL)
+        return ctve_open_failed(out, "Could not write raw video to %s", outfile);
+
+    printf("Write raw video to %s\n", outfile);
+
+    video->frame_rate = av_q2d(rate);
+
+    if(out->raw->pixel_type == ctx->options.pixel_type)
+        return 0;
+
+    pixFmt = ctve_frame_pix_fmt(out->raw->pixel_type);
+    out->frame = av_frame_alloc();
+    out->sws = sws_getContext(video->width, video->height, ctve_frame_pix_fmt(ctx->options.pixel_type),
+        video->width, video->height, pixFmt, ctx->options.scaler, 0, 0, 0);
+
+    if(out->frame == NULL || out->sws == NULL ||
+        av_image_alloc(out->frame->data, out->frame->linesize, video->width, video->height, pixFmt, 32) < 0) {
+        rawio_close(out->raw);
+        out->raw = NULL;
+        return ctve_open_failed(out, "Could not allocate raw picture buffer");
+    }
+
+    return 0;
+}
+
+/* Write a batch to raw output, converted to its layout if need be. */
+static void ctve_write_raw(ctve_output_t *out, ctve_video_t *video)
+{
+    ctve_context_t *ctx = out->ctx;
+
+    for (int i = 0; i < video->length; i++) {
+        ctve_frame_t *frame = &video->frames[i];
+        uint64_t time = ctve_clock(ctx);
+        uint8_t *data[3];
+        int linesize[3];
+
+        for(int p = 0; p < ctve_frame_planes(frame->pixel_type); ++p) {
+            data[p] = ctve_frame_plane(frame, p);
+            linesize[p] = ctve_frame_linesize(frame, p);
+        }
+
+        if(out->sws != NULL) {
+            sws_scale(out->sws, (const uint8_t * const *)data, linesize, 0, frame->height, out->frame->data, out->frame->linesize);
+
+            for(int p = 0; p < 3; ++p) {
+                data[p] = out->frame->data[p];
+                linesize[p] = out->frame->linesize[p];
+            }
+
+            time = ctve_lap(ctx, STATS_CONVERT_OUT, time, 1);
+        }
+
+        ctve_count_frame(out, frame);
+
+        if(rawio_write(out->raw, data, linesize) < 0) {
+            ctve_fail(ctx, "Error writing raw video");
+            return;
+        }
+
+        ctve_lap(ctx, STATS_WRITE, time, 1);
+    }
+}
+
+static void ctve_write_out_file(ctve_output_t *out, ctve_video_t *video)
+{
+    ctve_context_t *ctx = out->ctx;
+    int got_output, i;
+    AVPacket pkt;
+
+    /* Once the run failed, batches go through without being written. */
+    if (ctve_failed(ctx))
+        return;
+
+    if (out->raw != NULL) {
+        ctve_write_raw(out, video);
+        return;
+    }
+
+    /* encode 1 second of video */
+    for (i = 0; i < video->length; i++) {
+        ctve_frame_t *frame = &video->frames[i];
+        AVFrame *picture = out->frame;
+        uint64_t time = ctve_clock(ctx);
+
+        av_init_packet(&pkt);
+        pkt.data = NULL;    // packet data will be allocated by the encoder
+        pkt.size = 0;
+        
+        uint8_t *inData[3];
+        int inLineSize[3];
+
+        for(int p = 0; p < ctve_frame_planes(frame->pixel_type); ++p) {
+            inData[p] = ctve_frame_plane(frame, p);
+            inLineSize[p] = ctve_frame_linesize(frame, p);
+        }
+
+        if(ctve_frame_pix_fmt(frame->pixel_type) == out->codec->pix_fmt &&
+            frame->width == out->codec->width && frame->height == out->codec->height) {
+            /* Already in the encoder's format: hand the planes over as they are. */
+            picture = out->planes;
+
+            for(int p = 0; p < ctve_frame_planes(frame->pixel_type); ++p) {
+                picture->data[p] = inData[p];
+                picture->linesize[p] = inLineSize[p];
+            }
+        } else {
+            sws_scale(
+                out->sws, 
+                (const uint8_t * const *)inData,
+                inLineSize, 
+                0,
+                video->height, 
+                out->frame->data, 
+                out->frame->linesize
+            );
+
+            time = ctve_lap(ctx, STATS_CONVERT_OUT, time, 1);
+        }
+
+        /* The input's timestamps, in the encoder's time base; encoders want them increasing. */
+        picture->pts = out->lastPts + 1;
+        if(frame->pts != AV_NOPTS_VALUE)
+            picture->pts = MAX(picture->pts, av_rescale_q(frame->pts, out->timeBase, out->codec->time_base));
+
+        out->lastPts = picture->pts;
+        out->ringPts[ctve_ring_slot(picture->pts)] = picture->pts;
+        out->ringInput[ctve_ring_slot(picture->pts)] = frame->pts;
+
+        ctve_count_frame(out, frame);
+
+        /* encode the image */
+        int ret = avcodec_encode_video2(out->codec, &pkt, picture, &got_output);
+        if (ret < 0) {
+            ctve_fail(ctx, "Error encoding frame");
+            return;
+        }
+
+        time = ctve_lap(ctx, STATS_ENCODE, time, 1);
+
+        if (got_output) {
+            if (out->copied != NULL && (pkt.flags & AV_PKT_FLAG_KEY))
+                ctve_checkpoint(out, &pkt);
+
+            ctve_write_packet(out, &pkt);
+            ctve_lap(ctx, STATS_WRITE, time, 1);
+        }
+    }
+}
+
+/**
+ * Flush the encoder, finish the container and release the output. Returns
+ * the bytes written. Once the run failed, it only finishes the container.
+ */
+static int64_t ctve_close_out_file(ctve_output_t *out)
+{
+    ctve_context_t *ctx = out->ctx;
+    AVPacket pkt;
+    uint64_t time;
+    int64_t size = 0;
+
+    if (out->raw != NULL) {
+        size = rawio_close(out->raw);
+        out->raw = NULL;
+        ctve_free_out_file(out);
+
+        return size;
+    }
+
+    /* get the delayed frames */
+    for (int got_output = !ctve_failed(ctx); got_output; ) {
+        av_init_packet(&pkt);
+        pkt.data = NULL;
+        pkt.size = 0;
+
+        time = ctve_clock(ctx);
+        int ret = avcodec_encode_video2(out->codec, &pkt, NULL, &got_output);
+        if (ret < 0) {
+            ctve_fail(ctx, "Error encoding delayed frames");
+            break;
+        }
+
+        time = ctve_lap(ctx, STATS_ENCODE, time, got_output);
+
+        if (got_output) {
+            ctve_write_packet(out, &pkt);
+            ctve_lap(ctx, STATS_WRITE, time, 1);
+        }
+    }
+
+    /* Index, moov atom or whatever else the container needs at the end. */
+    if (av_write_trailer(out->format) < 0)
+        ctve_fail(ctx, "Could not finish the output");
+
+    if (!(out->format->oformat->flags & AVFMT_NOFILE)) {
+        size = avio_tell(out->format->pb);
+        avio_closep(&out->format->pb);
+    }
+
+    ctve_free_out_file(out);
+
+    return size;
+}
+
+/**
+ * Frames per batch: as asked, or as many as fit every batch in flight in
+ * the memory budget, between 1 and FRAMES_COUNT.
+ */
+static int ctve_batch_frames(ctve_context_t *ctx, ctve_video_t *video, int batches)
+{
+    uint64_t size = ctve_frame_size(video->width, video->height, ctx->options.pixel_type);
+
+    if(ctx->options.batch_frames > 0)
+        return ctx->options.batch_frames;
+
+    if(ctx->options.mem_budget == 0)
+        return FRAMES_COUNT;
+
+    return (int)MAX(1, MIN(FRAMES_COUNT, ctx->options.mem_budget / (batches * size)));
+}
+
+/**
+ * Set up the count frames of a batch, in the configured layout. They get
+ * their buffers as they are filled, see ctve_own_frame(): a decoder's
+ * picture may bring its own. Returns -1, having failed the run, if there
+ * is no memory for them; the batch can still go to ctve_free_video().
+ */
+static int ctve_alloc_batch(ctve_context_t *ctx, ctve_video_t *video, int count)
+{
+    video->frames = (ctve_frame_t*)calloc(count, sizeof(ctve_frame_t));
+    if(video->frames == NULL) {
+        ctve_fail(ctx, "Could not allocate a batch of frames");
+        return -1;
+    }
+
+    video->capacity = count;
+
+    for(int i = 0; i < count; ++i) {
+        /* Init frame. */
+        video->frames[i].width = video->width;
+        video->frames[i].height = video->height;
+        video->frames[i].pixel_type = ctx->options.pixel_type;
+        video->frames[i].counters = &ctx->stats;
+    }
+
+    return 0;
+}
+
+/**
+ * Give the frame a buffer of its own to write to: one if it has none yet,
+ * another if someone still holds on to its own, e.g. a history or the
+ * decoder. The contents are kept when asked. Returns -1, having failed
+ * the run, if there is none.
+ */
+static int ctve_own_frame(ctve_context_t *ctx, ctve_frame_t *frame, int keep)
+{
+    ctve_frame_t own = *frame;
+
+    if(frame->data != NULL && (frame->buf == NULL || av_buffer_is_writable(frame->buf)))
+        return 0;
+
+    if(ctve_frame_alloc(&own) < 0) {
+        ctve_fail(ctx, "Could not allocate frame buffer");
+        return -1;
+    }
+
+    for(int p = 0; keep && frame->data != NULL && p < ctve_frame_planes(frame->pixel_type); ++p) {
+        int len = ctve_frame_plane_width(frame, p);
+
+        for(int i = 0; i < ctve_frame_plane_height(frame, p); ++i)
+            memcpy(ctve_frame_plane(&own, p) + i * ctve_frame_linesize(&own, p), ctve_frame_plane(frame, p) + i * ctve_frame_linesize(frame, p), len);
+
+        ctve_count_copy(frame->counters, len * ctve_frame_plane_height(frame, p));
+    }
+
+    ctve_frame_unref(frame);
+    *frame = own;
+
+    return 0;
+}
+
+/**
+ * A decoded picture that is already a frame: one buffer of ours, laid
+ * out as ctve_get_buffer() does. Returns the rows of its first plane,
+ * 0 if it is not.
+ */
+static int ctve_picture_rows(ctve_frame_t *frame, AVFrame *picture)
+{
+    uint32_t stride = ctve_frame_stride(frame->width, frame->pixel_type);
+    int rows;
+
+    if(frame->pixel_type != YUV420P || picture->format != AV_PIX_FMT_YUV420P ||
+        picture->width != frame->width || picture->height != frame->height ||
+        picture->buf[0] == NULL || picture->buf[1] != NULL || picture->data[0] != picture->buf[0]->data ||
+        (uintptr_t)picture->data[0] % CTVE_FRAME_ALIGN != 0 || picture->linesize[0] != stride ||
+        picture->linesize[1] != stride / 2 || picture->linesize[2] != stride / 2)
+        return 0;
+
+    rows = (picture->data[1] - picture->data[0]) / stride;
+    if(rows < frame->height || picture->data[1] - picture->data[0] != rows * stride ||
+        picture->data[2] - picture->data[1] != (stride / 2) * ((rows + 1) / 2) ||
+        picture->buf[0]->size < ctve_frame_size(frame->width, rows, frame->pixel_type))
+        return 0;
+
+    return rows;
+}
+
+/**
+ * Fill the next frame of a batch from a decoded picture. A picture the
+ * decoder wrote into a buffer of ours, in the frame's layout, becomes the
+ * frame as it is, see ctve_get_buffer(). Otherwise sws_scale() writes
+ * straight into the frame's buffer, or the planes are copied over.
+ */
+static void ctve_fill_frame(ctve_context_t *ctx, ctve_video_t *video, AVFrame *picture, struct SwsContext *sws)
+{
+    /* Access current frame. */
+    ctve_frame_t *frame = &video->frames[video->length];
+    int rows = sws == NULL ? ctve_picture_rows(frame, picture) : 0;
+    uint8_t *data[3];
+    int linesize[3];
+    uint64_t time;
+
+    if(rows > 0) {
+        /* The decoder may still refer to it: ctve_run_algorithm() gets it a copy to write to then. */
+        AVBufferRef *buf = av_buffer_ref(picture->buf[0]);
+
+        if(buf == NULL) {
+            ctve_fail(ctx, "Could not hold on to a decoded picture");
+            return;
+        }
+
+        time = ctve_clock(ctx);
+        ctve_frame_unref(frame);
+
+        frame->buf = buf;
+        frame->data = buf->data;
+        frame->rows = rows;
+        frame->stride = picture->linesize[0];
+        frame->length = ctve_frame_size(frame->width, rows, frame->pixel_type);
+    } else {
+        if(ctve_own_frame(ctx, frame, 0) < 0)
+            return;
+
+        for(int p = 0; p < ctve_frame_planes(frame->pixel_type); ++p) {
+            data[p] = ctve_frame_plane(frame, p);
+            linesize[p] = ctve_frame_linesize(frame, p);
+        }
+
+        time = ctve_clock(ctx);
+
+        if(sws != NULL) {
+            /* Resized on the way, when asked: the slice is the whole picture. */
+            sws_scale(
+                sws,
+                (uint8_t const * const *)picture->data,
+                picture->linesize,
+                0,
+                picture->height,
+                data,
+                linesize
+            );
+        } else {
+            /* Decoded into the decoder's own buffers: copy them over, plane by plane. */
+            for(int p = 0; p < ctve_frame_planes(frame->pixel_type); ++p) {
+                int len = ctve_frame_plane_width(frame, p);
+
+                for(int i = 0; i < ctve_frame_plane_height(frame, p); ++i)
+                    memcpy(data[p] + i * linesize[p], picture->data[p] + i * picture->linesize[p], len);
+
+                ctve_count_copy(frame->counters, len * ctve_frame_plane_height(frame, p));
+            }
+        }
+    }
+
+    frame->decoded = ctve_lap(ctx, STATS_CONVERT_IN, time, 1);
+    frame->pts = av_frame_get_best_effort_timestamp(picture);
+    frame->time = frame->pts != AV_NOPTS_VALUE ? (frame->pts - ctx->videoStart) * av_q2d(ctx->videoTimeBase) : -1;
+
+    /* Increment the number of frames.*/
+    video->length++;
+    __sync_fetch_and_add(&ctx->statsDecoded, 1);
+}
+
+/* Run the algorithm on a batch. */
+static void ctve_run_algorithm(ctve_context_t *ctx, ctve_video_t *video)
+{
+    uint64_t time = ctve_clock(ctx);
+    ctve_video_t range = *video;
+
+    /* Only the frames in the range, they follow each other in a batch. */
+    while(range.length > 0 && ctx->rangeFrom != AV_NOPTS_VALUE && range.frames[0].pts != AV_NOPTS_VALUE &&
+        range.frames[0].pts < ctx->rangeFrom) {
+        range.frames++;
+        range.length--;
+    }
+
+    while(range.length > 0 && ctx->rangeTo != AV_NOPTS_VALUE && range.frames[range.length - 1].pts != AV_NOPTS_VALUE &&
+        range.frames[range.length - 1].pts >= ctx->rangeTo)
+        range.length--;
+
+    range.capacity = 0;
+
+    /* Effects work in place: pictures the decoder still refers to are copied first. */
+    for(int i = 0; ctx->func != NULL && i < range.length; ++i) {
+        if(ctve_own_frame(ctx, &range.frames[i], 1) < 0)
+            return;
+    }
+
+    if(ctx->func != NULL && range.length > 0)
+        ctx->func(&range, ctx->user);
+
+    ctve_lap(ctx, STATS_EFFECT, time, range.length);
+}
+
+/* A batch going to the main output and every rendition. */
+typedef struct
+{
+    ctve_context_t *ctx;
+    ctve_video_t *video;
+} ctve_write_job_t;
+
+/* Encodes a batch into the main output (task 0) or a rendition. */
+static void ctve_write_task(void *arg, int task)
+{
+    ctve_write_job_t *job = (ctve_write_job_t*)arg;
+
+    ctve_write_out_file(task == 0 ? &job->ctx->output : &job->ctx->renditions[task - 1], job->video);
+}
+
+/**
+ * Write a batch to an output. The main output's frames go to every
+ * rendition too, all encoders at once on the pool: they only read them.
+ */
+static void ctve_write_outputs(ctve_output_t *out, ctve_video_t *video)
+{
+    ctve_context_t *ctx = out->ctx;
+    ctve_write_job_t job = { ctx, video };
+
+    if(out == &ctx->output && ctx->renditionCount > 0)
+        pool_run(pool_get(), 1 + ctx->renditionCount, ctve_write_task, &job);
+    else
+        ctve_write_out_file(out, video);
+}
+
+/* Copy a packet of an audio or subtitle stream to every output that holds the stream. */
+static void ctve_copy_everywhere(ctve_context_t *ctx, AVPacket *packet, AVStream *in)
+{
+    int64_t dts = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+
+    /* Resumed: up to the checkpoint's, it is in the output already. */
+    if(ctx->resume.offset >= 0 && packet->stream_index < ctx->resume.copiedCount &&
+        ctx->resume.copied[packet->stream_index] != AV_NOPTS_VALUE && dts != AV_NOPTS_VALUE &&
+        dts <= ctx->resume.copied[packet->stream_index])
+        return;
+
+    for(int i = 0; i < ctx->renditionCount; ++i) {
+        AVPacket copy;
+
+        /* The muxer takes the reference, every output needs its own. */
+        if(ctve_output_stream(&ctx->renditions[i], packet->stream_index) >= 0 && av_packet_ref(&copy, packet) == 0)
+            ctve_copy_packet(&ctx->renditions[i], &copy, in);
+    }
+
+    /* Raw output has no streams to copy into. */
+    if(ctve_output_stream(&ctx->output, packet->stream_index) >= 0)
+        ctve_copy_packet(&ctx->output, packet, in);
+}
+
+/* Process the frames of a batch, write them out and empty it. */
+static void ctve_process_batch(ctve_output_t *out, ctve_video_t *video)
+{
+    ctve_context_t *ctx = out->ctx;
+
+    /* Process these frames. */
+    ctve_run_algorithm(ctx, video);
+
+    /* Write these frames into output file.*/
+    ctve_write_outputs(out, video);
+
+    /* Reset length for the next batch. */
+    video->length = 0;
+}
+
+static void ctve_save_frame(ctve_output_t *out, ctve_video_t *video, AVFrame *picture, struct SwsContext *sws)
+{
+    ctve_context_t *ctx = out->ctx;
+
+    if(video == NULL || picture == NULL || ctve_failed(ctx))
+        return;
+
+    if(video->frames == NULL) {
+        /* First chunk of frames, one batch per segment in flight. */
+        ctx->stats.batch_frames = ctve_batch_frames(ctx, video, MAX(1, ctx->options.segments));
+        if(ctve_alloc_batch(ctx, video, ctx->stats.batch_frames) < 0)
+            return;
+    }
+
+    ctve_fill_frame(ctx, video, picture, sws);
+
+    /* A full batch goes out right away, it doesn't wait for the next frame. */
+    if(video->length == video->capacity)
+        ctve_process_batch(out, video);
+}
+
+/* Effect stage: runs the algorithm on every batch the decoder hands over. */
+static void *ctve_effect_stage(void *arg)
+{
+    ctve_context_t *ctx = (ctve_context_t*)arg;
+    ctve_video_t *batch;
+
+    while((batch = (ctve_video_t*)queue_pop(ctx->pipeEffect)) != NULL) {
+        ctve_run_algorithm(ctx, batch);
+
+        queue_push(ctx->pipeEncode, batch);
+    }
+
+    /* No more batches: let the encoder finish too. */
+    queue_close(ctx->pipeEncode);
+
+    return NULL;
+}
+
+/* Encode stage: writes batches out and recycles them for the decoder. */
+static void *ctve_encode_stage(void *arg)
+{
+    ctve_context_t *ctx = (ctve_context_t*)arg;
+    ctve_video_t *batch;
+
+    while((batch = (ctve_video_t*)queue_pop(ctx->pipeEncode)) != NULL) {
+        ctve_write_outputs(&ctx->output, batch);
+
+        batch->length = 0;
+        queue_push(ctx->pipeFree, batch);
+    }
+
+    return NULL;
+}
+
+/**
+ * Allocates the batches and starts the effect and encode threads.
+ * The decoder (calling thread) can only run queue_depth batches ahead
+ * of the effect stage, and the effect stage as far ahead of the encoder.
+ */
+static void ctve_pipeline_start(ctve_context_t *ctx, ctve_video_t *video)
+{
+    int count;
+
+    ctx->pipeBatches = 2 * ctx->options.queue_depth + 3;
+    count = ctve_batch_frames(ctx, video, ctx->pipeBatches);
+    ctx->stats.batch_frames = count;
+
+    ctx->pipeFree    = queue_create(ctx->pipeBatches);
+    ctx->pipeEffect  = queue_create(ctx->options.queue_depth);
+    ctx->pipeEncode  = queue_create(ctx->options.queue_depth);
+    ctx->pipeBatch   = NULL;
+
+    /* Short of buffers, the run fails and the decoder stops: every batch still goes around. */
+    for(int i = 0; i < ctx->pipeBatches; ++i) {
+        ctve_video_t *batch = ctve_create_video_empty(video->width, video->height, video->frame_rate);
+
+        if(!ctve_failed(ctx))
+            ctve_alloc_batch(ctx, batch, count);
+        queue_push(ctx->pipeFree, batch);
+    }
+
+    pthread_create(&ctx->pipeEffectThread, NULL, ctve_effect_stage, ctx);
+    pthread_create(&ctx->pipeEncodeThread, NULL, ctve_encode_stage, ctx);
+}
+
+/* Decode stage: fill a free batch and pass it on once it is full. */
+static void ctve_pipeline_save_frame(ctve_context_t *ctx, AVFrame *picture, struct SwsContext *sws)
+{
+    if(ctve_failed(ctx))
+        return;
+
+    if(ctx->pipeBatch == NULL)
+        ctx->pipeBatch = (ctve_video_t*)queue_pop(ctx->pipeFree);
+
+    ctve_fill_frame(ctx, ctx->pipeBatch, picture, sws);
+
+    if(ctx->pipeBatch->length == ctx->pipeBatch->capacity) {
+        queue_push(ctx->pipeEffect, ctx->pipeBatch);
+        ctx->pipeBatch = NULL;
+    }
+}
+
+/* Pass on the trailing partial batch, wait for both stages and clean up. */
+static void ctve_pipeline_finish(ctve_context_t *ctx)
+{
+    if(ctx->pipeBatch != NULL && ctx->pipeBatch->length > 0)
+        queue_push(ctx->pipeEffect, ctx->pipeBatch);
+    else if(ctx->pipeBatch != NULL)
+        queue_push(ctx->pipeFree, ctx->pipeBatch);
+
+    ctx->pipeBatch = NULL;
+
+    queue_close(ctx->pipeEffect);
+    pthread_join(ctx->pipeEffectThread, NULL);
+    pthread_join(ctx->pipeEncodeThread, NULL);
+
+    /* Every batch is back in the free queue now. */
+    for(int i = 0; i < ctx->pipeBatches; ++i)
+        ctve_free_video((ctve_video_t*)queue_pop(ctx->pipeFree));
+
+    queue_free(ctx->pipeFree);
+    queue_free(ctx->pipeEffect);
+    queue_free(ctx->pipeEncode);
+}
+
+/* Hand a decoded picture over, to the pipeline or to the current batch. */
+static void ctve_decoded_frame(ctve_context_t *ctx, ctve_video_t *video, AVFrame *picture, struct SwsContext *sws)
+{
+    int64_t pts = av_frame_get_best_effort_timestamp(picture);
+
+    /* Resumed: frames before the checkpoint's are in the output already. */
+    if(ctx->resume.offset >= 0 && pts != AV_NOPTS_VALUE && pts < ctx->resume.inputPts)
+        return;
+
+    if(ctx->options.pipeline)
+        ctve_pipeline_save_frame(ctx, picture, sws);
+    else
+        ctve_save_frame(&ctx->output, video, picture, sws);
+}
+
+void SaveFrame(AVFrame *pFrame, int width, int height, int iFrame) {
+  FILE *pFile;
+  char szFilename[32];
+  int  y;
+  
+  // Open file
+  sprintf(szFilename, "frame%d.ppm", iFrame);
+  pFile=fopen(szFilename, "wb");
   if(pFile==NULL)
     return;
   
@@ -300,194 +1816,1205 @@ void SaveFrame(AVFrame *pFrame, int width, int height, int iFrame) {
 }
 
 
-void SaveFrame2(uint8_t *data, int width, int height, int iFrame) {
-  FILE *pFile;
-  char szFilename[32];
-  int  y;
-  
-  // Open file
-  sprintf(szFilename, "frame%d.ppm", iFrame);
-  pFile=fopen(szFilename, "wb");
-  if(pFile==NULL)
-    return;
-  
-  // Write header
-  fprintf(pFile, "P6\n%d %d\n255\n", width, height);
-  
-  // Write pixel data
-  for(y=0; y<height; y++)
-    fwrite(data + y * 3 * width, 1, width * 3, pFile);
-  
-  // Close file
-  fclose(pFile);
+void SaveFrame2(uint8_t *data, int width, int height, int iFrame) {
+  FILE *pFile;
+  char szFilename[32];
+  int  y;
+  
+  // Open file
+  sprintf(szFilename, "frame%d.ppm", iFrame);
+  pFile=fopen(szFilename, "wb");
+  if(pFile==NULL)
+    return;
+  
+  // Write header
+  fprintf(pFile, "P6\n%d %d\n255\n", width, height);
+  
+  // Write pixel data
+  for(y=0; y<height; y++)
+    fwrite(data + y * 3 * width, 1, width * 3, pFile);
+  
+  // Close file
+  fclose(pFile);
+}
+
+/* Open a file and find its first video stream. Returns NULL if either fails. */
+static AVFormatContext *ctve_open_input(const char *infile, int *videoStream)
+{
+    AVFormatContext *format = NULL;
+
+    // Open video file
+    if(avformat_open_input(&format, infile, NULL, NULL) != 0)
+        return NULL; // Couldn't open file
+
+    // Retrieve stream information
+    if(avformat_find_stream_info(format, NULL) < 0) {
+        avformat_close_input(&format);
+        return NULL; // Couldn't find stream information
+    }
+
+    // Find the first video stream
+    for(int i = 0; i < format->nb_streams; i++) {
+        if(format->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO) {
+            *videoStream = i;
+            return format;
+        }
+    }
+
+    avformat_close_input(&format);
+
+    return NULL; // Didn't find a video stream
+}
+
+/**
+ * Decoder buffers from the frame pool, laid out like a frame of the batch
+ * with rows to spare for what the decoder writes past the picture: its
+ * pictures then go into the batch as they are, see ctve_fill_frame().
+ * Pictures that get converted, or that the decoder can't write in that
+ * layout, go into the decoder's own buffers.
+ */
+static int ctve_get_buffer(AVCodecContext *codec, AVFrame *picture, int flags)
+{
+    ctve_context_t *ctx = (ctve_context_t*)codec->opaque;
+    int width = picture->width, height = picture->height;
+    int align[AV_NUM_DATA_POINTERS];
+    uint16_t fitWidth, fitHeight;
+    ctve_frame_t frame;
+
+    /* As ctve_open_scaler() sees it; the picture may be the coded size, cropped later. */
+    ctve_fit_size(codec->width, codec->height, ctx->options.width, ctx->options.height, ctx->options.scale, &fitWidth, &fitHeight);
+
+    if(picture->format != AV_PIX_FMT_YUV420P || ctx->options.pixel_type != YUV420P ||
+        fitWidth != codec->width || fitHeight != codec->height)
+        return avcodec_default_get_buffer2(codec, picture, flags);
+
+    memset(&frame, 0, sizeof(frame));
+    frame.width = picture->width;
+    frame.height = picture->height;
+    frame.pixel_type = YUV420P;
+    frame.stride = ctve_frame_stride(frame.width, frame.pixel_type);
+
+    avcodec_align_dimensions2(codec, &width, &height, align);
+    if(frame.stride < width || frame.stride % align[0] != 0 || (frame.stride / 2) % align[1] != 0 || (frame.stride / 2) % align[2] != 0)
+        return avcodec_default_get_buffer2(codec, picture, flags);
+
+    /* The decoder's rows, and some for it to read past the end of the last plane. */
+    frame.rows = height + 2 * ((16 + CTVE_FRAME_ALIGN + frame.stride / 2 - 1) / (frame.stride / 2));
+
+    if(ctve_frame_alloc(&frame) < 0)
+        return AVERROR(ENOMEM);
+
+    picture->buf[0] = frame.buf;
+    for(int p = 0; p < 3; ++p) {
+        picture->data[p] = ctve_frame_plane(&frame, p);
+        picture->linesize[p] = ctve_frame_linesize(&frame, p);
+    }
+    picture->extended_data = picture->data;
+
+    return 0;
+}
+
+/* Open the decoder of the video stream, in the stream's codec context. */
+static AVCodecContext *ctve_open_decoder(ctve_context_t *ctx, AVFormatContext *format, int videoStream)
+{
+    // Get a pointer to the codec context for the video stream
+    AVCodecContext *codecCtx = format->streams[videoStream]->codec;
+
+    // Find the decoder for the video stream
+    AVCodec *codec = avcodec_find_decoder(codecCtx->codec_id);
+    if(codec == NULL) {
+        fprintf(stderr, "Unsupported codec!\n");
+        return NULL; // Codec not found
+    }
+
+    codecCtx->thread_count = ctve_codec_threads(ctx, ctx->options.decode_threads);
+    codecCtx->thread_type = ctx->options.thread_type;
+
+    /* Pictures are ours to keep, in buffers of the frame pool when the decoder takes them. */
+    codecCtx->refcounted_frames = 1;
+    if(codec->capabilities & AV_CODEC_CAP_DR1) {
+        codecCtx->opaque = ctx;
+        codecCtx->get_buffer2 = ctve_get_buffer;
+        /* The frame pool takes its own lock. */
+        codecCtx->thread_safe_callbacks = 1;
+    }
+
+    // Open codec
+    if(avcodec_open2(codecCtx, codec, NULL) < 0)
+        return NULL; // Could not open codec
+
+    return codecCtx;
+}
+
+/**
+ * Converter from the decoder's pictures to the effects' layout and size,
+ * NULL when they match.
+ */
+static struct SwsContext *ctve_open_scaler(ctve_context_t *ctx, AVCodecContext *codecCtx)
+{
+    /* Layout the effects work on; pictures get converted into the frames' own buffers. */
+    enum AVPixelFormat pixFmt = ctve_frame_pix_fmt(ctx->options.pixel_type);
+    uint16_t width, height;
+
+    ctve_fit_size(codecCtx->width, codecCtx->height, ctx->options.width, ctx->options.height, ctx->options.scale, &width, &height);
+
+    /* Decoded planes already in the right layout and size are used as they are. */
+    if(codecCtx->pix_fmt == pixFmt && codecCtx->width == width && codecCtx->height == height)
+        return NULL;
+
+    return sws_getContext(
+        codecCtx->width,
+        codecCtx->height,
+        codecCtx->pix_fmt,
+        width,
+        height,
+        pixFmt,
+        ctx->options.scaler,
+        NULL,
+        NULL,
+        NULL
+    );
+}
+
+/**
+ * A GOP-aligned part of the input: the frames with a pts in [start, end),
+ * both keyframes of the video stream. AV_NOPTS_VALUE leaves a side open.
+ */
+typedef struct
+{
+    ctve_context_t *ctx;
+    const char *infile;
+    /* The segment's encoded video, joined into the output afterwards. */
+    char path[1040];
+    int64_t start;
+    int64_t end;
+    /* Pts of the last decoded picture that had one, see ctve_segment_frame(). */
+    int64_t lastPts;
+    ctve_output_t output;
+    int failed;
+    pthread_t thread;
+} ctve_segment_t;
+
+/* The input read again while segments are joined, for the streams copied through. */
+typedef struct
+{
+    ctve_context_t *ctx;
+    AVFormatContext *format;
+    int videoStream;
+    /**
+     * Smart cut: video packets are copied up to the keyframe at cut[0]
+     * (part 0), dropped (part 1), then copied from the one at cut[1] on
+     * (part 2). Without copyVideo, none are.
+     */
+    int copyVideo;
+    int64_t cut[2];
+    int part;
+    /* Last video dts written, see ctve_mux_video(). */
+    int64_t lastDts;
+    /* First packet not written yet when 1, -1 at the end of the input. */
+    AVPacket next;
+    int pending;
+} ctve_copy_t;
+
+/**
+ * Split the video stream at keyframes into at most count segments of
+ * about as many packets each: starts[0] is AV_NOPTS_VALUE, then the pts
+ * of every segment's keyframe. Reads the packets, decodes nothing.
+ * Returns how many segments there are.
+ */
+static int ctve_find_segments(AVFormatContext *format, int videoStream, int count, int64_t *starts)
+{
+    int64_t *keys = NULL;
+    int64_t *positions = NULL;
+    int64_t total = 0;
+    int keyCount = 0, keySize = 0, segments = 1;
+    AVPacket packet;
+
+    while(av_read_frame(format, &packet) >= 0) {
+        if(packet.stream_index == videoStream) {
+            /* Only keyframes with a pts can tell where a segment starts. */
+            if((packet.flags & AV_PKT_FLAG_KEY) && packet.pts != AV_NOPTS_VALUE) {
+                if(keyCount == keySize) {
+                    keySize = MAX(64, 2 * keySize);
+                    keys = (int64_t*)realloc(keys, keySize * sizeof(int64_t));
+                    positions = (int64_t*)realloc(positions, keySize * sizeof(int64_t));
+                }
+
+                keys[keyCount] = packet.pts;
+                positions[keyCount++] = total;
+            }
+
+            total++;
+        }
+
+        av_free_packet(&packet);
+    }
+
+    starts[0] = AV_NOPTS_VALUE;
+
+    for(int k = 0; k < keyCount && segments < count; ++k) {
+        if(positions[k] >= total * segments / count && (segments == 1 || keys[k] > starts[segments - 1]))
+            starts[segments++] = keys[k];
+    }
+
+    free(keys);
+    free(positions);
+
+    return segments;
+}
+
+/**
+ * Keep the decoded pictures of the segment's own range only. A picture
+ * without a pts goes with the one shown before it, so exactly one
+ * segment keeps it; with none before it, it is left to the first.
+ */
+static void ctve_segment_frame(ctve_segment_t *seg, ctve_video_t *video, AVFrame *picture, struct SwsContext *sws)
+{
+    int64_t pts = av_frame_get_best_effort_timestamp(picture);
+
+    if(pts != AV_NOPTS_VALUE)
+        seg->lastPts = pts;
+    else
+        pts = seg->lastPts;
+
+    if(pts == AV_NOPTS_VALUE && seg->start != AV_NOPTS_VALUE)
+        return;
+
+    if(pts != AV_NOPTS_VALUE && ((seg->start != AV_NOPTS_VALUE && pts < seg->start) ||
+        (seg->end != AV_NOPTS_VALUE && pts >= seg->end)))
+        return;
+
+    ctve_save_frame(&seg->output, video, picture, sws);
+}
+
+/* Segment stage: decode, process and encode one segment into its own file. */
+static void *ctve_segment_stage(void *arg)
+{
+    ctve_segment_t *seg = (ctve_segment_t*)arg;
+    ctve_context_t *ctx = seg->ctx;
+    AVCodecContext *decoder = NULL;
+    AVFrame *picture;
+    AVPacket packet;
+    int videoStream, finished, ended = 0;
+    uint64_t time;
+
+    AVFormatContext *format = ctve_open_input(seg->infile, &videoStream);
+    if(format != NULL)
+        decoder = ctve_open_decoder(ctx, format, videoStream);
+
+    if(decoder == NULL || (seg->start != AV_NOPTS_VALUE &&
+        av_seek_frame(format, videoStream, seg->start, AVSEEK_FLAG_BACKWARD) < 0)) {
+        fprintf(stderr, "Could not open the segment at %lld\n", (long long)seg->start);
+        seg->failed = 1;
+
+        if(decoder != NULL)
+            avcodec_close(decoder);
+        avformat_close_input(&format);
+
+        return NULL;
+    }
+
+    picture = av_frame_alloc();
+    struct SwsContext *sws = ctve_open_scaler(ctx, decoder);
+    /* At the size of the output the segment joins. */
+    ctve_video_t *video = ctve_create_video_empty(ctx->output.codec->width, ctx->output.codec->height, 30);
+
+    if(ctve_open_out_file(ctx, &seg->output, seg->path, format, videoStream, video, &ctx->output, 0, NULL) < 0) {
+        seg->failed = 1;
+
+        ctve_free_video(video);
+        sws_freeContext(sws);
+        av_frame_free(&picture);
+        avcodec_close(decoder);
+        avformat_close_input(&format);
+
+        return NULL;
+    }
+
+    /* Another segment failing stops this one too. */
+    time = ctve_clock(ctx);
+    while(!ctve_failed(ctx) && av_read_frame(format, &packet) >= 0) {
+        int64_t pts = packet.pts != AV_NOPTS_VALUE ? packet.pts : packet.dts;
+
+        if(packet.stream_index != videoStream) {
+            av_free_packet(&packet);
+            continue;
+        }
+
+        __sync_fetch_and_add(&ctx->stats.bytes_read, packet.size);
+        time = ctve_lap(ctx, STATS_READ, time, 1);
+
+        /**
+         * The next segment's keyframe still goes through the decoder: the
+         * leading pictures of an open GOP come after it and refer to it.
+         * The first packet shown after it ends the segment.
+         */
+        if(seg->end != AV_NOPTS_VALUE && pts != AV_NOPTS_VALUE) {
+            if(ended && pts > seg->end) {
+                av_free_packet(&packet);
+                break;
+            }
+
+            if((packet.flags & AV_PKT_FLAG_KEY) && pts >= seg->end)
+                ended = 1;
+        }
+
+        avcodec_decode_video2(decoder, picture, &finished, &packet);
+        time = ctve_lap(ctx, STATS_DECODE, time, 1);
+
+        /* The batch holds on to what it keeps of the picture. */
+        if(finished) {
+            ctve_segment_frame(seg, video, picture, sws);
+            av_frame_unref(picture);
+        }
+
+        av_free_packet(&packet);
+        time = ctve_clock(ctx);
+    }
+
+    /* Frames the decoder still holds on to. */
+    av_init_packet(&packet);
+    packet.data = NULL;
+    packet.size = 0;
+
+    do {
+        avcodec_decode_video2(decoder, picture, &finished, &packet);
+
+        if(finished) {
+            ctve_segment_frame(seg, video, picture, sws);
+            av_frame_unref(picture);
+        }
+    } while(finished && !ctve_failed(ctx));
+
+    if(video->length > 0 && !ctve_failed(ctx))
+        ctve_process_batch(&seg->output, video);
+
+    ctve_close_out_file(&seg->output);
+
+    ctve_free_video(video);
+    sws_freeContext(sws);
+    av_frame_free(&picture);
+    avcodec_close(decoder);
+    avformat_close_input(&format);
+
+    return NULL;
+}
+
+/**
+ * Write the video packet of a copy or of a segment. An encoder starts its
+ * decode timestamps a reordering delay ahead of the first pts, which
+ * overlaps whatever came before: those get nudged after it.
+ */
+static void ctve_mux_video(ctve_copy_t *copy, AVPacket *packet)
+{
+    ctve_context_t *ctx = copy->ctx;
+
+    if(packet->dts != AV_NOPTS_VALUE && copy->lastDts != AV_NOPTS_VALUE && packet->dts <= copy->lastDts) {
+        packet->dts = copy->lastDts + 1;
+
+        if(packet->pts != AV_NOPTS_VALUE && packet->pts < packet->dts)
+            packet->pts = packet->dts;
+    }
+
+    if(packet->dts != AV_NOPTS_VALUE)
+        copy->lastDts = packet->dts;
+
+    packet->stream_index = ctx->output.video->index;
+    packet->pos = -1;
+
+    ctve_mux_packet(&ctx->output, packet, -1, AV_NOPTS_VALUE);
+}
+
+/**
+ * Whether the next video packet of the input gets copied, moving on to
+ * the next part of a smart cut at its keyframes. 0 drops the packet.
+ */
+static int ctve_copy_video(ctve_copy_t *copy, AVPacket *packet)
+{
+    int64_t pts = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+    int key = packet->flags & AV_PKT_FLAG_KEY;
+
+    if(!copy->copyVideo)
+        return 0;
+
+    if(copy->part == 0 && key && pts == copy->cut[0])
+        copy->part = 1;
+
+    if(copy->part == 1 && copy->cut[1] != AV_NOPTS_VALUE && key && pts >= copy->cut[1])
+        copy->part = 2;
+
+    /* Leading pictures of an open GOP at the cut were encoded again. */
+    if(copy->part == 2)
+        return pts == AV_NOPTS_VALUE || pts >= copy->cut[1];
+
+    return copy->part == 0;
+}
+
+/**
+ * Write the packets of the copied streams up to ts, in time base tb, or
+ * all that are left for AV_NOPTS_VALUE. Stops at the first video packet
+ * of a part of the smart cut after part.
+ */
+static void ctve_copy_until(ctve_copy_t *copy, int64_t ts, AVRational tb, int part)
+{
+    ctve_context_t *ctx = copy->ctx;
+
+    while(copy->pending >= 0) {
+        if(copy->pending == 0) {
+            if(av_read_frame(copy->format, &copy->next) < 0) {
+                copy->pending = -1;
+                break;
+            }
+
+            int index = copy->next.stream_index;
+            int copied = index == copy->videoStream ? ctve_copy_video(copy, &copy->next) : ctve_output_stream(&ctx->output, index) >= 0;
+
+            if(!copied) {
+                av_free_packet(&copy->next);
+
+                if(copy->part > part)
+                    break;
+                continue;
+            }
+
+            __sync_fetch_and_add(&ctx->stats.bytes_read, copy->next.size);
+            copy->pending = 1;
+        }
+
+        if(copy->next.stream_index == copy->videoStream && copy->part > part)
+            break;
+
+        AVStream *in = copy->format->streams[copy->next.stream_index];
+        int64_t t = copy->next.dts != AV_NOPTS_VALUE ? copy->next.dts : copy->next.pts;
+
+        if(ts != AV_NOPTS_VALUE && t != AV_NOPTS_VALUE && av_compare_ts(t, in->time_base, ts, tb) > 0)
+            break;
+
+        if(copy->next.stream_index == copy->videoStream) {
+            av_packet_rescale_ts(&copy->next, in->time_base, ctx->output.video->time_base);
+            ctve_mux_video(copy, &copy->next);
+        } else {
+            ctve_copy_packet(&ctx->output, &copy->next, in);
+        }
+
+        copy->pending = 0;
+    }
+}
+
+/* Append the packets of a finished segment to the output's video stream. Returns -1 if it can't be read. */
+static int ctve_join_segment(ctve_segment_t *seg, ctve_copy_t *copy)
+{
+    ctve_context_t *ctx = seg->ctx;
+    AVFormatContext *part = NULL;
+    AVPacket packet;
+
+    /* Our own file: the header has all there is to know. */
+    if(avformat_open_input(&part, seg->path, NULL, NULL) != 0) {
+        ctve_fail(ctx, "Could not read the segment %s", seg->path);
+        return -1;
+    }
+
+    AVRational tb = part->streams[0]->time_base;
+
+    while(av_read_frame(part, &packet) >= 0) {
+        av_packet_rescale_ts(&packet, tb, ctx->output.video->time_base);
+
+        /* Interleave the copied streams as we go. */
+        ctve_copy_until(copy, packet.dts, ctx->output.video->time_base, 1);
+
+        ctve_mux_video(copy, &packet);
+    }
+
+    avformat_close_input(&part);
+
+    return 0;
+}
+
+/* Open the input again to copy its other streams, and its video with copyVideo. */
+static void ctve_copy_open(ctve_context_t *ctx, ctve_copy_t *copy, const char *infile, int copyVideo, int64_t from, int64_t to)
+{
+    copy->ctx = ctx;
+    copy->format = ctve_open_input(infile, &copy->videoStream);
+    copy->pending = copy->format != NULL ? 0 : -1;
+    copy->copyVideo = copyVideo;
+    copy->cut[0] = from;
+    copy->cut[1] = to;
+    copy->part = copyVideo && from != AV_NOPTS_VALUE ? 0 : 1;
+    copy->lastDts = AV_NOPTS_VALUE;
+}
+
+/* Start a segment thread on [start, end), into a file next to the output. */
+static void ctve_segment_start(ctve_context_t *ctx, ctve_segment_t *seg, const char *infile, const char *outfile, int index, int64_t start, int64_t end)
+{
+    seg->ctx = ctx;
+    seg->infile = infile;
+    seg->start = start;
+    seg->end = end;
+    seg->lastPts = AV_NOPTS_VALUE;
+    snprintf(seg->path, sizeof(seg->path), "%s.part%d.nut", outfile, index);
+
+    pthread_create(&seg->thread, NULL, ctve_segment_stage, seg);
 }
 
-ctve_video_t *ctve_load_and_process_video(const char *infile, const char *outfile, cvte_algorithm_func func)
+/**
+ * Wait for a segment, append it to the output and remove its file.
+ * Returns -1 once the run failed, here or anywhere else: the segment is
+ * waited for and its file removed all the same, but not joined.
+ */
+static int ctve_segment_finish(ctve_segment_t *seg, ctve_copy_t *copy)
 {
-    AVFormatContext *pFormatCtx = NULL;
-    int             i, videoStream;
-    AVCodecContext  *pCodecCtx = NULL;
-    AVCodec         *pCodec = NULL;
-    AVFrame         *pFrame = NULL; 
-    AVFrame         *pFrameRGB = NULL;
-    AVPacket        packet;
-    int             frameFinished;
-    int             numBytes;
-    uint8_t         *buffer = NULL;
+    int ret = -1;
 
-    AVDictionary    *optionsDict = NULL;
-    struct SwsContext      *sws_ctx = NULL;
+    pthread_join(seg->thread, NULL);
 
-    // Init process function
-    algorithm_func = func;
+    if(seg->failed)
+        ctve_fail(seg->ctx, "Segment %s failed", seg->path);
 
-    // Register all formats and codecs
-    av_register_all();
+    if(!ctve_failed(seg->ctx))
+        ret = ctve_join_segment(seg, copy);
 
-    // Open video file
-    if(avformat_open_input(&pFormatCtx, infile, NULL, NULL) != 0)
-        return NULL; // Couldn't open file
+    unlink(seg->path);
 
-    // Retrieve stream information
-    if(avformat_find_stream_info(pFormatCtx, NULL) < 0)
-        return NULL; // Couldn't find stream information
+    return ret;
+}
 
-    // Dump information about file onto standard error
-    av_dump_format(pFormatCtx, 0, infile, 0);
+/**
+ * Segmented run: the video is split at keyframes, every segment gets
+ * decoded, processed and encoded with codecs of its own on a thread of
+ * its own, into a file of its own. Segments are then joined in order into
+ * the output, along with the copied streams; only their compressed
+ * packets are read back.
+ */
+static void ctve_process_segments(ctve_context_t *ctx, const char *infile, const char *outfile, AVFormatContext *format, int videoStream, ctve_video_t *video)
+{
+    int64_t *starts = (int64_t*)malloc(ctx->options.segments * sizeof(int64_t));
+    ctve_copy_t copy;
 
-    // Find the first video stream
-    videoStream = -1;
-    for(i = 0; i < pFormatCtx->nb_streams; i++) {
-        if(pFormatCtx->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO) {
-            videoStream = i;
+    int count = ctve_find_segments(format, videoStream, ctx->options.segments, starts);
+    ctve_segment_t *segments = (ctve_segment_t*)calloc(count, sizeof(ctve_segment_t));
+
+    printf("Segments: %d\n", count);
+
+    /* The output's encoder only sets the codec and headers the segments use. */
+    if(ctve_open_out_file(ctx, &ctx->output, outfile, format, videoStream, video, NULL, 0, NULL) < 0) {
+        free(segments);
+        free(starts);
+        return;
+    }
+
+    for(int k = 0; k < count; ++k)
+        ctve_segment_start(ctx, &segments[k], infile, outfile, k, starts[k], k + 1 < count ? starts[k + 1] : AV_NOPTS_VALUE);
+
+    ctve_copy_open(ctx, &copy, infile, 0, AV_NOPTS_VALUE, AV_NOPTS_VALUE);
+
+    /* Segments get joined as soon as they are done, the later ones keep going. */
+    for(int k = 0; k < count; ++k)
+        ctve_segment_finish(&segments[k], &copy);
+
+    if(!ctve_failed(ctx))
+        ctve_copy_until(&copy, AV_NOPTS_VALUE, ctx->output.video->time_base, 2);
+    ctx->stats.bytes_written = ctve_close_out_file(&ctx->output);
+
+    avformat_close_input(&copy.format);
+    free(segments);
+    free(starts);
+}
+
+/* Pts of the video stream, seconds after its start. */
+static int64_t ctve_seconds_pts(AVStream *stream, double seconds)
+{
+    int64_t start = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+
+    return start + llrint(seconds / av_q2d(stream->time_base));
+}
+
+/**
+ * Pts of the video keyframe a seek to ts lands on: at or before ts with
+ * AVSEEK_FLAG_BACKWARD, else the first one at or after ts. AV_NOPTS_VALUE
+ * if there is none or the input can't seek.
+ */
+static int64_t ctve_find_keyframe(AVFormatContext *format, int videoStream, int64_t ts, int flags)
+{
+    int64_t found = AV_NOPTS_VALUE;
+    AVPacket packet;
+
+    if(av_seek_frame(format, videoStream, ts, flags) < 0)
+        return AV_NOPTS_VALUE;
+
+    while(found == AV_NOPTS_VALUE && av_read_frame(format, &packet) >= 0) {
+        if(packet.stream_index == videoStream && (packet.flags & AV_PKT_FLAG_KEY) && packet.pts != AV_NOPTS_VALUE &&
+            ((flags & AVSEEK_FLAG_BACKWARD) || packet.pts >= ts))
+            found = packet.pts;
+
+        av_free_packet(&packet);
+    }
+
+    return found;
+}
+
+/**
+ * Whether an encoder's headers (H.264's SPS and PPS, say) are the very
+ * bytes of the stream's: only then can its packets go where the stream's
+ * did, under the stream's headers.
+ */
+static int ctve_same_headers(const AVCodecContext *codec, const AVCodecParameters *stream)
+{
+    return codec->extradata_size > 0 && codec->extradata_size == stream->extradata_size &&
+        memcmp(codec->extradata, stream->extradata, codec->extradata_size) == 0;
+}
+
+/**
+ * Smart cut: the GOPs overlapping the range go through a segment, the
+ * video before and after it is copied as it is. Returns -1, with nothing
+ * but a header written to be written over, when the encoder, its headers
+ * or the container can't do that.
+ */
+static int ctve_process_range(ctve_context_t *ctx, const char *infile, const char *outfile, AVFormatContext *format, int videoStream, ctve_video_t *video)
+{
+    AVStream *stream = format->streams[videoStream];
+    enum AVCodecID codec_id = stream->codec->codec_id;
+    AVOutputFormat *container = av_guess_format(NULL, outfile, NULL);
+    ctve_segment_t segment;
+    ctve_copy_t copy;
+    int64_t start = AV_NOPTS_VALUE;
+    int64_t end = AV_NOPTS_VALUE;
+
+    /**
+     * Copied and encoded packets share a stream: the encoder must make the
+     * input's codec, at the input's size.
+     */
+    if(video->width != stream->codec->width || video->height != stream->codec->height ||
+        avcodec_find_encoder(codec_id) == NULL || container == NULL || !avformat_query_codec(container, codec_id, FF_COMPLIANCE_NORMAL))
+        return -1;
+
+    /* Failed to open, the run is over: nothing to fall back to. */
+    if(ctve_open_out_file(ctx, &ctx->output, outfile, format, videoStream, video, NULL, 1, NULL) < 0)
+        return 0;
+
+    /**
+     * Encoded and copied packets share the stream's headers, whatever the
+     * encoder is set up like. Checked before the keyframe probes below read
+     * from format, so a fallback still decodes it from the start.
+     */
+    if(!ctve_same_headers(ctx->output.codec, stream->codecpar)) {
+        printf("The encoder's headers differ from the input's\n");
+        ctve_free_out_file(&ctx->output);
+        return -1;
+    }
+
+    if(ctx->rangeFrom != AV_NOPTS_VALUE) {
+        start = ctve_find_keyframe(format, videoStream, ctx->rangeFrom, AVSEEK_FLAG_BACKWARD);
+
+        /* Landed past it: start over from the first frame. */
+        if(start != AV_NOPTS_VALUE && start > ctx->rangeFrom)
+            start = AV_NOPTS_VALUE;
+    }
+
+    if(ctx->rangeTo != AV_NOPTS_VALUE)
+        end = ctve_find_keyframe(format, videoStream, ctx->rangeTo, 0);
+
+    printf("Smart cut: encoding from %s to %s, copying the rest\n",
+        start != AV_NOPTS_VALUE ? "a keyframe" : "the start", end != AV_NOPTS_VALUE ? "a keyframe" : "the end");
+
+    memset(&segment, 0, sizeof(segment));
+    ctve_segment_start(ctx, &segment, infile, outfile, 0, start, end);
+
+    /* Before the range, while the segment runs; then the segment; then the rest. */
+    ctve_copy_open(ctx, &copy, infile, 1, start, end);
+    ctve_copy_until(&copy, AV_NOPTS_VALUE, ctx->output.video->time_base, 0);
+    if(ctve_segment_finish(&segment, &copy) == 0)
+        ctve_copy_until(&copy, AV_NOPTS_VALUE, ctx->output.video->time_base, 2);
+
+    ctx->stats.bytes_written = ctve_close_out_file(&ctx->output);
+    avformat_close_input(&copy.format);
+
+    return 0;
+}
+
+/**
+ * Whether outfile's container can be cut back and written on: a stream
+ * of packets with no header to fix up or index at the end.
+ */
+static int ctve_appendable(const char *outfile)
+{
+    static const char *names[] = { "mpegts", "h264", "hevc", "mpeg1video", "mpeg2video", "m4v" };
+    AVOutputFormat *format = av_guess_format(NULL, outfile, NULL);
+
+    for(int i = 0; format != NULL && i < sizeof(names) / sizeof(names[0]); ++i) {
+        if(strcmp(format->name, names[i]) == 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Read the output's checkpoint into ctx->resume, for an input of that many streams. Returns -1 if there is none. */
+static int ctve_resume_load(ctve_context_t *ctx, int streams)
+{
+    ctve_checkpoint_t *resume = &ctx->resume;
+    FILE *file = fopen(ctx->checkpointPath, "r");
+    long long value, dts;
+    char key[32];
+    int found = 0;
+
+    if(file == NULL)
+        return -1;
+
+    resume->copiedCount = streams;
+    resume->copied = (int64_t*)malloc(streams * sizeof(int64_t));
+    for(int i = 0; i < streams; ++i)
+        resume->copied[i] = AV_NOPTS_VALUE;
+
+    while(fscanf(file, "%31s %lld", key, &value) == 2) {
+        if(strcmp(key, "input_pts") == 0) {
+            resume->inputPts = value;
+            found |= 1;
+        } else if(strcmp(key, "output_offset") == 0) {
+            resume->offset = value;
+            found |= 2;
+        } else if(strcmp(key, "pts") == 0) {
+            resume->lastPts = value;
+            found |= 4;
+        } else if(strcmp(key, "copied") == 0 && fscanf(file, "%lld", &dts) == 1 && value >= 0 && value < streams) {
+            resume->copied[value] = dts;
+        }
+    }
+
+    fclose(file);
+
+    if(found != 7 || resume->offset < 0) {
+        fprintf(stderr, "Checkpoint %s is incomplete, starting over\n", ctx->checkpointPath);
+        resume->offset = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Set up the checkpoints of a single pass, and resume from the output's
+ * one when asked: the input gets seeked to the keyframe before its frame.
+ */
+static void ctve_checkpoint_open(ctve_context_t *ctx, const char *outfile, AVFormatContext *format, int videoStream)
+{
+    ctx->checkpointPath[0] = '\0';
+    ctx->resume.offset = -1;
+
+    if((ctx->options.checkpoint <= 0 && !ctx->options.resume) || ctx->options.raw_out || ctx->options.rendition_count > 0)
+        return;
+
+    if(!ctve_appendable(outfile)) {
+        printf("Checkpoints need an output that can be appended to, such as .ts: not taking any\n");
+        return;
+    }
+
+    snprintf(ctx->checkpointPath, sizeof(ctx->checkpointPath), "%s.ckpt", outfile);
+
+    /* Starting over: a checkpoint left from before doesn't fit the new output. */
+    if(!ctx->options.resume || ctve_resume_load(ctx, format->nb_streams) < 0) {
+        unlink(ctx->checkpointPath);
+        return;
+    }
+
+    printf("Resuming %s at byte %lld\n", outfile, (long long)ctx->resume.offset);
+
+    /* Else decoded from the start, frames before the checkpoint's dropped all the same. */
+    if(av_seek_frame(format, videoStream, ctx->resume.inputPts, AVSEEK_FLAG_BACKWARD) < 0)
+        printf("Can't seek the input, decoding it from the start\n");
+}
+
+/* Done with the checkpoints: once the video is whole its checkpoint goes, a failed run keeps it to resume. */
+static void ctve_checkpoint_close(ctve_context_t *ctx)
+{
+    if(ctx->checkpointPath[0] != '\0' && !ctve_failed(ctx))
+        unlink(ctx->checkpointPath);
+
+    ctx->checkpointPath[0] = '\0';
+    ctx->resume.offset = -1;
+    free(ctx->resume.copied);
+    ctx->resume.copied = NULL;
+    ctx->resume.copiedCount = 0;
+}
+
+/**
+ * Raw input to raw output: frames are read straight into the batches,
+ * pointing into a mapped file when its rows fit, or through one staging
+ * frame when they need converting or scaling. Frame k has pts k, in
+ * frames of the input's rate.
+ */
+static ctve_video_t *ctve_context_run_raw(ctve_context_t *ctx, const char *infile, const char *outfile)
+{
+    uint64_t start = stats_now();
+    uint64_t time;
+    uint16_t width, height;
+    struct SwsContext *sws = NULL;
+    ctve_frame_t staging;
+    int ret = 1;
+
+    rawio_t *in = rawio_open_input(infile, (rawio_format_t)ctx->options.raw_in, ctx->options.raw_width, ctx->options.raw_height, ctx->options.raw_rate);
+    if(in == NULL) {
+        ctve_fail(ctx, "Could not read %s", infile);
+        return NULL;
+    }
+
+    AVRational rate = { in->rateNum, in->rateDen };
+
+    fprintf(stderr, "Raw input %s: %dx%d %s at %d/%d fps%s\n", infile, in->width, in->height,
+        ctve_frame_layout_name(in->pixel_type), in->rateNum, in->rateDen, in->inPlace ? ", frames in place" : "");
+
+    ctve_fit_size(in->width, in->height, ctx->options.width, ctx->options.height, ctx->options.scale, &width, &height);
+    ctve_video_t *video = ctve_create_video_empty(width, height, av_q2d(rate));
+
+    ctx->videoStart = 0;
+    ctx->videoTimeBase = av_inv_q(rate);
+    ctx->rangeFrom = ctx->options.from > 0 ? llrint(ctx->options.from * av_q2d(rate)) : AV_NOPTS_VALUE;
+    ctx->rangeTo = ctx->options.to > 0 ? llrint(ctx->options.to * av_q2d(rate)) : AV_NOPTS_VALUE;
+
+    /* Pictures not in the effects' layout and size are read aside, then converted into the batch. */
+    memset(&staging, 0, sizeof(staging));
+    staging.counters = &ctx->stats;
+
+    if(in->pixel_type != ctx->options.pixel_type || in->width != width || in->height != height) {
+        sws = sws_getContext(in->width, in->height, ctve_frame_pix_fmt(in->pixel_type),
+            width, height, ctve_frame_pix_fmt(ctx->options.pixel_type), ctx->options.scaler, NULL, NULL, NULL);
+
+        if(sws == NULL) {
+            ctve_fail(ctx, "Could not convert the raw input");
+            rawio_close(in);
+            ctve_free_video(video);
+            return NULL;
+        }
+    }
+
+    if(ctve_open_raw_out(ctx, &ctx->output, outfile, video, rate) < 0) {
+        rawio_close(in);
+        sws_freeContext(sws);
+        ctve_free_video(video);
+        return NULL;
+    }
+
+    ctx->stats.batch_frames = ctve_batch_frames(ctx, video, 1);
+    if(ctve_alloc_batch(ctx, video, ctx->stats.batch_frames) < 0)
+        ret = 0;
+
+    time = ctve_clock(ctx);
+    while(ret > 0 && !ctve_failed(ctx)) {
+        ctve_frame_t *frame = &video->frames[video->length];
+
+        ret = rawio_read(in, sws != NULL ? &staging : frame);
+        if(ret < 0)
+            ctve_fail(ctx, "Error reading %s at frame %llu", infile, (unsigned long long)in->frames);
+        if(ret <= 0)
             break;
+
+        time = ctve_lap(ctx, STATS_READ, time, 1);
+
+        if(sws != NULL) {
+            uint8_t *src[3], *dst[3];
+            int srcLinesize[3], dstLinesize[3];
+
+            if(ctve_own_frame(ctx, frame, 0) < 0)
+                break;
+
+            for(int p = 0; p < 3; ++p) {
+                src[p] = p < ctve_frame_planes(staging.pixel_type) ? ctve_frame_plane(&staging, p) : NULL;
+                srcLinesize[p] = p < ctve_frame_planes(staging.pixel_type) ? ctve_frame_linesize(&staging, p) : 0;
+                dst[p] = p < ctve_frame_planes(frame->pixel_type) ? ctve_frame_plane(frame, p) : NULL;
+                dstLinesize[p] = p < ctve_frame_planes(frame->pixel_type) ? ctve_frame_linesize(frame, p) : 0;
+            }
+
+            sws_scale(sws, (uint8_t const * const *)src, srcLinesize, 0, staging.height, dst, dstLinesize);
+            time = ctve_lap(ctx, STATS_CONVERT_IN, time, 1);
+        }
+
+        frame->decoded = time;
+        frame->pts = in->frames - 1;
+        frame->time = frame->pts * av_q2d(ctx->videoTimeBase);
+
+        video->length++;
+        __sync_fetch_and_add(&ctx->statsDecoded, 1);
+
+        /* Written out: the pages they were read from can go. */
+        if(video->length == video->capacity) {
+            ctve_process_batch(&ctx->output, video);
+            rawio_release(in);
         }
+
+        time = ctve_clock(ctx);
     }
 
-    if(videoStream == -1)
-        return NULL; // Didn't find a video stream
+    if(video->length > 0 && !ctve_failed(ctx))
+        ctve_process_batch(&ctx->output, video);
 
-    // Get a pointer to the codec context for the video stream
-    pCodecCtx = pFormatCtx->streams[videoStream]->codec;
+    ctx->stats.bytes_written = ctve_close_out_file(&ctx->output);
+    ctx->stats.bytes_read = rawio_close(in);
+    ctx->stats.seconds = (stats_now() - start) / 1e9;
 
-    // Find the decoder for the video stream
-    pCodec = avcodec_find_decoder(pCodecCtx->codec_id);
-    if(pCodec == NULL) {
-        fprintf(stderr, "Unsupported codec!\n");
-        return NULL; // Codec not found
+    /* Frames may still point into the map, which is gone. */
+    for(int i = 0; i < video->capacity; ++i) {
+        if(video->frames[i].buf == NULL)
+            video->frames[i].data = NULL;
     }
 
-    // Open codec
-    if(avcodec_open2(pCodecCtx, pCodec, &optionsDict) < 0)
-        return NULL; // Could not open codec
+    ctve_frame_unref(&staging);
+    sws_freeContext(sws);
+
+    if(ctve_failed(ctx)) {
+        ctve_free_video(video);
+        return NULL;
+    }
+
+    return video;
+}
+
+/**
+ * Whole run: decode the video, process it in batches and encode it into
+ * the output and the renditions, copying the other streams along. On a
+ * failure everything it opened is closed again and the run is failed.
+ */
+static void ctve_process_whole(ctve_context_t *ctx, const char *outfile, AVFormatContext *pFormatCtx, int videoStream, ctve_video_t *video)
+{
+    int             i, opened;
+    AVCodecContext  *pCodecCtx = NULL;
+    AVFrame         *pFrame = NULL; 
+    AVPacket        packet;
+    int             frameFinished;
+
+    struct SwsContext      *sws_ctx = NULL;
+
+    uint64_t time;
+
+    pCodecCtx = ctve_open_decoder(ctx, pFormatCtx, videoStream);
+    if(pCodecCtx == NULL) {
+        ctve_fail(ctx, "Could not open the decoder");
+        return;
+    }
 
     // Allocate video frame
     pFrame = av_frame_alloc();
+    if(pFrame == NULL) {
+        ctve_fail(ctx, "Could not allocate a picture");
+        avcodec_close(pCodecCtx);
+        return;
+    }
 
-    // Allocate an AVFrame structure
-    pFrameRGB = av_frame_alloc();
-    if(pFrameRGB == NULL)
-        return NULL;
+    sws_ctx = ctve_open_scaler(ctx, pCodecCtx);
 
-    // Determine required buffer size and allocate buffer
-    numBytes = avpicture_get_size(PIX_FMT_RGB24, pCodecCtx->width, pCodecCtx->height);
-    buffer = (uint8_t *)av_malloc(numBytes*sizeof(uint8_t));
-
-    /* Our very own video container. The width/height get initialized when first frame is copied.*/
-    ctve_video_t *video = ctve_create_video_empty(pCodecCtx->width, pCodecCtx->height, 30);
-
-    sws_ctx = sws_getContext(
-        pCodecCtx->width,
-        pCodecCtx->height,
-        pCodecCtx->pix_fmt,
-        pCodecCtx->width,
-        pCodecCtx->height,
-        PIX_FMT_RGB24,
-        SWS_BICUBIC,
-        NULL,
-        NULL,
-        NULL
-    );
+    /* Before the output, which is appended to when resuming. */
+    ctve_checkpoint_open(ctx, outfile, pFormatCtx, videoStream);
+
+    /* Opened up front: copied packets go out as they are read. */
+    if(ctx->options.raw_out) {
+        AVRational rate = av_guess_frame_rate(pFormatCtx, pFormatCtx->streams[videoStream], NULL);
+
+        opened = ctve_open_raw_out(ctx, &ctx->output, outfile, video, rate.num > 0 && rate.den > 0 ? rate : (AVRational){30, 1});
+    } else {
+        opened = ctve_open_out_file(ctx, &ctx->output, outfile, pFormatCtx, videoStream, video, NULL, 0, NULL);
+    }
+
+    ctx->renditionCount = 0;
+    for(i = 0; opened == 0 && i < MIN(ctx->options.rendition_count, CTVE_MAX_RENDITIONS); ++i) {
+        if(ctve_open_out_file(ctx, &ctx->renditions[i], ctx->options.renditions[i].path, pFormatCtx, videoStream, video, NULL, 0, &ctx->options.renditions[i]) < 0)
+            break;
+        ctx->renditions[i].rendition = i + 1;
+        ctx->renditionCount++;
+    }
+
+    /* The ones that did open go, unfinished. */
+    if(ctve_failed(ctx)) {
+        if(opened == 0)
+            ctve_free_out_file(&ctx->output);
+        for(i = 0; i < ctx->renditionCount; ++i)
+            ctve_free_out_file(&ctx->renditions[i]);
+
+        ctx->renditionCount = 0;
+        ctve_checkpoint_close(ctx);
+        sws_freeContext(sws_ctx);
+        av_frame_free(&pFrame);
+        avcodec_close(pCodecCtx);
+
+        return;
+    }
 
-    // Assign appropriate parts of buffer to image planes in pFrameRGB
-    // Note that pFrameRGB is an AVFrame, but AVFrame is a superset
-    // of AVPicture
-    avpicture_fill((AVPicture *)pFrameRGB, buffer, PIX_FMT_RGB24,
-         pCodecCtx->width, pCodecCtx->height);
+    if(ctx->options.pipeline)
+        ctve_pipeline_start(ctx, video);
 
     // Read frames and save first five frames to disk
     i = 0;
-    while(av_read_frame(pFormatCtx, &packet) >= 0) {
+    time = ctve_clock(ctx);
+    while(!ctve_failed(ctx) && av_read_frame(pFormatCtx, &packet) >= 0) {
+        ctx->stats.bytes_read += packet.size;
+        time = ctve_lap(ctx, STATS_READ, time, 1);
+
         // Is this a packet from the video stream?
         if(packet.stream_index==videoStream) {
             // Decode video frame
             avcodec_decode_video2(pCodecCtx, pFrame, &frameFinished, &packet);
-          
+            time = ctve_lap(ctx, STATS_DECODE, time, 1);
+
             // Did we get a video frame? 
             if(frameFinished) {
-                // Convert the image from its native format to RGB
-                sws_scale(
-                    sws_ctx,
-                    (uint8_t const * const *)pFrame->data,
-                    pFrame->linesize,
-                    0,
-                    pCodecCtx->height,
-                    pFrameRGB->data,
-                    pFrameRGB->linesize
-                );
-
-                if(i == 0)
-                    ctve_open_out_file(outfile, pCodecCtx, video, pCodecCtx->codec_id);
-
-                /* Copy frame into video structure.*/
-                ctve_save_frame(video, pFrameRGB->data[0], pFrameRGB->linesize[0]);
-
+                /* Convert the image into the video structure, which holds on to what it keeps of it. */
+                ctve_decoded_frame(ctx, video, pFrame, sws_ctx);
+                av_frame_unref(pFrame);
                 i++;
             }
+        } else {
+            /* Audio and subtitles: straight to the muxers. */
+            ctve_copy_everywhere(ctx, &packet, pFormatCtx->streams[packet.stream_index]);
         }
 
         // Free the packet that was allocated by av_read_frame
         av_free_packet(&packet);
+        time = ctve_clock(ctx);
     }
 
-    // Out file.
-    /* get the delayed frames */
-    for (int got_output = 1; got_output; i++) {
-        fflush(stdout);
+    /* Frames the decoder still holds on to, for reordering or on other threads. */
+    av_init_packet(&packet);
+    packet.data = NULL;
+    packet.size = 0;
 
-        int ret = avcodec_encode_video2(outContext, &outPkt, NULL, &got_output);
-        if (ret < 0) {
-            fprintf(stderr, "Error encoding outFrame2\n");
-            exit(1);
-        }
+    do {
+        avcodec_decode_video2(pCodecCtx, pFrame, &frameFinished, &packet);
 
-        if (got_output) {
-            fwrite(outPkt.data, 1, outPkt.size, outFile);
-            av_packet_unref(&outPkt);
+        if(frameFinished) {
+            ctve_decoded_frame(ctx, video, pFrame, sws_ctx);
+            av_frame_unref(pFrame);
+            i++;
         }
-    }
+    } while(frameFinished && !ctve_failed(ctx));
+
+    /* The last batch may not be full. */
+    if(ctx->options.pipeline)
+        ctve_pipeline_finish(ctx);
+    else if(video->length > 0 && !ctve_failed(ctx))
+        ctve_process_batch(&ctx->output, video);
 
-    /* add sequence end code to have a real MPEG file */
-    fwrite(outEndcode, 1, sizeof(outEndcode), outFile);
-    fclose(outFile);
+    ctx->stats.bytes_written = ctve_close_out_file(&ctx->output);
 
-    avcodec_close(outContext);
-    av_free(outContext);
-    av_freep(&outFrame->data[0]);
-    av_frame_free(&outFrame);
+    for(i = 0; i < ctx->renditionCount; ++i)
+        ctx->stats.bytes_written += ctve_close_out_file(&ctx->renditions[i]);
 
-    // Free the RGB image
-    av_free(buffer);
-    av_free(pFrameRGB);
+    ctx->renditionCount = 0;
+    ctve_checkpoint_close(ctx);
+
+    // Free the conversion context
+    sws_freeContext(sws_ctx);
 
     // Free the YUV frame
     av_free(pFrame);
 
     // Close the codec
     avcodec_close(pCodecCtx);
+}
+
+/* Process a video with a context ready for it, see ctve_context_process(). */
+static ctve_video_t *ctve_context_run(ctve_context_t *ctx, const char *infile, const char *outfile)
+{
+    AVFormatContext *pFormatCtx = NULL;
+    int             videoStream;
+    AVCodecContext  *pCodecCtx = NULL;
+
+    uint64_t start = stats_now();
+
+    if(ctx->options.raw_in)
+        return ctve_context_run_raw(ctx, infile, outfile);
+
+    // Register all formats and codecs
+    pthread_once(&registerOnce, av_register_all);
+
+    // Open video file and find its video stream
+    pFormatCtx = ctve_open_input(infile, &videoStream);
+    if(pFormatCtx == NULL) {
+        ctve_fail(ctx, "Could not open %s", infile);
+        return NULL;
+    }
+
+    // Dump information about file onto standard error
+    av_dump_format(pFormatCtx, 0, infile, 0);
+
+    pCodecCtx = pFormatCtx->streams[videoStream]->codec;
+
+    /* Our very own video container, at the size the effects run at. The frame rate is the input's, see ctve_open_out_file(). */
+    uint16_t width, height;
+
+    ctve_fit_size(pCodecCtx->width, pCodecCtx->height, ctx->options.width, ctx->options.height, ctx->options.scale, &width, &height);
+    ctve_video_t *video = ctve_create_video_empty(width, height, 30);
+
+    ctx->videoStart = pFormatCtx->streams[videoStream]->start_time != AV_NOPTS_VALUE ? pFormatCtx->streams[videoStream]->start_time : 0;
+    ctx->videoTimeBase = pFormatCtx->streams[videoStream]->time_base;
+
+    /* The range, in the video stream's own timestamps. */
+    ctx->rangeFrom = ctx->options.from > 0 ? ctve_seconds_pts(pFormatCtx->streams[videoStream], ctx->options.from) : AV_NOPTS_VALUE;
+    ctx->rangeTo = ctx->options.to > 0 ? ctve_seconds_pts(pFormatCtx->streams[videoStream], ctx->options.to) : AV_NOPTS_VALUE;
+
+    /* The smart cut writes a single output: renditions encode the whole video, raw output has no GOPs. */
+    if((ctx->rangeFrom != AV_NOPTS_VALUE || ctx->rangeTo != AV_NOPTS_VALUE) && ctx->options.rendition_count == 0 && !ctx->options.raw_out) {
+        if(ctve_process_range(ctx, infile, outfile, pFormatCtx, videoStream, video) == 0) {
+            ctx->stats.seconds = (stats_now() - start) / 1e9;
+            avformat_close_input(&pFormatCtx);
+
+            if(ctve_failed(ctx)) {
+                ctve_free_video(video);
+                return NULL;
+            }
+
+            return video;
+        }
+
+        printf("Can't copy this video as it is, encoding all of it\n");
+    }
+
+    if(ctx->options.segments > 1) {
+        ctve_process_segments(ctx, infile, outfile, pFormatCtx, videoStream, video);
+
+        ctx->stats.seconds = (stats_now() - start) / 1e9;
+        avformat_close_input(&pFormatCtx);
+
+        if(ctve_failed(ctx)) {
+            ctve_free_video(video);
+            return NULL;
+        }
+
+        return video;
+    }
+
+    ctve_process_whole(ctx, outfile, pFormatCtx, videoStream, video);
+
+    ctx->stats.seconds = (stats_now() - start) / 1e9;
 
     // Close the video file
     avformat_close_input(&pFormatCtx);
-    
+
+    if(ctve_failed(ctx)) {
+        ctve_free_video(video);
+        return NULL;
+    }
+
     return video;
-}
\ No newline at end of file
+}
+
+ctve_video_t *ctve_context_process(ctve_context_t *ctx, const char *infile, const char *outfile, ctve_process_func func, void *user)
+{
+    // Init process function
+    ctx->func = func;
+    ctx->user = user;
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+    ctx->statsDecoded = 0;
+    ctx->failed = 0;
+    ctx->error[0] = '\0';
+
+    return ctve_context_run(ctx, infile, outfile);
+}
+
+static void ctve_default_func(ctve_video_t *video, void *user)
+{
+    defaultFunc(video);
+}
+
+ctve_video_t *ctve_load_and_process_video(const char *infile, const char *outfile, cvte_algorithm_func func)
+{
+    defaultFunc = func;
+
+    return ctve_context_process(ctve_default_context(), infile, outfile, func != NULL ? ctve_default_func : NULL, NULL);
+}
@@ -9,8 +9,10 @@
 
 #include <math.h>
 #include <ctype.h>
+#include <pthread.h>
 
 #include <libavutil/opt.h>
+#include <libavutil/pixdesc.h>
 #include <libavcodec/avcodec.h>
 #include <libavutil/channel_layout.h>
 #include <libavutil/common.h>
@@ -26,16 +28,32 @@
 #include <libavutil/timestamp.h>
 #include <libswresample/swresample.h>
 
+#include "stats.h"
+
 #define INBUF_SIZE 		4096
+/* Frames per batch, unless the options ask for fewer. */
 #define FRAMES_COUNT	30
 
+/* Frame buffers and the start of every row are aligned to this many bytes. */
+#define CTVE_FRAME_ALIGN	64
+
 /**
- * How many bytes does a pixel have.
+ * How many bytes does a pixel have. Planar layouts don't fit that
+ * scheme and get values of their own; use ctve_frame_size().
  */
 typedef enum 
 {
 	BW = 1,
 	RGB = 3,
+	/* R, G, B and a padding byte: every pixel on 32 bits. */
+	RGBA = 4,
+	/* Planar Y, U, V one after the other; U and V at half size both ways. */
+	YUV420P = 0x100,
+	/**
+	 * Planar G, B and R one after the other, all at full size: a row of
+	 * each channel is contiguous, which suits vector kernels best.
+	 */
+	GBRP = 0x101,
 } ctve_frame_pixel_t;
 
 /**
@@ -48,14 +66,123 @@ typedef struct
 	/* Bytes count.*/
 	uint32_t	 length;
 
+	/* Pooled buffer holding data. */
+	AVBufferRef *buf;
+
 	/* Frame size - in pixels.*/
 	uint16_t width;
 	uint16_t height;
 
-	/* Pixel size. RGB = 3. B/W = 1. */
+	/**
+	 * Bytes from a row of the first plane to the next, padded to
+	 * CTVE_FRAME_ALIGN. YUV420P chroma rows take half as many. Frames
+	 * in a mapped raw input share the layout, not the alignment.
+	 */
+	uint32_t stride;
+
+	/**
+	 * Rows the first plane has room for when more than height, 0 if
+	 * not: a decoder writes a few rows past the picture, and its
+	 * pictures become frames as they are. The planes after it start
+	 * that much further on; ctve_frame_plane() knows where.
+	 */
+	uint16_t rows;
+
+	/* Pixel size. RGB = 3. B/W = 1. Or a planar layout. */
 	ctve_frame_pixel_t pixel_type;
+
+	/* When the frame was decoded, see stats_now(); 0 unless timed. */
+	uint64_t decoded;
+
+	/* Presentation time in the input stream's time base, or AV_NOPTS_VALUE. */
+	int64_t pts;
+	/* Seconds from the start of the input video, or -1 if unknown. */
+	double time;
+
+	/* Counters of the run the frame goes through, see ctve_count_copy(); NULL for none. */
+	struct ctve_stats *counters;
 } ctve_frame_t;
 
+/* Padded row size of the first plane for this width and layout. */
+uint32_t ctve_frame_stride(uint16_t width, ctve_frame_pixel_t pixel_type);
+
+/* Bytes needed by a frame of this size and layout, padding included. */
+uint32_t ctve_frame_size(uint16_t width, uint16_t height, ctve_frame_pixel_t pixel_type);
+
+/* How many planes a layout has: 3 for YUV420P and GBRP, 1 for packed layouts. */
+int ctve_frame_planes(ctve_frame_pixel_t pixel_type);
+
+/* FFmpeg's pixel format of a layout. */
+enum AVPixelFormat ctve_frame_pix_fmt(ctve_frame_pixel_t pixel_type);
+
+/* Short name of a layout ("rgb24", "rgba", "gbrp", "yuv420p" or "gray"). */
+const char *ctve_frame_layout_name(ctve_frame_pixel_t pixel_type);
+
+/**
+ * Start, padded row size (stride) in bytes, bytes of pixels in a row and
+ * height of a plane.
+ */
+uint8_t *ctve_frame_plane(ctve_frame_t *frame, int plane);
+int ctve_frame_linesize(ctve_frame_t *frame, int plane);
+int ctve_frame_plane_width(ctve_frame_t *frame, int plane);
+int ctve_frame_plane_height(ctve_frame_t *frame, int plane);
+
+/**
+ * Point the frame at a free buffer of the frame pool, sized and strided
+ * for its width, height, rows and layout. Buffers are CTVE_FRAME_ALIGN aligned
+ * and come back to the pool when unref'ed, across batches and runs. The
+ * previous data is not released, see ctve_frame_unref(). Returns 0, or
+ * -1 if no buffer could be had.
+ */
+int ctve_frame_alloc(ctve_frame_t *frame);
+
+/* Return the frame's buffer to the pool, data becomes NULL. */
+void ctve_frame_unref(ctve_frame_t *frame);
+
+/**
+ * Counters of a context's last run. Frame data goes from the decoder to
+ * the encoder through the same pooled buffer; bytes_copied adds up
+ * whatever still had to be copied on the way. It and the reuse counters
+ * are counted into the frames' run, so videos going through at once
+ * each have their own.
+ */
+typedef struct ctve_stats
+{
+	uint64_t frames;
+	uint64_t bytes_copied;
+	/* Frames per batch that were used. */
+	uint32_t batch_frames;
+	/* Frames decoded by the time the first one reached the encoder. */
+	uint64_t latency_frames;
+
+	/**
+	 * Frames that took an earlier output as it was, and tiles that did,
+	 * out of the tiles looked at; see reuse.h.
+	 */
+	uint64_t frames_reused;
+	uint64_t tiles_reused;
+	uint64_t tiles_hashed;
+
+	/* With the stats option: time per stage, bytes in and out, wall time. */
+	stats_timer_t stages[STATS_STAGES];
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+	double seconds;
+} ctve_stats_t;
+
+/**
+ * Account for bytes of frame data copied from one buffer to another, in
+ * the counters of a frame's run (a frame's counters field); NULL counts
+ * nowhere. Any thread may call it.
+ */
+void ctve_count_copy(ctve_stats_t *counters, uint64_t bytes);
+
+/* Account for frames and tiles whose processing was skipped, out of tiles looked at, the same way. */
+void ctve_count_reuse(ctve_stats_t *counters, uint64_t frames, uint64_t tiles, uint64_t hashed);
+
+/* Counters of the last ctve_load_and_process_video(). */
+void ctve_get_stats(ctve_stats_t *stats);
+
 void SaveFrame2(uint8_t *data, int width, int height, int iFrame);
 
 /**
@@ -68,6 +195,8 @@ typedef struct
 	ctve_frame_t *frames;
 	/* How many frames are in there. */
 	uint32_t length;
+	/* Frames allocated for the video itself, freed with it; 0 if attached. */
+	uint32_t capacity;
 
 	/* Overall video size.*/
 	uint16_t width;
@@ -83,6 +212,196 @@ typedef struct
  */
 typedef void (*cvte_algorithm_func)(ctve_video_t*);
 
+/**
+ * The same, for ctve_context_process(): user is the pointer the video is
+ * processed with, e.g. the effect's parameters.
+ */
+typedef void (*ctve_process_func)(ctve_video_t *video, void *user);
+
+/**
+ * Everything one video is processed with: options, codecs, outputs,
+ * pipeline threads and stats. Videos with contexts of their own can be
+ * processed at the same time, from threads of their own; they share the
+ * frame buffer pools and the worker pool. See ctve.c.
+ */
+typedef struct ctve_context ctve_context_t;
+
+/* Most renditions one pass writes, see ctve_options_t. */
+#define CTVE_MAX_RENDITIONS 8
+
+/**
+ * One more encoding of the processed frames, to a file of its own. A
+ * side at 0 keeps the aspect ratio, both at 0 keep the frames' size;
+ * sides are rounded to even. bit_rate is in bits per second, 0 for the
+ * input's; preset is NULL for the options' one.
+ */
+typedef struct
+{
+	const char *path;
+	int width;
+	int height;
+	int64_t bit_rate;
+	const char *preset;
+} ctve_rendition_t;
+
+/**
+ * Processing options. Fill with ctve_default_options() and change
+ * what's needed before ctve_set_options().
+ */
+typedef struct
+{
+	/* Run decode, effect and encode on separate threads. */
+	int pipeline;
+	/* How many batches may wait between two pipeline stages. */
+	int queue_depth;
+	/**
+	 * Layout handed to the effects: RGB, RGBA or GBRP, or YUV420P to
+	 * skip both colour conversions when the decoder and encoder already
+	 * use it. Pictures are converted straight into it, and only when the
+	 * decoder's or encoder's format differs; otherwise the decoder writes
+	 * them into the frames' buffers.
+	 */
+	ctve_frame_pixel_t pixel_type;
+	/* Frames per batch, 1 streams frame by frame; 0 picks it from mem_budget. */
+	int batch_frames;
+	/**
+	 * Bytes all batches in flight may take, 0 for FRAMES_COUNT frames a
+	 * batch. Batches shrink down to a single frame to stay under it.
+	 */
+	uint64_t mem_budget;
+	/* Time every stage, see ctve_stats_t. */
+	int stats;
+
+	/* Threads of the decoder and the encoder, 0 lets libavcodec pick one per core. */
+	int decode_threads;
+	int encode_threads;
+	/* FF_THREAD_FRAME and/or FF_THREAD_SLICE, for both codecs. */
+	int thread_type;
+	/* Encoder preset (H.264 only), NULL for the encoder's default. */
+	const char *preset;
+
+	/**
+	 * Split the input at keyframes into this many segments, decoded,
+	 * processed and encoded each on its own thread with its own codecs,
+	 * then joined. 0 or 1 runs a single pass. Each segment starts on a
+	 * fresh frame: the algorithm must not keep state across frames.
+	 */
+	int segments;
+
+	/**
+	 * Seconds of the input the algorithm runs on, from its start; to <= 0
+	 * goes to the end. Only the GOPs around them get decoded and encoded
+	 * again, the others are copied as they are when the encoder and the
+	 * container allow it. 0 and 0 process every frame.
+	 */
+	double from;
+	double to;
+
+	/**
+	 * Size the decoded pictures are scaled to, in the same pass as their
+	 * conversion to the effects' layout, so the effects and the encoder
+	 * work at that size. A side at 0 keeps the input's aspect ratio; both
+	 * at 0 take the input's size times scale, or the input's size when
+	 * scale is 0 too. Sides are rounded to even.
+	 */
+	int width;
+	int height;
+	double scale;
+	/* libswscale algorithm for both conversions, SWS_BICUBIC and the like. */
+	int scaler;
+
+	/**
+	 * Extra outputs of the same frames, e.g. an ABR ladder: the input is
+	 * decoded and processed once, and every batch goes to the main
+	 * output's encoder and to one encoder per rendition, side by side on
+	 * the worker pool. Not with segments.
+	 */
+	const ctve_rendition_t *renditions;
+	int rendition_count;
+
+	/**
+	 * Raw video instead of a container, a rawio_format_t (see rawio.h), 0
+	 * for none; "-" is stdin or stdout. Raw input has no codec to encode
+	 * for, so it goes to raw output, and pipeline does not apply. Its size
+	 * and frame rate (25 if 0) are these unless a YUV4MPEG2 header says.
+	 */
+	int raw_in;
+	int raw_out;
+	int raw_width;
+	int raw_height;
+	double raw_rate;
+
+	/**
+	 * Seconds of video between two checkpoints, 0 for none. One is taken
+	 * at the first encoder keyframe that far past the last (GOPs are then
+	 * closed) into <output>.ckpt: the pts of the input frame the keyframe
+	 * is made of, the output's size before it and the encoder's pts. Only
+	 * for a single pass into an output that can be appended to, such as
+	 * MPEG-TS. The file goes away once the video is done.
+	 */
+	double checkpoint;
+	/**
+	 * Pick up from the output's checkpoint, if there is one: the output is
+	 * cut back to it and appended to, and the input seeked to its frame,
+	 * so at most a GOP gets processed again. The algorithm starts on a
+	 * fresh frame there, as with segments.
+	 */
+	int resume;
+
+	/**
+	 * Pixel format of the encoders, AV_PIX_FMT_NONE for YUV420P. Frames
+	 * already in it, e.g. in the YUV420P layout, go in without a
+	 * conversion. An encoder that doesn't take it fails to open.
+	 */
+	enum AVPixelFormat encode_pix_fmt;
+} ctve_options_t;
+
+#define CTVE_DEFAULT_OPTIONS { 0, 2, RGB, 0, 0, 0, 0, 0, FF_THREAD_FRAME | FF_THREAD_SLICE, "medium", 0, 0, 0, 0, 0, 0, SWS_BICUBIC, NULL, 0, 0, 0, 0, 0, 0, 0, 0, AV_PIX_FMT_NONE }
+
+/* Fill options with the default values. */
+void ctve_default_options(ctve_options_t *options);
+
+/* Options used by the next ctve_load_and_process_video(). */
+void ctve_set_options(const ctve_options_t *options);
+
+/* Create a context with these options, or the defaults for NULL. */
+ctve_context_t *ctve_context_create(const ctve_options_t *options);
+
+/* Release a context that has no video going through. */
+void ctve_context_free(ctve_context_t *ctx);
+
+/* Options used by the context's next video. */
+void ctve_context_set_options(ctve_context_t *ctx, const ctve_options_t *options);
+
+/**
+ * Process infile into outfile with the context's options, calling func
+ * with user on every batch. Returns the video, for ctve_free_video(), or
+ * NULL if it fails, see ctve_context_error(): the process keeps going.
+ * A context takes one video at a time.
+ */
+ctve_video_t *ctve_context_process(ctve_context_t *ctx, const char *infile, const char *outfile, ctve_process_func func, void *user);
+
+/* Why the context's last video failed, NULL if it didn't. */
+const char *ctve_context_error(ctve_context_t *ctx);
+
+/* Counters of the context's last video. */
+void ctve_context_stats(ctve_context_t *ctx, ctve_stats_t *stats);
+
+/**
+ * Set the codec options of a speed profile: "fast", "balanced" (the
+ * default) or "quality". Returns -1 on an unknown profile.
+ */
+int ctve_options_profile(ctve_options_t *options, const char *profile);
+
+/**
+ * Set the scaler algorithm by name: "point", "fast_bilinear", "bilinear",
+ * "bicubic" (the default), "area" or "lanczos". Returns -1 on an unknown one.
+ */
+int ctve_options_scaler(ctve_options_t *options, const char *name);
+
+/* Set the encoders' pixel format by FFmpeg's name, "yuv444p" say. Returns -1 on an unknown one. */
+int ctve_options_encode_format(ctve_options_t *options, const char *name);
+
 /**
  * Creates an empty frame with a given size.
  * The frame should be free'd with ctve_free_frame().
@@ -90,8 +409,8 @@ typedef void (*cvte_algorithm_func)(ctve_video_t*);
 ctve_frame_t *ctve_create_frame_empty(uint16_t width, uint16_t height, ctve_frame_pixel_t pixel_type);
 
 /**
- * Creates a frame from a given buffer. It copies the buffer (deep copy).
- * The frame should be free'd with ctve_free_frame().
+ * Creates a frame from a given buffer of packed rows. It copies the
+ * buffer (deep copy). The frame should be free'd with ctve_free_frame().
  */
 ctve_frame_t *ctve_create_frame(uint8_t *data, uint16_t width, uint16_t height, ctve_frame_pixel_t pixel_type);
 
@@ -116,13 +435,14 @@ ctve_video_t *ctve_create_video_empty(uint16_t width, uint16_t height, float fra
 ctve_video_t *ctve_create_video(ctve_frame_t* frames, uint32_t len, float frame_rate);
 
 /**
- * Frees up the entire video. First deletes all the frames!
- * All pointers are set to NULL.
+ * Frees up the entire video. First deletes all the frames, and the
+ * frames array too if the video allocated it.
  */
 void ctve_free_video(ctve_video_t *video);
 
 /**
- * Loads a video from file and returns a ctve_vide_t.
+ * Loads a video from file and returns a ctve_vide_t. Runs on a context of
+ * the process, one video at a time: see ctve_context_process().
  */
 ctve_video_t *ctve_load_and_process_video(const char *infile, const char *outfile, cvte_algorithm_func func);
 
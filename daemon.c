@@ -0,0 +1,261 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "daemon.h"
+#include "queue.h"
+#include "stats.h"
+
+/* A client gets this long to send its job. */
+#define DAEMON_READ_SECONDS	5
+
+/* A job that came in, and the connection waiting for its result. */
+typedef struct
+{
+	daemon_job_t job;
+	int fd;
+	uint64_t received;
+} daemon_request_t;
+
+typedef struct
+{
+	int fd;
+	queue_t *requests;
+	/* Connections still sending their job, each on a thread of its own. */
+	int reading;
+} daemon_listener_t;
+
+/* A connection whose job is still being read. */
+typedef struct
+{
+	daemon_listener_t *listener;
+	int fd;
+} daemon_connection_t;
+
+/* A thread running jobs, with the state run keeps for it. */
+typedef struct
+{
+	daemon_listener_t *listener;
+	daemon_run_func run;
+	void *worker;
+} daemon_runner_t;
+
+/* Read up to the end of the line. Returns its length, or -1. */
+static int daemon_read_line(int fd, char *line, int size)
+{
+	int length = 0;
+
+	while(length < size - 1) {
+		ssize_t n = read(fd, line + length, size - 1 - length);
+
+		if(n <= 0)
+			return -1;
+
+		length += n;
+		line[length] = '\0';
+
+		char *end = strchr(line, '\n');
+		if(end != NULL) {
+			*end = '\0';
+			return end - line;
+		}
+	}
+
+	return -1;
+}
+
+/* Split "<input>\t<output>\t<effect>" into a job. Returns -1 if malformed. */
+static int daemon_parse_job(char *line, daemon_job_t *job)
+{
+	char *fields[3];
+	int count = 0;
+
+	for(char *p = line; count < 3; ++count) {
+		fields[count] = p;
+
+		p = strchr(p, '\t');
+		if(p == NULL) {
+			count++;
+			break;
+		}
+
+		*p++ = '\0';
+	}
+
+	if(count != 3 || !*fields[0] || !*fields[1] || !*fields[2])
+		return -1;
+
+	snprintf(job->inFile, sizeof(job->inFile), "%s", fields[0]);
+	snprintf(job->outFile, sizeof(job->outFile), "%s", fields[1]);
+	snprintf(job->effect, sizeof(job->effect), "%s", fields[2]);
+
+	return 0;
+}
+
+static void daemon_reply(int fd, const char *reply)
+{
+	/* A client that went away only loses its answer. */
+	if(write(fd, reply, strlen(reply)) < 0)
+		perror("daemon reply");
+
+	close(fd);
+}
+
+/* Reader: takes one connection's job in and queues it; a slow client only holds up itself. */
+static void *daemon_read(void *arg)
+{
+	daemon_connection_t *connection = (daemon_connection_t*)arg;
+	daemon_listener_t *listener = connection->listener;
+	char line[2 * DAEMON_PATH_MAX + 512];
+	int fd = connection->fd;
+
+	free(connection);
+
+	struct timeval timeout = { DAEMON_READ_SECONDS, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	daemon_request_t *request = (daemon_request_t*)malloc(sizeof(daemon_request_t));
+
+	if(daemon_read_line(fd, line, sizeof(line)) < 0 || daemon_parse_job(line, &request->job) < 0) {
+		daemon_reply(fd, "error malformed job, expected <input>\\t<output>\\t<effect>\n");
+		free(request);
+	} else {
+		request->fd = fd;
+		request->received = stats_now();
+
+		/* Waits while the queue is full. */
+		queue_push(listener->requests, request);
+	}
+
+	__sync_fetch_and_sub(&listener->reading, 1);
+
+	return NULL;
+}
+
+/* Listener: hands every connection to a reader of its own, never waiting on one. */
+static void *daemon_listen(void *arg)
+{
+	daemon_listener_t *listener = (daemon_listener_t*)arg;
+	pthread_attr_t attr;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	for(;;) {
+		int fd = accept(listener->fd, NULL, NULL);
+		if(fd < 0)
+			continue;
+
+		daemon_connection_t *connection = (daemon_connection_t*)malloc(sizeof(daemon_connection_t));
+		pthread_t thread;
+
+		connection->listener = listener;
+		connection->fd = fd;
+
+		/* As many as may wait in the queue, or the client is told to come back. */
+		if(__sync_add_and_fetch(&listener->reading, 1) > DAEMON_QUEUE ||
+			pthread_create(&thread, &attr, daemon_read, connection) != 0) {
+			__sync_fetch_and_sub(&listener->reading, 1);
+			daemon_reply(fd, "error busy, try again later\n");
+			free(connection);
+		}
+	}
+
+	return NULL;
+}
+
+/* Runner: runs the queued jobs, one at a time, with its own worker. */
+static void *daemon_run(void *arg)
+{
+	daemon_runner_t *runner = (daemon_runner_t*)arg;
+
+	for(;;) {
+		daemon_request_t *request = (daemon_request_t*)queue_pop(runner->listener->requests);
+		char reply[512];
+		char error[256] = "";
+		uint64_t frames = 0;
+
+		uint64_t start = stats_now();
+		int ret = runner->run(runner->worker, &request->job, &frames, error, sizeof(error));
+		uint64_t end = stats_now();
+
+		double queued = (start - request->received) / 1e6;
+		double ran = (end - start) / 1e6;
+
+		if(ret == 0)
+			snprintf(reply, sizeof(reply), "ok frames=%llu queued_ms=%.1f run_ms=%.1f fps=%.2f\n",
+				(unsigned long long)frames, queued, ran, ran > 0 ? frames * 1e3 / ran : 0);
+		else
+			snprintf(reply, sizeof(reply), "error %s\n", error);
+
+		printf("Job %s -> %s [%s]: %s", request->job.inFile, request->job.outFile, request->job.effect, reply);
+		fflush(stdout);
+
+		daemon_reply(request->fd, reply);
+		free(request);
+	}
+
+	return NULL;
+}
+
+int daemon_serve(const char *path, void **workers, int count, daemon_run_func run)
+{
+	struct sockaddr_un addr;
+	daemon_listener_t listener;
+	daemon_runner_t *runners;
+	pthread_t thread;
+
+	if(strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long: %s\n", path);
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	listener.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(listener.fd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	unlink(path);
+
+	if(bind(listener.fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listener.fd, DAEMON_QUEUE) < 0) {
+		perror(path);
+		close(listener.fd);
+		return -1;
+	}
+
+	/* Clients hanging up early must not take the server down. */
+	signal(SIGPIPE, SIG_IGN);
+
+	listener.requests = queue_create(DAEMON_QUEUE);
+	listener.reading = 0;
+	pthread_create(&thread, NULL, daemon_listen, &listener);
+
+	printf("Listening on %s, %d job%s at a time\n", path, count, count > 1 ? "s" : "");
+	fflush(stdout);
+
+	/* Every worker but the first on a thread of its own; the calling thread runs the first. */
+	runners = (daemon_runner_t*)malloc(count * sizeof(daemon_runner_t));
+	for(int i = 0; i < count; ++i) {
+		runners[i].listener = &listener;
+		runners[i].run = run;
+		runners[i].worker = workers[i];
+
+		if(i > 0)
+			pthread_create(&thread, NULL, daemon_run, &runners[i]);
+	}
+
+	daemon_run(&runners[0]);
+
+	return 0;
+}
@@ -0,0 +1,48 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <stdint.h>
+
+/**
+ * Job server on a Unix domain socket. A client connects, sends one line
+ *
+ *	<input>\t<output>\t<effect chain>\n
+ *
+ * and gets one line back once the job is done, then the connection closes:
+ *
+ *	ok frames=<n> queued_ms=<ms> run_ms=<ms> fps=<fps>\n
+ *	error <why>\n
+ *
+ * Jobs start in the order they came, several at a time within one
+ * process, each on a worker of its own: the effect threads, frame
+ * buffers and a worker's parsed chains stay warm from one job to the
+ * next. A client that is slow to send its job only holds up itself.
+ */
+
+#define DAEMON_PATH_MAX	1024
+
+/* Jobs waiting to run before the server stops taking more connections. */
+#define DAEMON_QUEUE	64
+
+typedef struct
+{
+	char inFile[DAEMON_PATH_MAX];
+	char outFile[DAEMON_PATH_MAX];
+	char effect[256];
+} daemon_job_t;
+
+/**
+ * Run a job with a worker's state, which no other job uses meanwhile: 0
+ * with the frames written, or -1 with why in error.
+ */
+typedef int (*daemon_run_func)(void *worker, const daemon_job_t *job, uint64_t *frames, char *error, int size);
+
+/**
+ * Listen on path (a stale socket file is replaced) and run up to count
+ * jobs at once with run, each on a thread of its own with one of the
+ * count workers; the calling thread is one of them. Only returns when
+ * the socket can't be set up, with -1.
+ */
+int daemon_serve(const char *path, void **workers, int count, daemon_run_func run);
+
+#endif
@@ -1,57 +1,547 @@
 #include "effects.h"
+#include "effects_simd.h"
+#include "pool.h"
 #include "util.h"
 
-void effects_apply_bw(ctve_frame_t *frame)
+/* Row kernels picked by effects_init(). */
+static const effects_kernels_t *kernels = &effects_kernels_scalar;
+
+/**
+ * Processes rows [from, to) of a frame, chroma rows for YUV420P.
+ * k holds effect parameters, if any.
+ */
+typedef void (*effects_rows_func)(ctve_frame_t *frame, int from, int to, const void *k);
+
+typedef struct
 {
-	if(!frame)
-		return;
+	ctve_frame_t *frame;
+	effects_rows_func rows;
+	const void *k;
+	int bands;
+} effects_job_t;
+
+const float effects_sepia_rgb[9] = {
+	0.393f, 0.769f, 0.189f,
+	0.349f, 0.686f, 0.168f,
+	0.272f, 0.534f, 0.131f,
+};
+
+/* BT.601, limited range, on values centered on (16, 128, 128). */
+static const float rgbFromYuv[9] = {
+	1.164f,  0.000f,  1.596f,
+	1.164f, -0.392f, -0.813f,
+	1.164f,  2.017f,  0.000f,
+};
+
+static const float yuvFromRgb[9] = {
+	 0.257f,  0.504f,  0.098f,
+	-0.148f, -0.291f,  0.439f,
+	 0.439f, -0.368f, -0.071f,
+};
+
+/* Scalar kernels on n-byte packed pixels, the first three bytes R, G and B. */
+static inline void effects_bw_packed(uint8_t *row, int width, int n)
+{
+	for(int j = 0; j < n * width; j += n) {
+		int grayscale = ((row[j] + row[j + 1] + row[j + 2]) * EFFECTS_BW_Q16) >> 16;
+
+		row[j] = grayscale;
+		row[j + 1] = grayscale;
+		row[j + 2] = grayscale;
+	}
+}
+
+static inline void effects_sepia_packed(uint8_t *row, int width, int n)
+{
+	const uint16_t *c = effects_sepia_q16;
+
+	for(int j = 0; j < n * width; j += n) {
+		uint32_t r = row[j] << 7;
+		uint32_t g = row[j + 1] << 7;
+		uint32_t b = row[j + 2] << 7;
+
+		row[j]		= MIN((((r * c[0]) >> 16) + ((g * c[1]) >> 16) + ((b * c[2]) >> 16)) >> 7, 255);
+		row[j + 1]	= MIN((((r * c[3]) >> 16) + ((g * c[4]) >> 16) + ((b * c[5]) >> 16)) >> 7, 255);
+		row[j + 2]	= MIN((((r * c[6]) >> 16) + ((g * c[7]) >> 16) + ((b * c[8]) >> 16)) >> 7, 255);
+	}
+}
+
+static inline void effects_saturation_packed(uint8_t *row, int width, int n, const uint16_t *k)
+{
+	for(int j = 0; j < n * width; j += n) {
+		row[j]		= MIN((((uint32_t)row[j] << 8) * k[0]) >> 23, 255);
+		row[j + 1]	= MIN((((uint32_t)row[j + 1] << 8) * k[1]) >> 23, 255);
+		row[j + 2]	= MIN((((uint32_t)row[j + 2] << 8) * k[2]) >> 23, 255);
+	}
+}
+
+void effects_scalar_bw_row(uint8_t *row, int width)
+{
+	effects_bw_packed(row, width, 3);
+}
+
+void effects_scalar_sepia_row(uint8_t *row, int width)
+{
+	effects_sepia_packed(row, width, 3);
+}
+
+void effects_scalar_saturation_row(uint8_t *row, int width, const uint16_t *k)
+{
+	effects_saturation_packed(row, width, 3, k);
+}
+
+void effects_scalar_bw_planar(uint8_t *r, uint8_t *g, uint8_t *b, int width)
+{
+	for(int j = 0; j < width; ++j) {
+		int grayscale = ((r[j] + g[j] + b[j]) * EFFECTS_BW_Q16) >> 16;
+
+		r[j] = grayscale;
+		g[j] = grayscale;
+		b[j] = grayscale;
+	}
+}
+
+void effects_scalar_sepia_planar(uint8_t *r, uint8_t *g, uint8_t *b, int width)
+{
+	const uint16_t *c = effects_sepia_q16;
+
+	for(int j = 0; j < width; ++j) {
+		uint32_t pr = r[j] << 7;
+		uint32_t pg = g[j] << 7;
+		uint32_t pb = b[j] << 7;
+
+		r[j] = MIN((((pr * c[0]) >> 16) + ((pg * c[1]) >> 16) + ((pb * c[2]) >> 16)) >> 7, 255);
+		g[j] = MIN((((pr * c[3]) >> 16) + ((pg * c[4]) >> 16) + ((pb * c[5]) >> 16)) >> 7, 255);
+		b[j] = MIN((((pr * c[6]) >> 16) + ((pg * c[7]) >> 16) + ((pb * c[8]) >> 16)) >> 7, 255);
+	}
+}
+
+void effects_scalar_saturation_planar(uint8_t *r, uint8_t *g, uint8_t *b, int width, const uint16_t *k)
+{
+	for(int j = 0; j < width; ++j) {
+		r[j] = MIN((((uint32_t)r[j] << 8) * k[0]) >> 23, 255);
+		g[j] = MIN((((uint32_t)g[j] << 8) * k[1]) >> 23, 255);
+		b[j] = MIN((((uint32_t)b[j] << 8) * k[2]) >> 23, 255);
+	}
+}
+
+void effects_scalar_bw_rgba(uint8_t *row, int width)
+{
+	effects_bw_packed(row, width, 4);
+}
+
+void effects_scalar_sepia_rgba(uint8_t *row, int width)
+{
+	effects_sepia_packed(row, width, 4);
+}
+
+void effects_scalar_saturation_rgba(uint8_t *row, int width, const uint16_t *k)
+{
+	effects_saturation_packed(row, width, 4, k);
+}
+
+const effects_kernels_t effects_kernels_scalar = {
+	"scalar", effects_scalar_bw_row, effects_scalar_sepia_row, effects_scalar_saturation_row,
+	effects_scalar_bw_planar, effects_scalar_sepia_planar, effects_scalar_saturation_planar,
+	effects_scalar_bw_rgba, effects_scalar_sepia_rgba, effects_scalar_saturation_rgba
+};
+
+/**
+ * Runs a set of kernels and the scalar reference on the same random rows,
+ * packed, planar and RGBA, every width from 0 to 64 so the vector tails are covered as well.
+ * Returns 0 when all outputs are identical.
+ */
+static int effects_check(const effects_kernels_t *fast)
+{
+	static const uint16_t k[][3] = { { 0, 32768, 65535 }, { 39322, 34406, 16384 } };
+	uint8_t in[4 * 64], ref[4 * 64], out[4 * 64];
+	uint32_t seed = 12345;
+
+	for(int width = 0; width <= 64; ++width) {
+		for(int i = 0; i < 4 * width; ++i) {
+			seed = seed * 1103515245 + 12345;
+			in[i] = seed >> 16;
+		}
+
+		/* Corner values first, where clamping happens. */
+		if(width > 1) {
+			memset(in, 255, 3);
+			memset(in + 3, 0, 3);
+		}
+
+		for(int test = 0; test < 12; ++test) {
+			/* Planar kernels take the same bytes as three planes of width samples. */
+			uint8_t *r0 = ref, *g0 = ref + width, *b0 = ref + 2 * width;
+			uint8_t *r1 = out, *g1 = out + width, *b1 = out + 2 * width;
+
+			memcpy(ref, in, 4 * width);
+			memcpy(out, in, 4 * width);
+
+			if(test == 0) {
+				effects_kernels_scalar.bw(ref, width);
+				fast->bw(out, width);
+			} else if(test == 1) {
+				effects_kernels_scalar.sepia(ref, width);
+				fast->sepia(out, width);
+			} else if(test < 4) {
+				effects_kernels_scalar.saturation(ref, width, k[test - 2]);
+				fast->saturation(out, width, k[test - 2]);
+			} else if(test == 4) {
+				effects_kernels_scalar.bw_planar(r0, g0, b0, width);
+				fast->bw_planar(r1, g1, b1, width);
+			} else if(test == 5) {
+				effects_kernels_scalar.sepia_planar(r0, g0, b0, width);
+				fast->sepia_planar(r1, g1, b1, width);
+			} else if(test < 8) {
+				effects_kernels_scalar.saturation_planar(r0, g0, b0, width, k[test - 6]);
+				fast->saturation_planar(r1, g1, b1, width, k[test - 6]);
+			} else if(test == 8) {
+				effects_kernels_scalar.bw_rgba(ref, width);
+				fast->bw_rgba(out, width);
+			} else if(test == 9) {
+				effects_kernels_scalar.sepia_rgba(ref, width);
+				fast->sepia_rgba(out, width);
+			} else {
+				effects_kernels_scalar.saturation_rgba(ref, width, k[test - 10]);
+				fast->saturation_rgba(out, width, k[test - 10]);
+			}
+
+			if(memcmp(ref, out, 4 * width) != 0)
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+void effects_init(void)
+{
+	kernels = &effects_kernels_scalar;
+
+#if defined(__x86_64__) || defined(__i386__)
+	const effects_kernels_t *fast = NULL;
+
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+		fast = &effects_kernels_avx2;
+	else if(__builtin_cpu_supports("sse2"))
+		fast = &effects_kernels_sse2;
+
+	if(fast != NULL && effects_check(fast) == 0)
+		kernels = fast;
+	else if(fast != NULL)
+		fprintf(stderr, "%s kernels differ from the scalar ones, using scalar\n", fast->name);
+#endif
+}
+
+const char *effects_kernels_name(void)
+{
+	return kernels->name;
+}
+
+void effects_row_bw(uint8_t *row, int width)
+{
+	kernels->bw(row, width);
+}
+
+void effects_row_sepia(uint8_t *row, int width)
+{
+	kernels->sepia(row, width);
+}
+
+void effects_row_saturation(uint8_t *row, int width, const uint16_t *k)
+{
+	kernels->saturation(row, width, k);
+}
+
+void effects_row_bw_rgba(uint8_t *row, int width)
+{
+	kernels->bw_rgba(row, width);
+}
+
+void effects_row_sepia_rgba(uint8_t *row, int width)
+{
+	kernels->sepia_rgba(row, width);
+}
+
+void effects_row_saturation_rgba(uint8_t *row, int width, const uint16_t *k)
+{
+	kernels->saturation_rgba(row, width, k);
+}
 
-	for(int i = 0; i < frame->height; ++i) {
-		for(int j = 0; j < 3 * frame->width; j += 3) {
-			int grayscale = (frame->data[i * 3 * frame->width + j]
-							+ frame->data[i * 3 * frame->width + j + 1]
-							+ frame->data[i * 3 * frame->width + j + 2]) / 3;
+void effects_row_bw_planar(uint8_t *r, uint8_t *g, uint8_t *b, int width)
+{
+	kernels->bw_planar(r, g, b, width);
+}
+
+void effects_row_sepia_planar(uint8_t *r, uint8_t *g, uint8_t *b, int width)
+{
+	kernels->sepia_planar(r, g, b, width);
+}
+
+void effects_row_saturation_planar(uint8_t *r, uint8_t *g, uint8_t *b, int width, const uint16_t *k)
+{
+	kernels->saturation_planar(r, g, b, width, k);
+}
+
+void effects_matrix_mul(const float *a, const float *b, float *out)
+{
+	float m[9];
+
+	for(int i = 0; i < 3; ++i)
+		for(int j = 0; j < 3; ++j)
+			m[3 * i + j] = a[3 * i] * b[j] + a[3 * i + 1] * b[3 + j] + a[3 * i + 2] * b[6 + j];
+
+	memcpy(out, m, sizeof(m));
+}
+
+void effects_yuv_matrix(const float *rgb, float *yuv)
+{
+	effects_matrix_mul(rgb, rgbFromYuv, yuv);
+	effects_matrix_mul(yuvFromRgb, yuv, yuv);
+}
+
+static uint8_t effects_clamp(int v)
+{
+	return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+/* RGB of a YUV sample centered on (16, 128, 128), clamped. Returns 0 if it had to be. */
+static int effects_yuv_rgb(const int *rgbQ12, int l, int cu, int cv, int *rgb)
+{
+	int inside = 1;
+
+	for(int i = 0; i < 3; ++i) {
+		int c = (rgbQ12[3 * i] * l + rgbQ12[3 * i + 1] * cu + rgbQ12[3 * i + 2] * cv + 2048) >> 12;
+
+		inside &= c >= 0 && c <= 255;
+		rgb[i] = effects_clamp(c);
+	}
+
+	return inside;
+}
+
+/**
+ * YUV matrix in Q12 on a band of chroma rows. Luma samples use the chroma
+ * of their 2x2 block, chroma samples the mean luma of it. A block with a
+ * pixel outside the RGB gamut is clamped in RGB, as the RGB kernels do,
+ * and its chroma becomes the mean of the clamped pixels'.
+ */
+static void effects_yuv_rows(ctve_frame_t *frame, int from, int to, const void *k)
+{
+	const int *m = (const int*)k;
+	const int *rgbQ12 = m + 9;
+	const int *yuvQ12 = m + 18;
+	int cw = ctve_frame_plane_width(frame, 1);
+	int ys = ctve_frame_linesize(frame, 0);
+	int cs = ctve_frame_linesize(frame, 1);
+	uint8_t *Y = ctve_frame_plane(frame, 0);
+	uint8_t *U = ctve_frame_plane(frame, 1);
+	uint8_t *V = ctve_frame_plane(frame, 2);
+
+	for(int cy = from; cy < to; ++cy) {
+		int rows = MIN(2, frame->height - 2 * cy);
+		uint8_t *u = U + cy * cs;
+		uint8_t *v = V + cy * cs;
+
+		for(int cx = 0; cx < cw; ++cx) {
+			int cu = u[cx] - 128;
+			int cv = v[cx] - 128;
+			int chroma = m[1] * cu + m[2] * cv + 2048;
+			int cols = MIN(2, frame->width - 2 * cx);
+			int n = rows * cols;
+			int l[4], rgb[3];
+			int sum = 0, inside = 1;
+
+			for(int i = 0; i < n; ++i) {
+				int y = Y[(2 * cy + i / cols) * ys + 2 * cx + i % cols] - 16;
+
+				sum += y;
+				l[i] = (m[0] * y + chroma) >> 12;
+			}
+
+			sum /= n;
+			int nu = (m[3] * sum + m[4] * cu + m[5] * cv + 2048) >> 12;
+			int nv = (m[6] * sum + m[7] * cu + m[8] * cv + 2048) >> 12;
+
+			for(int i = 0; i < n; ++i)
+				inside &= effects_yuv_rgb(rgbQ12, l[i], nu, nv, rgb);
+
+			if(!inside) {
+				int su = 0, sv = 0;
+
+				for(int i = 0; i < n; ++i) {
+					effects_yuv_rgb(rgbQ12, l[i], nu, nv, rgb);
+					l[i] = (yuvQ12[0] * rgb[0] + yuvQ12[1] * rgb[1] + yuvQ12[2] * rgb[2] + 2048) >> 12;
+					su += yuvQ12[3] * rgb[0] + yuvQ12[4] * rgb[1] + yuvQ12[5] * rgb[2];
+					sv += yuvQ12[6] * rgb[0] + yuvQ12[7] * rgb[1] + yuvQ12[8] * rgb[2];
+				}
+
+				nu = (su / n + 2048) >> 12;
+				nv = (sv / n + 2048) >> 12;
+			}
+
+			for(int i = 0; i < n; ++i)
+				Y[(2 * cy + i / cols) * ys + 2 * cx + i % cols] = effects_clamp(l[i] + 16);
+
+			u[cx] = effects_clamp(nu + 128);
+			v[cx] = effects_clamp(nv + 128);
+		}
+	}
+}
+
+static void effects_band(void *arg, int task)
+{
+	effects_job_t *job = (effects_job_t*)arg;
+	int height = job->frame->height;
+
+	/* YUV420P bands are counted in chroma rows. */
+	if(job->frame->pixel_type == YUV420P)
+		height = ctve_frame_plane_height(job->frame, 1);
+
+	job->rows(job->frame, height * task / job->bands, height * (task + 1) / job->bands, job->k);
+}
+
+/* Split the frame into L2-sized row bands and run them on the shared pool. */
+static void effects_run(ctve_frame_t *frame, effects_rows_func rows, const void *k)
+{
+	pool_t *pool = pool_get();
+	int bands = MAX(4 * pool_threads(pool), (int)(frame->length / L2_TILE_BYTES));
+	effects_job_t job = { frame, rows, k, MIN(frame->height, bands) };
 
+	pool_run(pool, job.bands, effects_band, &job);
+}
+
+/* Start of row i of the R, G and B planes of a GBRP frame. */
+static void effects_planar_row(ctve_frame_t *frame, int i, uint8_t **r, uint8_t **g, uint8_t **b)
+{
+	*g = ctve_frame_plane(frame, 0) + i * frame->stride;
+	*b = ctve_frame_plane(frame, 1) + i * frame->stride;
+	*r = ctve_frame_plane(frame, 2) + i * frame->stride;
+}
+
+static void effects_bw_rows(ctve_frame_t *frame, int from, int to, const void *k)
+{
+	uint8_t *r, *g, *b;
+
+	for(int i = from; i < to; ++i) {
+		uint8_t *row = frame->data + i * frame->stride;
 
-			frame->data[i * 3 * frame->width + j] = grayscale;
-			frame->data[i * 3 * frame->width + j + 1] = grayscale;
-			frame->data[i * 3 * frame->width + j + 2] = grayscale;
+		if(frame->pixel_type == GBRP) {
+			effects_planar_row(frame, i, &r, &g, &b);
+			kernels->bw_planar(r, g, b, frame->width);
+		} else if(frame->pixel_type == RGBA) {
+			kernels->bw_rgba(row, frame->width);
+		} else {
+			kernels->bw(row, frame->width);
 		}
 	}
 }
 
+static void effects_sepia_rows(ctve_frame_t *frame, int from, int to, const void *k)
+{
+	uint8_t *r, *g, *b;
+
+	for(int i = from; i < to; ++i) {
+		uint8_t *row = frame->data + i * frame->stride;
+
+		if(frame->pixel_type == GBRP) {
+			effects_planar_row(frame, i, &r, &g, &b);
+			kernels->sepia_planar(r, g, b, frame->width);
+		} else if(frame->pixel_type == RGBA) {
+			kernels->sepia_rgba(row, frame->width);
+		} else {
+			kernels->sepia(row, frame->width);
+		}
+	}
+}
+
+static void effects_saturation_rows(ctve_frame_t *frame, int from, int to, const void *k)
+{
+	uint8_t *r, *g, *b;
+
+	for(int i = from; i < to; ++i) {
+		uint8_t *row = frame->data + i * frame->stride;
+
+		if(frame->pixel_type == GBRP) {
+			effects_planar_row(frame, i, &r, &g, &b);
+			kernels->saturation_planar(r, g, b, frame->width, (const uint16_t*)k);
+		} else if(frame->pixel_type == RGBA) {
+			kernels->saturation_rgba(row, frame->width, (const uint16_t*)k);
+		} else {
+			kernels->saturation(row, frame->width, (const uint16_t*)k);
+		}
+	}
+}
+
+void effects_apply_yuv(ctve_frame_t *frame, const float *yuv)
+{
+	/* The matrix, then the conversions to RGB and back for the gamut clamp, in Q12. */
+	int m[27];
+
+	if(!frame || frame->pixel_type != YUV420P)
+		return;
+
+	for(int i = 0; i < 9; ++i) {
+		m[i] = (int)lrintf(yuv[i] * 4096.f);
+		m[9 + i] = (int)lrintf(rgbFromYuv[i] * 4096.f);
+		m[18 + i] = (int)lrintf(yuvFromRgb[i] * 4096.f);
+	}
+
+	effects_run(frame, effects_yuv_rows, m);
+}
+
+void effects_apply_bw(ctve_frame_t *frame)
+{
+	if(!frame)
+		return;
+
+	if(frame->pixel_type == YUV420P) {
+		/* Grey is the luma plane: neutral chroma is all it takes. Decoded frames may have rows between the planes. */
+		for(int p = 1; p < 3; ++p)
+			memset(ctve_frame_plane(frame, p), 128, ctve_frame_linesize(frame, p) * ctve_frame_plane_height(frame, p));
+		return;
+	}
+
+	effects_run(frame, effects_bw_rows, NULL);
+}
+
 void effects_apply_sepia(ctve_frame_t *frame)
 {
 	if(!frame)
 		return;
 
-	for(int i = 0; i < frame->height; ++i) {
-		for(int j = 0; j < 3 * frame->width; j += 3) {
-			int r = frame->data[i * 3 * frame->width + j];
-			int g = frame->data[i * 3 * frame->width + j + 1];
-			int b = frame->data[i * 3 * frame->width + j + 2];
+	if(frame->pixel_type == YUV420P) {
+		float yuv[9];
 
-			frame->data[i * 3 * frame->width + j] 		= MIN(r * 0.393f + g * 0.769f + b * 0.189, 255);
-			frame->data[i * 3 * frame->width + j + 1] 	= MIN(r * 0.349f + g * 0.686f + b * 0.168, 255);
-			frame->data[i * 3 * frame->width + j + 2] 	= MIN(r * 0.272f + g * 0.534f + b * 0.131, 255);
-		}
+		effects_yuv_matrix(effects_sepia_rgb, yuv);
+		effects_apply_yuv(frame, yuv);
+		return;
 	}
+
+	effects_run(frame, effects_sepia_rows, NULL);
+}
+
+uint16_t effects_q15(float k)
+{
+	return (uint16_t)MAX(0.f, MIN(k * 32768.f + 0.5f, 65535.f));
 }
 
 void effects_saturation(ctve_frame_t *frame, float kR, float kG, float kB)
 {
+	uint16_t k[3] = { effects_q15(kR), effects_q15(kG), effects_q15(kB) };
+
 	if(!frame)
 		return;
 
-	for(int i = 0; i < frame->height; ++i) {
-		for(int j = 0; j < 3 * frame->width; j += 3) {
-			int r = frame->data[i * 3 * frame->width + j];
-			int g = frame->data[i * 3 * frame->width + j + 1];
-			int b = frame->data[i * 3 * frame->width + j + 2];
+	if(frame->pixel_type == YUV420P) {
+		float rgb[9] = { kR, 0, 0, 0, kG, 0, 0, 0, kB };
+		float yuv[9];
 
-			frame->data[i * 3 * frame->width + j] 		= MIN(r * kR, 255);
-			frame->data[i * 3 * frame->width + j + 1] 	= MIN(g * kG, 255);
-			frame->data[i * 3 * frame->width + j + 2] 	= MIN(b * kB, 255);
-		}
+		effects_yuv_matrix(rgb, yuv);
+		effects_apply_yuv(frame, yuv);
+		return;
 	}
+
+	effects_run(frame, effects_saturation_rows, k);
 }
@@ -3,13 +3,70 @@
 
 #include "ctve.h"
 
+/**
+ * Pick the fastest row kernels this CPU supports (AVX2, SSE2 or scalar).
+ * Vector kernels are checked against the scalar ones before being used.
+ */
+void effects_init(void);
+
+/* Name of the kernels in use: "avx2", "sse2" or "scalar". */
+const char *effects_kernels_name(void);
+
+/**
+ * The effects below work on RGB, RGBA, GBRP and YUV420P frames. On
+ * YUV420P, black and white neutralises chroma; sepia and saturation
+ * apply their RGB matrix through effects_yuv_matrix(), clamped to the
+ * RGB gamut like on the other layouts.
+ */
+
 /* Convert frame into black and white. */
 void effects_apply_bw(ctve_frame_t *frame);
 
 /* Sepia filter. */
 void effects_apply_sepia(ctve_frame_t *frame);
 
-/* Color saturation. */
+/* Color saturation. Factors are in range [0..2]. */
 void effects_saturation(ctve_frame_t *frame, float r, float g, float b);
 
+/**
+ * Single-row versions of the effects above, for callers that fuse several
+ * effects into one pass. Saturation factors come from effects_q15().
+ */
+void effects_row_bw(uint8_t *row, int width);
+void effects_row_sepia(uint8_t *row, int width);
+void effects_row_saturation(uint8_t *row, int width, const uint16_t *k);
+
+/* The same on RGBA rows; the padding byte is left as it is. */
+void effects_row_bw_rgba(uint8_t *row, int width);
+void effects_row_sepia_rgba(uint8_t *row, int width);
+void effects_row_saturation_rgba(uint8_t *row, int width, const uint16_t *k);
+
+/* The same on a row of each plane of a GBRP frame. */
+void effects_row_bw_planar(uint8_t *r, uint8_t *g, uint8_t *b, int width);
+void effects_row_sepia_planar(uint8_t *r, uint8_t *g, uint8_t *b, int width);
+void effects_row_saturation_planar(uint8_t *r, uint8_t *g, uint8_t *b, int width, const uint16_t *k);
+
+/* Sepia as a row-major RGB matrix. */
+extern const float effects_sepia_rgb[9];
+
+/* out = a * b, 3x3 row-major; out may alias a or b. */
+void effects_matrix_mul(const float *a, const float *b, float *out);
+
+/**
+ * Express a 3x3 RGB colour matrix as one on YUV values centered on
+ * (16, 128, 128). Such matrices compose, so several colour effects can
+ * be merged into a single pass over a YUV420P frame.
+ */
+void effects_yuv_matrix(const float *rgb, float *yuv);
+
+/**
+ * Apply a matrix from effects_yuv_matrix() on a YUV420P frame. Pixels
+ * it takes out of the RGB gamut are clamped in RGB, once for the whole
+ * matrix.
+ */
+void effects_apply_yuv(ctve_frame_t *frame, const float *yuv);
+
+/* Saturation factor in Q15, clamped to what the kernels can represent (just under 2). */
+uint16_t effects_q15(float k);
+
 #endif
@@ -0,0 +1,569 @@
+#include "effects_simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+#define SSE2 __attribute__((target("sse2")))
+#define AVX2 __attribute__((target("avx2")))
+
+/* Splits 16 packed RGB24 pixels into one register per channel. */
+static inline SSE2 void sse2_load_rgb(const uint8_t *p, __m128i *r, __m128i *g, __m128i *b)
+{
+	__m128i t00 = _mm_loadu_si128((const __m128i*)p);
+	__m128i t01 = _mm_loadu_si128((const __m128i*)(p + 16));
+	__m128i t02 = _mm_loadu_si128((const __m128i*)(p + 32));
+
+	__m128i t10 = _mm_unpacklo_epi8(t00, _mm_unpackhi_epi64(t01, t01));
+	__m128i t11 = _mm_unpacklo_epi8(_mm_unpackhi_epi64(t00, t00), t02);
+	__m128i t12 = _mm_unpacklo_epi8(t01, _mm_unpackhi_epi64(t02, t02));
+
+	__m128i t20 = _mm_unpacklo_epi8(t10, _mm_unpackhi_epi64(t11, t11));
+	__m128i t21 = _mm_unpacklo_epi8(_mm_unpackhi_epi64(t10, t10), t12);
+	__m128i t22 = _mm_unpacklo_epi8(t11, _mm_unpackhi_epi64(t12, t12));
+
+	__m128i t30 = _mm_unpacklo_epi8(t20, _mm_unpackhi_epi64(t21, t21));
+	__m128i t31 = _mm_unpacklo_epi8(_mm_unpackhi_epi64(t20, t20), t22);
+	__m128i t32 = _mm_unpacklo_epi8(t21, _mm_unpackhi_epi64(t22, t22));
+
+	*r = _mm_unpacklo_epi8(t30, _mm_unpackhi_epi64(t31, t31));
+	*g = _mm_unpacklo_epi8(_mm_unpackhi_epi64(t30, t30), t32);
+	*b = _mm_unpacklo_epi8(t31, _mm_unpackhi_epi64(t32, t32));
+}
+
+/* Packs four pixels "r g b 0" into the low 12 bytes of a register. */
+static inline SSE2 __m128i sse2_squeeze(__m128i p)
+{
+	__m128i keep = _mm_set1_epi64x(0x0000000000ffffffLL);
+	__m128i move = _mm_set1_epi64x(0x0000ffffff000000LL);
+	__m128i half = _mm_set_epi32(0, 0, -1, -1);
+
+	/* Two pixels per 64-bit half, then both halves next to each other. */
+	p = _mm_or_si128(_mm_and_si128(p, keep), _mm_and_si128(_mm_srli_epi64(p, 8), move));
+
+	return _mm_or_si128(_mm_and_si128(p, half), _mm_srli_si128(_mm_andnot_si128(half, p), 2));
+}
+
+/* Inverse of sse2_load_rgb(). */
+static inline SSE2 void sse2_store_rgb(uint8_t *p, __m128i r, __m128i g, __m128i b)
+{
+	__m128i z = _mm_setzero_si128();
+	__m128i rg0 = _mm_unpacklo_epi8(r, g);
+	__m128i rg1 = _mm_unpackhi_epi8(r, g);
+	__m128i b0 = _mm_unpacklo_epi8(b, z);
+	__m128i b1 = _mm_unpackhi_epi8(b, z);
+
+	__m128i q0 = sse2_squeeze(_mm_unpacklo_epi16(rg0, b0));
+	__m128i q1 = sse2_squeeze(_mm_unpackhi_epi16(rg0, b0));
+	__m128i q2 = sse2_squeeze(_mm_unpacklo_epi16(rg1, b1));
+	__m128i q3 = sse2_squeeze(_mm_unpackhi_epi16(rg1, b1));
+
+	/* 4 x 12 bytes -> 3 x 16 bytes. */
+	_mm_storeu_si128((__m128i*)p, _mm_or_si128(q0, _mm_slli_si128(q1, 12)));
+	_mm_storeu_si128((__m128i*)(p + 16), _mm_or_si128(_mm_srli_si128(q1, 4), _mm_slli_si128(q2, 8)));
+	_mm_storeu_si128((__m128i*)(p + 32), _mm_or_si128(_mm_srli_si128(q2, 8), _mm_slli_si128(q3, 4)));
+}
+
+static SSE2 void sse2_bw_row(uint8_t *row, int width)
+{
+	__m128i z = _mm_setzero_si128();
+	__m128i k = _mm_set1_epi16(EFFECTS_BW_Q16);
+	int j = 0;
+
+	for(; j + 16 <= width; j += 16) {
+		__m128i r, g, b;
+		sse2_load_rgb(row + 3 * j, &r, &g, &b);
+
+		__m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(r, z), _mm_unpacklo_epi8(g, z)), _mm_unpacklo_epi8(b, z));
+		__m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(r, z), _mm_unpackhi_epi8(g, z)), _mm_unpackhi_epi8(b, z));
+		__m128i gray = _mm_packus_epi16(_mm_mulhi_epu16(lo, k), _mm_mulhi_epu16(hi, k));
+
+		sse2_store_rgb(row + 3 * j, gray, gray, gray);
+	}
+
+	effects_scalar_bw_row(row + 3 * j, width - j);
+}
+
+/* One sepia output channel for 8 pixels widened to 16 bits and shifted left by 7. */
+static inline SSE2 __m128i sse2_sepia_channel(__m128i r, __m128i g, __m128i b, const uint16_t *c)
+{
+	__m128i sum = _mm_adds_epu16(_mm_mulhi_epu16(r, _mm_set1_epi16(c[0])), _mm_mulhi_epu16(g, _mm_set1_epi16(c[1])));
+
+	return _mm_srli_epi16(_mm_adds_epu16(sum, _mm_mulhi_epu16(b, _mm_set1_epi16(c[2]))), 7);
+}
+
+static SSE2 void sse2_sepia_row(uint8_t *row, int width)
+{
+	__m128i z = _mm_setzero_si128();
+	int j = 0;
+
+	for(; j + 16 <= width; j += 16) {
+		__m128i r, g, b;
+		sse2_load_rgb(row + 3 * j, &r, &g, &b);
+
+		__m128i rl = _mm_slli_epi16(_mm_unpacklo_epi8(r, z), 7), rh = _mm_slli_epi16(_mm_unpackhi_epi8(r, z), 7);
+		__m128i gl = _mm_slli_epi16(_mm_unpacklo_epi8(g, z), 7), gh = _mm_slli_epi16(_mm_unpackhi_epi8(g, z), 7);
+		__m128i bl = _mm_slli_epi16(_mm_unpacklo_epi8(b, z), 7), bh = _mm_slli_epi16(_mm_unpackhi_epi8(b, z), 7);
+
+		sse2_store_rgb(row + 3 * j,
+			_mm_packus_epi16(sse2_sepia_channel(rl, gl, bl, effects_sepia_q16), sse2_sepia_channel(rh, gh, bh, effects_sepia_q16)),
+			_mm_packus_epi16(sse2_sepia_channel(rl, gl, bl, effects_sepia_q16 + 3), sse2_sepia_channel(rh, gh, bh, effects_sepia_q16 + 3)),
+			_mm_packus_epi16(sse2_sepia_channel(rl, gl, bl, effects_sepia_q16 + 6), sse2_sepia_channel(rh, gh, bh, effects_sepia_q16 + 6)));
+	}
+
+	effects_scalar_sepia_row(row + 3 * j, width - j);
+}
+
+/* (p << 8) * k >> 16 >> 7 for 16 pixels of one channel, saturated to 255. */
+static inline SSE2 __m128i sse2_scale(__m128i p, __m128i k)
+{
+	__m128i z = _mm_setzero_si128();
+	__m128i lo = _mm_srli_epi16(_mm_mulhi_epu16(_mm_unpacklo_epi8(z, p), k), 7);
+	__m128i hi = _mm_srli_epi16(_mm_mulhi_epu16(_mm_unpackhi_epi8(z, p), k), 7);
+
+	return _mm_packus_epi16(lo, hi);
+}
+
+static SSE2 void sse2_saturation_row(uint8_t *row, int width, const uint16_t *k)
+{
+	__m128i kR = _mm_set1_epi16(k[0]), kG = _mm_set1_epi16(k[1]), kB = _mm_set1_epi16(k[2]);
+	int j = 0;
+
+	for(; j + 16 <= width; j += 16) {
+		__m128i r, g, b;
+		sse2_load_rgb(row + 3 * j, &r, &g, &b);
+		sse2_store_rgb(row + 3 * j, sse2_scale(r, kR), sse2_scale(g, kG), sse2_scale(b, kB));
+	}
+
+	effects_scalar_saturation_row(row + 3 * j, width - j, k);
+}
+
+/* Planar rows need no shuffling: 16 samples of a channel are one load. */
+static SSE2 void sse2_bw_planar(uint8_t *r, uint8_t *g, uint8_t *b, int width)
+{
+	__m128i z = _mm_setzero_si128();
+	__m128i k = _mm_set1_epi16(EFFECTS_BW_Q16);
+	int j = 0;
+
+	for(; j + 16 <= width; j += 16) {
+		__m128i pr = _mm_loadu_si128((const __m128i*)(r + j));
+		__m128i pg = _mm_loadu_si128((const __m128i*)(g + j));
+		__m128i pb = _mm_loadu_si128((const __m128i*)(b + j));
+
+		__m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(pr, z), _mm_unpacklo_epi8(pg, z)), _mm_unpacklo_epi8(pb, z));
+		__m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(pr, z), _mm_unpackhi_epi8(pg, z)), _mm_unpackhi_epi8(pb, z));
+		__m128i gray = _mm_packus_epi16(_mm_mulhi_epu16(lo, k), _mm_mulhi_epu16(hi, k));
+
+		_mm_storeu_si128((__m128i*)(r + j), gray);
+		_mm_storeu_si128((__m128i*)(g + j), gray);
+		_mm_storeu_si128((__m128i*)(b + j), gray);
+	}
+
+	effects_scalar_bw_planar(r + j, g + j, b + j, width - j);
+}
+
+static SSE2 void sse2_sepia_planar(uint8_t *r, uint8_t *g, uint8_t *b, int width)
+{
+	__m128i z = _mm_setzero_si128();
+	int j = 0;
+
+	for(; j + 16 <= width; j += 16) {
+		__m128i pr = _mm_loadu_si128((const __m128i*)(r + j));
+		__m128i pg = _mm_loadu_si128((const __m128i*)(g + j));
+		__m128i pb = _mm_loadu_si128((const __m128i*)(b + j));
+
+		__m128i rl = _mm_slli_epi16(_mm_unpacklo_epi8(pr, z), 7), rh = _mm_slli_epi16(_mm_unpackhi_epi8(pr, z), 7);
+		__m128i gl = _mm_slli_epi16(_mm_unpacklo_epi8(pg, z), 7), gh = _mm_slli_epi16(_mm_unpackhi_epi8(pg, z), 7);
+		__m128i bl = _mm_slli_epi16(_mm_unpacklo_epi8(pb, z), 7), bh = _mm_slli_epi16(_mm_unpackhi_epi8(pb, z), 7);
+
+		_mm_storeu_si128((__m128i*)(r + j),
+			_mm_packus_epi16(sse2_sepia_channel(rl, gl, bl, effects_sepia_q16), sse2_sepia_channel(rh, gh, bh, effects_sepia_q16)));
+		_mm_storeu_si128((__m128i*)(g + j),
+			_mm_packus_epi16(sse2_sepia_channel(rl, gl, bl, effects_sepia_q16 + 3), sse2_sepia_channel(rh, gh, bh, effects_sepia_q16 + 3)));
+		_mm_storeu_si128((__m128i*)(b + j),
+			_mm_packus_epi16(sse2_sepia_channel(rl, gl, bl, effects_sepia_q16 + 6), sse2_sepia_channel(rh, gh, bh, effects_sepia_q16 + 6)));
+	}
+
+	effects_scalar_sepia_planar(r + j, g + j, b + j, width - j);
+}
+
+static SSE2 void sse2_saturation_planar(uint8_t *r, uint8_t *g, uint8_t *b, int width, const uint16_t *k)
+{
+	__m128i kR = _mm_set1_epi16(k[0]), kG = _mm_set1_epi16(k[1]), kB = _mm_set1_epi16(k[2]);
+	int j = 0;
+
+	for(; j + 16 <= width; j += 16) {
+		_mm_storeu_si128((__m128i*)(r + j), sse2_scale(_mm_loadu_si128((const __m128i*)(r + j)), kR));
+		_mm_storeu_si128((__m128i*)(g + j), sse2_scale(_mm_loadu_si128((const __m128i*)(g + j)), kG));
+		_mm_storeu_si128((__m128i*)(b + j), sse2_scale(_mm_loadu_si128((const __m128i*)(b + j)), kB));
+	}
+
+	effects_scalar_saturation_planar(r + j, g + j, b + j, width - j, k);
+}
+
+/* Splits 8 RGBA pixels into 16-bit R, G and B values: a mask and a shift per channel. */
+static inline SSE2 void sse2_load_rgba(const uint8_t *p, __m128i *r, __m128i *g, __m128i *b)
+{
+	__m128i m = _mm_set1_epi32(0xff);
+	__m128i p0 = _mm_loadu_si128((const __m128i*)p);
+	__m128i p1 = _mm_loadu_si128((const __m128i*)(p + 16));
+
+	*r = _mm_packs_epi32(_mm_and_si128(p0, m), _mm_and_si128(p1, m));
+	*g = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 8), m), _mm_and_si128(_mm_srli_epi32(p1, 8), m));
+	*b = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 16), m), _mm_and_si128(_mm_srli_epi32(p1, 16), m));
+}
+
+/* Inverse of sse2_load_rgba() for values up to 511, saturated to 255; the fourth bytes stay. */
+static inline SSE2 void sse2_store_rgba(uint8_t *p, __m128i r, __m128i g, __m128i b)
+{
+	__m128i max = _mm_set1_epi16(255);
+	__m128i keep = _mm_set1_epi32((int)0xff000000);
+	__m128i p0 = _mm_loadu_si128((const __m128i*)p);
+	__m128i p1 = _mm_loadu_si128((const __m128i*)(p + 16));
+	__m128i rg = _mm_or_si128(_mm_min_epi16(r, max), _mm_slli_epi16(_mm_min_epi16(g, max), 8));
+
+	b = _mm_min_epi16(b, max);
+
+	_mm_storeu_si128((__m128i*)p, _mm_or_si128(_mm_and_si128(p0, keep), _mm_unpacklo_epi16(rg, b)));
+	_mm_storeu_si128((__m128i*)(p + 16), _mm_or_si128(_mm_and_si128(p1, keep), _mm_unpackhi_epi16(rg, b)));
+}
+
+static SSE2 void sse2_bw_rgba(uint8_t *row, int width)
+{
+	__m128i k = _mm_set1_epi16(EFFECTS_BW_Q16);
+	int j = 0;
+
+	for(; j + 8 <= width; j += 8) {
+		__m128i r, g, b;
+		sse2_load_rgba(row + 4 * j, &r, &g, &b);
+
+		__m128i gray = _mm_mulhi_epu16(_mm_add_epi16(_mm_add_epi16(r, g), b), k);
+		sse2_store_rgba(row + 4 * j, gray, gray, gray);
+	}
+
+	effects_scalar_bw_rgba(row + 4 * j, width - j);
+}
+
+static SSE2 void sse2_sepia_rgba(uint8_t *row, int width)
+{
+	int j = 0;
+
+	for(; j + 8 <= width; j += 8) {
+		__m128i r, g, b;
+		sse2_load_rgba(row + 4 * j, &r, &g, &b);
+
+		r = _mm_slli_epi16(r, 7);
+		g = _mm_slli_epi16(g, 7);
+		b = _mm_slli_epi16(b, 7);
+
+		sse2_store_rgba(row + 4 * j,
+			sse2_sepia_channel(r, g, b, effects_sepia_q16),
+			sse2_sepia_channel(r, g, b, effects_sepia_q16 + 3),
+			sse2_sepia_channel(r, g, b, effects_sepia_q16 + 6));
+	}
+
+	effects_scalar_sepia_rgba(row + 4 * j, width - j);
+}
+
+static SSE2 void sse2_saturation_rgba(uint8_t *row, int width, const uint16_t *k)
+{
+	__m128i kR = _mm_set1_epi16(k[0]), kG = _mm_set1_epi16(k[1]), kB = _mm_set1_epi16(k[2]);
+	int j = 0;
+
+	for(; j + 8 <= width; j += 8) {
+		__m128i r, g, b;
+		sse2_load_rgba(row + 4 * j, &r, &g, &b);
+
+		sse2_store_rgba(row + 4 * j,
+			_mm_srli_epi16(_mm_mulhi_epu16(_mm_slli_epi16(r, 8), kR), 7),
+			_mm_srli_epi16(_mm_mulhi_epu16(_mm_slli_epi16(g, 8), kG), 7),
+			_mm_srli_epi16(_mm_mulhi_epu16(_mm_slli_epi16(b, 8), kB), 7));
+	}
+
+	effects_scalar_saturation_rgba(row + 4 * j, width - j, k);
+}
+
+const effects_kernels_t effects_kernels_sse2 = {
+	"sse2", sse2_bw_row, sse2_sepia_row, sse2_saturation_row,
+	sse2_bw_planar, sse2_sepia_planar, sse2_saturation_planar,
+	sse2_bw_rgba, sse2_sepia_rgba, sse2_saturation_rgba
+};
+
+/**
+ * AVX2 kernels: channels are split with byte shuffles, 16 pixels are
+ * widened into one 256-bit register per channel and packed back.
+ */
+#define X -1
+static const int8_t avx2_split[3][3][16] = {
+	{ { 0, 3, 6, 9, 12, 15, X, X, X, X, X, X, X, X, X, X },
+	  { X, X, X, X, X, X, 2, 5, 8, 11, 14, X, X, X, X, X },
+	  { X, X, X, X, X, X, X, X, X, X, X, 1, 4, 7, 10, 13 } },
+	{ { 1, 4, 7, 10, 13, X, X, X, X, X, X, X, X, X, X, X },
+	  { X, X, X, X, X, 0, 3, 6, 9, 12, 15, X, X, X, X, X },
+	  { X, X, X, X, X, X, X, X, X, X, X, 2, 5, 8, 11, 14 } },
+	{ { 2, 5, 8, 11, 14, X, X, X, X, X, X, X, X, X, X, X },
+	  { X, X, X, X, X, 1, 4, 7, 10, 13, X, X, X, X, X, X },
+	  { X, X, X, X, X, X, X, X, X, X, 0, 3, 6, 9, 12, 15 } },
+};
+
+static const int8_t avx2_merge[3][3][16] = {
+	{ { 0, X, X, 1, X, X, 2, X, X, 3, X, X, 4, X, X, 5 },
+	  { X, 0, X, X, 1, X, X, 2, X, X, 3, X, X, 4, X, X },
+	  { X, X, 0, X, X, 1, X, X, 2, X, X, 3, X, X, 4, X } },
+	{ { X, X, 6, X, X, 7, X, X, 8, X, X, 9, X, X, 10, X },
+	  { 5, X, X, 6, X, X, 7, X, X, 8, X, X, 9, X, X, 10 },
+	  { X, 5, X, X, 6, X, X, 7, X, X, 8, X, X, 9, X, X } },
+	{ { X, 11, X, X, 12, X, X, 13, X, X, 14, X, X, 15, X, X },
+	  { X, X, 11, X, X, 12, X, X, 13, X, X, 14, X, X, 15, X },
+	  { 10, X, X, 11, X, X, 12, X, X, 13, X, X, 14, X, X, 15 } },
+};
+#undef X
+
+static inline AVX2 __m128i avx2_shuffle3(__m128i a, __m128i b, __m128i c, const int8_t mask[3][16])
+{
+	__m128i ab = _mm_or_si128(_mm_shuffle_epi8(a, _mm_loadu_si128((const __m128i*)mask[0])),
+	                          _mm_shuffle_epi8(b, _mm_loadu_si128((const __m128i*)mask[1])));
+
+	return _mm_or_si128(ab, _mm_shuffle_epi8(c, _mm_loadu_si128((const __m128i*)mask[2])));
+}
+
+/* Loads 16 pixels as three registers of 16-bit channel values. */
+static inline AVX2 void avx2_load_rgb(const uint8_t *p, __m256i *r, __m256i *g, __m256i *b)
+{
+	__m128i a = _mm_loadu_si128((const __m128i*)p);
+	__m128i m = _mm_loadu_si128((const __m128i*)(p + 16));
+	__m128i c = _mm_loadu_si128((const __m128i*)(p + 32));
+
+	*r = _mm256_cvtepu8_epi16(avx2_shuffle3(a, m, c, avx2_split[0]));
+	*g = _mm256_cvtepu8_epi16(avx2_shuffle3(a, m, c, avx2_split[1]));
+	*b = _mm256_cvtepu8_epi16(avx2_shuffle3(a, m, c, avx2_split[2]));
+}
+
+/* Saturates 16 16-bit values to bytes. */
+static inline AVX2 __m128i avx2_pack(__m256i v)
+{
+	return _mm_packus_epi16(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+}
+
+static inline AVX2 void avx2_store_rgb(uint8_t *p, __m256i r, __m256i g, __m256i b)
+{
+	__m128i r8 = avx2_pack(r), g8 = avx2_pack(g), b8 = avx2_pack(b);
+
+	_mm_storeu_si128((__m128i*)p, avx2_shuffle3(r8, g8, b8, avx2_merge[0]));
+	_mm_storeu_si128((__m128i*)(p + 16), avx2_shuffle3(r8, g8, b8, avx2_merge[1]));
+	_mm_storeu_si128((__m128i*)(p + 32), avx2_shuffle3(r8, g8, b8, avx2_merge[2]));
+}
+
+static AVX2 void avx2_bw_row(uint8_t *row, int width)
+{
+	__m256i k = _mm256_set1_epi16(EFFECTS_BW_Q16);
+	int j = 0;
+
+	for(; j + 16 <= width; j += 16) {
+		__m256i r, g, b;
+		avx2_load_rgb(row + 3 * j, &r, &g, &b);
+
+		__m256i gray = _mm256_mulhi_epu16(_mm256_add_epi16(_mm256_add_epi16(r, g), b), k);
+		avx2_store_rgb(row + 3 * j, gray, gray, gray);
+	}
+
+	effects_scalar_bw_row(row + 3 * j, width - j);
+}
+
+static inline AVX2 __m256i avx2_sepia_channel(__m256i r, __m256i g, __m256i b, const uint16_t *c)
+{
+	__m256i sum = _mm256_adds_epu16(_mm256_mulhi_epu16(r, _mm256_set1_epi16(c[0])), _mm256_mulhi_epu16(g, _mm256_set1_epi16(c[1])));
+
+	return _mm256_srli_epi16(_mm256_adds_epu16(sum, _mm256_mulhi_epu16(b, _mm256_set1_epi16(c[2]))), 7);
+}
+
+static AVX2 void avx2_sepia_row(uint8_t *row, int width)
+{
+	int j = 0;
+
+	for(; j + 16 <= width; j += 16) {
+		__m256i r, g, b;
+		avx2_load_rgb(row + 3 * j, &r, &g, &b);
+
+		r = _mm256_slli_epi16(r, 7);
+		g = _mm256_slli_epi16(g, 7);
+		b = _mm256_slli_epi16(b, 7);
+
+		avx2_store_rgb(row + 3 * j,
+			avx2_sepia_channel(r, g, b, effects_sepia_q16),
+			avx2_sepia_channel(r, g, b, effects_sepia_q16 + 3),
+			avx2_sepia_channel(r, g, b, effects_sepia_q16 + 6));
+	}
+
+	effects_scalar_sepia_row(row + 3 * j, width - j);
+}
+
+static AVX2 void avx2_saturation_row(uint8_t *row, int width, const uint16_t *k)
+{
+	__m256i kR = _mm256_set1_epi16(k[0]), kG = _mm256_set1_epi16(k[1]), kB = _mm256_set1_epi16(k[2]);
+	int j = 0;
+
+	for(; j + 16 <= width; j += 16) {
+		__m256i r, g, b;
+		avx2_load_rgb(row + 3 * j, &r, &g, &b);
+
+		avx2_store_rgb(row + 3 * j,
+			_mm256_srli_epi16(_mm256_mulhi_epu16(_mm256_slli_epi16(r, 8), kR), 7),
+			_mm256_srli_epi16(_mm256_mulhi_epu16(_mm256_slli_epi16(g, 8), kG), 7),
+			_mm256_srli_epi16(_mm256_mulhi_epu16(_mm256_slli_epi16(b, 8), kB), 7));
+	}
+
+	effects_scalar_saturation_row(row + 3 * j, width - j, k);
+}
+
+/* 16 samples of a planar channel, widened to 16 bits. */
+static inline AVX2 __m256i avx2_load_plane(const uint8_t *p)
+{
+	return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)p));
+}
+
+static inline AVX2 void avx2_store_plane(uint8_t *p, __m256i v)
+{
+	_mm_storeu_si128((__m128i*)p, avx2_pack(v));
+}
+
+static AVX2 void avx2_bw_planar(uint8_t *r, uint8_t *g, uint8_t *b, int width)
+{
+	__m256i k = _mm256_set1_epi16(EFFECTS_BW_Q16);
+	int j = 0;
+
+	for(; j + 16 <= width; j += 16) {
+		__m256i sum = _mm256_add_epi16(_mm256_add_epi16(avx2_load_plane(r + j), avx2_load_plane(g + j)), avx2_load_plane(b + j));
+		__m256i gray = _mm256_mulhi_epu16(sum, k);
+
+		avx2_store_plane(r + j, gray);
+		avx2_store_plane(g + j, gray);
+		avx2_store_plane(b + j, gray);
+	}
+
+	effects_scalar_bw_planar(r + j, g + j, b + j, width - j);
+}
+
+static AVX2 void avx2_sepia_planar(uint8_t *r, uint8_t *g, uint8_t *b, int width)
+{
+	int j = 0;
+
+	for(; j + 16 <= width; j += 16) {
+		__m256i pr = _mm256_slli_epi16(avx2_load_plane(r + j), 7);
+		__m256i pg = _mm256_slli_epi16(avx2_load_plane(g + j), 7);
+		__m256i pb = _mm256_slli_epi16(avx2_load_plane(b + j), 7);
+
+		avx2_store_plane(r + j, avx2_sepia_channel(pr, pg, pb, effects_sepia_q16));
+		avx2_store_plane(g + j, avx2_sepia_channel(pr, pg, pb, effects_sepia_q16 + 3));
+		avx2_store_plane(b + j, avx2_sepia_channel(pr, pg, pb, effects_sepia_q16 + 6));
+	}
+
+	effects_scalar_sepia_planar(r + j, g + j, b + j, width - j);
+}
+
+static AVX2 void avx2_saturation_planar(uint8_t *r, uint8_t *g, uint8_t *b, int width, const uint16_t *k)
+{
+	__m256i kR = _mm256_set1_epi16(k[0]), kG = _mm256_set1_epi16(k[1]), kB = _mm256_set1_epi16(k[2]);
+	int j = 0;
+
+	for(; j + 16 <= width; j += 16) {
+		avx2_store_plane(r + j, _mm256_srli_epi16(_mm256_mulhi_epu16(_mm256_slli_epi16(avx2_load_plane(r + j), 8), kR), 7));
+		avx2_store_plane(g + j, _mm256_srli_epi16(_mm256_mulhi_epu16(_mm256_slli_epi16(avx2_load_plane(g + j), 8), kG), 7));
+		avx2_store_plane(b + j, _mm256_srli_epi16(_mm256_mulhi_epu16(_mm256_slli_epi16(avx2_load_plane(b + j), 8), kB), 7));
+	}
+
+	effects_scalar_saturation_planar(r + j, g + j, b + j, width - j, k);
+}
+
+/**
+ * 16 RGBA pixels as in sse2_load_rgba(). Packing and unpacking stay
+ * within 128-bit lanes, so pixels come out of avx2_store_rgba() where
+ * they went in, whatever order the registers hold them in between.
+ */
+static inline AVX2 void avx2_load_rgba(const uint8_t *p, __m256i *r, __m256i *g, __m256i *b)
+{
+	__m256i m = _mm256_set1_epi32(0xff);
+	__m256i p0 = _mm256_loadu_si256((const __m256i*)p);
+	__m256i p1 = _mm256_loadu_si256((const __m256i*)(p + 32));
+
+	*r = _mm256_packs_epi32(_mm256_and_si256(p0, m), _mm256_and_si256(p1, m));
+	*g = _mm256_packs_epi32(_mm256_and_si256(_mm256_srli_epi32(p0, 8), m), _mm256_and_si256(_mm256_srli_epi32(p1, 8), m));
+	*b = _mm256_packs_epi32(_mm256_and_si256(_mm256_srli_epi32(p0, 16), m), _mm256_and_si256(_mm256_srli_epi32(p1, 16), m));
+}
+
+static inline AVX2 void avx2_store_rgba(uint8_t *p, __m256i r, __m256i g, __m256i b)
+{
+	__m256i max = _mm256_set1_epi16(255);
+	__m256i keep = _mm256_set1_epi32((int)0xff000000);
+	__m256i p0 = _mm256_loadu_si256((const __m256i*)p);
+	__m256i p1 = _mm256_loadu_si256((const __m256i*)(p + 32));
+	__m256i rg = _mm256_or_si256(_mm256_min_epi16(r, max), _mm256_slli_epi16(_mm256_min_epi16(g, max), 8));
+
+	b = _mm256_min_epi16(b, max);
+
+	_mm256_storeu_si256((__m256i*)p, _mm256_or_si256(_mm256_and_si256(p0, keep), _mm256_unpacklo_epi16(rg, b)));
+	_mm256_storeu_si256((__m256i*)(p + 32), _mm256_or_si256(_mm256_and_si256(p1, keep), _mm256_unpackhi_epi16(rg, b)));
+}
+
+static AVX2 void avx2_bw_rgba(uint8_t *row, int width)
+{
+	__m256i k = _mm256_set1_epi16(EFFECTS_BW_Q16);
+	int j = 0;
+
+	for(; j + 16 <= width; j += 16) {
+		__m256i r, g, b;
+		avx2_load_rgba(row + 4 * j, &r, &g, &b);
+
+		__m256i gray = _mm256_mulhi_epu16(_mm256_add_epi16(_mm256_add_epi16(r, g), b), k);
+		avx2_store_rgba(row + 4 * j, gray, gray, gray);
+	}
+
+	effects_scalar_bw_rgba(row + 4 * j, width - j);
+}
+
+static AVX2 void avx2_sepia_rgba(uint8_t *row, int width)
+{
+	int j = 0;
+
+	for(; j + 16 <= width; j += 16) {
+		__m256i r, g, b;
+		avx2_load_rgba(row + 4 * j, &r, &g, &b);
+
+		r = _mm256_slli_epi16(r, 7);
+		g = _mm256_slli_epi16(g, 7);
+		b = _mm256_slli_epi16(b, 7);
+
+		avx2_store_rgba(row + 4 * j,
+			avx2_sepia_channel(r, g, b, effects_sepia_q16),
+			avx2_sepia_channel(r, g, b, effects_sepia_q16 + 3),
+			avx2_sepia_channel(r, g, b, effects_sepia_q16 + 6));
+	}
+
+	effects_scalar_sepia_rgba(row + 4 * j, width - j);
+}
+
+static AVX2 void avx2_saturation_rgba(uint8_t *row, int width, const uint16_t *k)
+{
+	__m256i kR = _mm256_set1_epi16(k[0]), kG = _mm256_set1_epi16(k[1]), kB = _mm256_set1_epi16(k[2]);
+	int j = 0;
+
+	for(; j + 16 <= width; j += 16) {
+		__m256i r, g, b;
+		avx2_load_rgba(row + 4 * j, &r, &g, &b);
+
+		avx2_store_rgba(row + 4 * j,
+			_mm256_srli_epi16(_mm256_mulhi_epu16(_mm256_slli_epi16(r, 8), kR), 7),
+			_mm256_srli_epi16(_mm256_mulhi_epu16(_mm256_slli_epi16(g, 8), kG), 7),
+			_mm256_srli_epi16(_mm256_mulhi_epu16(_mm256_slli_epi16(b, 8), kB), 7));
+	}
+
+	effects_scalar_saturation_rgba(row + 4 * j, width - j, k);
+}
+
+const effects_kernels_t effects_kernels_avx2 = {
+	"avx2", avx2_bw_row, avx2_sepia_row, avx2_saturation_row,
+	avx2_bw_planar, avx2_sepia_planar, avx2_saturation_planar,
+	avx2_bw_rgba, avx2_sepia_rgba, avx2_saturation_rgba
+};
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef EFFECTS_SIMD_H
+#define EFFECTS_SIMD_H
+
+#include <stdint.h>
+
+/**
+ * Row kernels of the colour effects, working in place on `width` packed
+ * RGB24 or RGBA pixels (the fourth byte left as it is), or on the rows of
+ * `width` samples of planar R, G and B.
+ * Every implementation uses the same fixed-point math, so vector versions
+ * must match the scalar ones bit for bit.
+ */
+typedef struct
+{
+	const char *name;
+
+	void (*bw)(uint8_t *row, int width);
+	void (*sepia)(uint8_t *row, int width);
+	/* k: per-channel factors in Q15, see effects_saturation(). */
+	void (*saturation)(uint8_t *row, int width, const uint16_t *k);
+
+	void (*bw_planar)(uint8_t *r, uint8_t *g, uint8_t *b, int width);
+	void (*sepia_planar)(uint8_t *r, uint8_t *g, uint8_t *b, int width);
+	void (*saturation_planar)(uint8_t *r, uint8_t *g, uint8_t *b, int width, const uint16_t *k);
+
+	void (*bw_rgba)(uint8_t *row, int width);
+	void (*sepia_rgba)(uint8_t *row, int width);
+	void (*saturation_rgba)(uint8_t *row, int width, const uint16_t *k);
+} effects_kernels_t;
+
+/* (r + g + b) * EFFECTS_BW_Q16 >> 16 equals (r + g + b) / 3 for all inputs. */
+#define EFFECTS_BW_Q16 21846
+
+/**
+ * Sepia matrix in Q16, row by row. Each term is ((p << 7) * c) >> 16, the
+ * three terms are summed, shifted right by 7 and clamped to 255.
+ */
+static const uint16_t effects_sepia_q16[9] = {
+	25756, 50397, 12386,	/* 0.393 0.769 0.189 */
+	22872, 44958, 11010,	/* 0.349 0.686 0.168 */
+	17826, 34996,  8585,	/* 0.272 0.534 0.131 */
+};
+
+/* Scalar reference kernels, defined in effects.c. */
+void effects_scalar_bw_row(uint8_t *row, int width);
+void effects_scalar_sepia_row(uint8_t *row, int width);
+void effects_scalar_saturation_row(uint8_t *row, int width, const uint16_t *k);
+void effects_scalar_bw_planar(uint8_t *r, uint8_t *g, uint8_t *b, int width);
+void effects_scalar_sepia_planar(uint8_t *r, uint8_t *g, uint8_t *b, int width);
+void effects_scalar_saturation_planar(uint8_t *r, uint8_t *g, uint8_t *b, int width, const uint16_t *k);
+void effects_scalar_bw_rgba(uint8_t *row, int width);
+void effects_scalar_sepia_rgba(uint8_t *row, int width);
+void effects_scalar_saturation_rgba(uint8_t *row, int width, const uint16_t *k);
+
+extern const effects_kernels_t effects_kernels_scalar;
+
+#if defined(__x86_64__) || defined(__i386__)
+extern const effects_kernels_t effects_kernels_sse2;
+extern const effects_kernels_t effects_kernels_avx2;
+#endif
+
+#endif
@@ -0,0 +1,74 @@
+#include "history.h"
+
+history_t *history_create(int size)
+{
+	if(size < 1)
+		return NULL;
+
+	history_t *history = (history_t*)malloc(sizeof(history_t));
+
+	history->frames = (ctve_frame_t*)calloc(size, sizeof(ctve_frame_t));
+	history->size = size;
+	history->length = 0;
+	history->head = 0;
+
+	return history;
+}
+
+void history_free(history_t *history)
+{
+	if(history == NULL)
+		return;
+
+	history_reset(history);
+	free(history->frames);
+	free(history);
+}
+
+void history_reset(history_t *history)
+{
+	for(int i = 0; i < history->length; ++i)
+		ctve_frame_unref(history_get(history, i));
+
+	history->length = 0;
+	history->head = 0;
+}
+
+int history_push(history_t *history, ctve_frame_t *frame, ctve_frame_t *evicted)
+{
+	ctve_frame_t ref = *frame;
+
+	if(frame->buf != NULL) {
+		ref.buf = av_buffer_ref(frame->buf);
+		if(ref.buf == NULL)
+			return -1;
+	} else {
+		/* Not pooled: the caller may reuse that memory, keep a copy. */
+		if(ctve_frame_alloc(&ref) < 0)
+			return -1;
+
+		memcpy(ref.data, frame->data, ref.length);
+		ctve_count_copy(frame->counters, ref.length);
+	}
+
+	int full = history->length == history->size;
+
+	history->head = (history->head + 1) % history->size;
+
+	if(full)
+		*evicted = history->frames[history->head];
+	else
+		history->length++;
+
+	history->frames[history->head] = ref;
+
+	return full;
+}
+
+ctve_frame_t *history_get(history_t *history, int age)
+{
+	if(age < 0 || age >= history->length)
+		return NULL;
+
+	return &history->frames[(history->head - age + history->size) % history->size];
+}
@@ -0,0 +1,40 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include "ctve.h"
+
+/**
+ * The last `size` frames an effect has seen, newest first. Frames are
+ * kept as references to their pooled buffers, nothing gets copied; a
+ * frame whose buffer isn't pooled is copied into one.
+ */
+typedef struct
+{
+	/* Ring of frames, `head` is the newest. */
+	ctve_frame_t *frames;
+	int size;
+	int length;
+	int head;
+} history_t;
+
+/* Create an empty history of up to size frames. NULL if size < 1. */
+history_t *history_create(int size);
+
+/* Release a history and its references. */
+void history_free(history_t *history);
+
+/* Drop every frame. */
+void history_reset(history_t *history);
+
+/**
+ * Add a reference to frame as the newest one. When the history was
+ * full, the oldest frame is moved to evicted and 1 is returned; the
+ * caller then owns that reference and releases it with ctve_frame_unref().
+ * Returns 0 otherwise, -1 if the frame could not be referenced.
+ */
+int history_push(history_t *history, ctve_frame_t *frame, ctve_frame_t *evicted);
+
+/* Frame pushed age pushes ago, 0 being the newest, or NULL. */
+ctve_frame_t *history_get(history_t *history, int age);
+
+#endif
@@ -1,66 +1,433 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "main.h"
-#include "blur.h"
+#include "chain.h"
 #include "effects.h"
+#include "pool.h"
+#include "daemon.h"
+#include "roi.h"
+#include "reuse.h"
+#include "rawio.h"
 
 #include <sys/time.h>
 
 /* Global configuration. */
 static conf_t conf;
 
+/* Seconds of video between checkpoints when --resume doesn't get --checkpoint. */
+#define DEFAULT_CHECKPOINT 10
+
+/* Chains parsed for a daemon worker's jobs, kept with their kernels and reused round robin. */
+#define CHAIN_CACHE 16
+
+/**
+ * What a daemon worker runs its jobs with, one job at a time: a context,
+ * the work handed to process_chain() and the chains it parsed, all kept
+ * warm from one job to the next and used by no other worker.
+ */
+typedef struct
+{
+	ctve_context_t *context;
+	work_t work;
+
+	struct
+	{
+		char spec[256];
+		chain_t *chain;
+	} chains[CHAIN_CACHE];
+	int chainNext;
+} job_worker_t;
+
+/* Layout of a --layout name, BW for an unknown one. */
+static ctve_frame_pixel_t layout_parse(const char *name)
+{
+	static const ctve_frame_pixel_t layouts[] = { RGB, RGBA, GBRP, YUV420P };
+
+	for(int i = 0; i < sizeof(layouts) / sizeof(layouts[0]); ++i) {
+		if(strcmp(name, ctve_frame_layout_name(layouts[i])) == 0)
+			return layouts[i];
+	}
+
+	return BW;
+}
+
+/**
+ * A rendition, "<file>:<w>x<h>[:<kbit/s>[:<preset>]]", cut up in place:
+ * the path and preset point into spec. Returns -1 on a malformed one.
+ */
+static int rendition_parse(char *spec, ctve_rendition_t *rendition)
+{
+	char *fields[4] = { spec, NULL, NULL, NULL };
+	int count = 1;
+
+	for(char *c = spec; *c != '\0' && count < 4; ++c) {
+		if(*c == ':') {
+			*c = '\0';
+			fields[count++] = c + 1;
+		}
+	}
+
+	memset(rendition, 0, sizeof(*rendition));
+	rendition->path = fields[0];
+
+	if(count < 2 || fields[0][0] == '\0' || sscanf(fields[1], "%dx%d", &rendition->width, &rendition->height) != 2 ||
+		rendition->width < 0 || rendition->height < 0)
+		return -1;
+
+	if(count >= 3)
+		rendition->bit_rate = atoll(fields[2]) * 1000;
+	if(count >= 4 && fields[3][0] != '\0')
+		rendition->preset = fields[3];
+
+	return 0;
+}
+
+/* Options for the work's chain out of the configuration, set on ctx. Returns -1 if they don't fit. */
+static int configure(ctve_context_t *ctx, ctve_options_t *options, const work_t *work)
+{
+	chain_t *chain = work->chain;
+
+	ctve_default_options(options);
+	options->pipeline = conf.pipeline;
+	options->pixel_type = chain_layout(chain, conf.rgb);
+	options->batch_frames = conf.stream ? 1 : 0;
+	options->mem_budget = (uint64_t)conf.memBudget << 20;
+	options->stats = conf.stats;
+	options->segments = conf.segments;
+	options->from = conf.from;
+	options->to = conf.to;
+	options->width = conf.width;
+	options->height = conf.height;
+	options->scale = conf.scale;
+	options->renditions = conf.renditions;
+	options->rendition_count = conf.renditionCount;
+	options->raw_in = conf.rawIn[0] != '\0' ? rawio_parse_format(conf.rawIn) : RAWIO_NONE;
+	options->raw_out = conf.rawOut[0] != '\0' ? rawio_parse_format(conf.rawOut) : RAWIO_NONE;
+	options->raw_width = conf.rawWidth;
+	options->raw_height = conf.rawHeight;
+	options->raw_rate = conf.rawRate;
+	options->checkpoint = conf.checkpoint;
+	options->resume = conf.resume;
+
+	/* Resuming takes checkpoints on as it goes. */
+	if(conf.resume && conf.checkpoint <= 0)
+		options->checkpoint = DEFAULT_CHECKPOINT;
+
+	if((conf.rawIn[0] != '\0' && options->raw_in == RAWIO_NONE) || (conf.rawOut[0] != '\0' && options->raw_out == RAWIO_NONE)) {
+		printf("Unknown raw format, rgb24, yuv420p or y4m.\n");
+		return -1;
+	}
+
+	/* Raw input is read straight into the frames when the chain can run on its layout. */
+	if(options->raw_in != RAWIO_NONE && (!conf.rgb || options->raw_in == RAWIO_RGB24) &&
+		chain_supports(chain, rawio_pixel_type(options->raw_in)))
+		options->pixel_type = rawio_pixel_type(options->raw_in);
+
+	if(conf.scaler[0] != '\0' && ctve_options_scaler(options, conf.scaler) < 0) {
+		printf("Unknown scaler %s.\n", conf.scaler);
+		return -1;
+	}
+
+	if(conf.pixFmt[0] != '\0' && ctve_options_encode_format(options, conf.pixFmt) < 0) {
+		printf("Unknown pixel format %s.\n", conf.pixFmt);
+		return -1;
+	}
+
+	if(conf.layout[0] != '\0') {
+		options->pixel_type = layout_parse(conf.layout);
+
+		if(options->pixel_type == BW || !chain_supports(chain, options->pixel_type)) {
+			printf("The effect chain can't run on layout %s.\n", conf.layout);
+			return -1;
+		}
+	}
+
+	if(conf.to > 0 && conf.to <= conf.from) {
+		printf("--to must come after --from.\n");
+		return -1;
+	}
+
+	/* A region is processed as frames of its own, of a size that may change. */
+	if(work->roi != NULL && chain_temporal(chain)) {
+		printf("Temporal effects need whole frames, they can't be limited to a region.\n");
+		return -1;
+	}
+
+	/* Reused outputs must only depend on the pixels they came from, and be made in order. */
+	if(conf.reuse && (work->roi != NULL || chain_temporal(chain) || conf.segments > 1)) {
+		printf("--reuse needs whole frames, in a single pass, and no temporal effect.\n");
+		return -1;
+	}
+
+	/* Every segment starts without the frames before it. */
+	if(conf.segments > 1 && chain_temporal(chain)) {
+		printf("Temporal effects need every frame in order, they can't run in segments.\n");
+		return -1;
+	}
+
+	/* Segments each write a part of one output; daemon jobs name their own. */
+	if(conf.renditionCount > 0 && (conf.segments > 1 || conf.daemon[0] != '\0')) {
+		printf("--rendition can't go with --segments or --daemon.\n");
+		return -1;
+	}
+
+	/* No codec to encode raw input for; raw streams have no keyframes to split or cut at. */
+	if(options->raw_in != RAWIO_NONE && options->raw_out == RAWIO_NONE) {
+		printf("--raw-in needs --raw-out too.\n");
+		return -1;
+	}
+
+	if((options->raw_in != RAWIO_NONE || options->raw_out != RAWIO_NONE) &&
+		(conf.segments > 1 || conf.renditionCount > 0 || conf.daemon[0] != '\0')) {
+		printf("Raw video can't go with --segments, --rendition or --daemon.\n");
+		return -1;
+	}
+
+	/* Raw frames may point into the input, with no buffer for the next ones to share. */
+	if(conf.reuse && options->raw_in != RAWIO_NONE) {
+		printf("--reuse can't go with --raw-in.\n");
+		return -1;
+	}
+
+	/* Checkpoints are taken of one encoder's output, written from start to end. */
+	if((conf.checkpoint > 0 || conf.resume) && (conf.segments > 1 || conf.renditionCount > 0 || conf.from > 0 || conf.to > 0 ||
+		options->raw_in != RAWIO_NONE || options->raw_out != RAWIO_NONE || conf.daemon[0] != '\0')) {
+		printf("--checkpoint and --resume need a single pass of the whole video into one encoded output.\n");
+		return -1;
+	}
+
+	/* The frames before the checkpoint are not processed again. */
+	if(conf.resume && chain_temporal(chain)) {
+		printf("Temporal effects need the frames before the checkpoint, they can't resume.\n");
+		return -1;
+	}
+
+	if(conf.profile[0] != '\0' && ctve_options_profile(options, conf.profile) < 0) {
+		printf("Unknown profile %s.\n", conf.profile);
+		return -1;
+	}
+
+	if(conf.preset[0] != '\0')
+		options->preset = conf.preset;
+	if(conf.codecThreads >= 0)
+		options->decode_threads = options->encode_threads = conf.codecThreads;
+	if(conf.threadType > 0)
+		options->thread_type = conf.threadType;
+
+	ctve_context_set_options(ctx, options);
+
+	return 0;
+}
+
+/* The region and --reuse state of the configuration, without a chain yet. Returns -1 if the region can't be had. */
+static int work_init(work_t *work)
+{
+	memset(work, 0, sizeof(*work));
+
+	if(conf.roi[0] != '\0')
+		work->roi = roi_parse_rects(conf.roi);
+	else if(conf.roiFile[0] != '\0')
+		work->roi = roi_load_sidecar(conf.roiFile);
+	else if(conf.roiMask[0] != '\0')
+		work->roi = roi_load_mask(conf.roiMask);
+
+	if(work->roi == NULL && (conf.roi[0] != '\0' || conf.roiFile[0] != '\0' || conf.roiMask[0] != '\0'))
+		return -1;
+
+	if(conf.reuse)
+		work->reuse = reuse_create();
+
+	return 0;
+}
+
+/* A chain for a worker's job, parsed only the first time it asks for it. */
+static chain_t *cached_chain(job_worker_t *worker, const char *spec)
+{
+	for(int i = 0; i < CHAIN_CACHE; ++i) {
+		if(worker->chains[i].chain != NULL && strcmp(worker->chains[i].spec, spec) == 0)
+			return worker->chains[i].chain;
+	}
+
+	chain_t *parsed = chain_parse(spec);
+	if(parsed == NULL)
+		return NULL;
+
+	int i = worker->chainNext;
+	worker->chainNext = (worker->chainNext + 1) % CHAIN_CACHE;
+
+	chain_free(worker->chains[i].chain);
+	snprintf(worker->chains[i].spec, sizeof(worker->chains[i].spec), "%s", spec);
+	worker->chains[i].chain = parsed;
+
+	return parsed;
+}
+
+/* Daemon job: the daemon's options, with the job's input, output and chain, on the worker's own state. */
+static int run_job(void *arg, const daemon_job_t *job, uint64_t *frames, char *error, int size)
+{
+	job_worker_t *worker = (job_worker_t*)arg;
+	ctve_options_t options;
+	ctve_stats_t stats;
+	ctve_video_t *video;
+
+	worker->work.chain = cached_chain(worker, job->effect);
+	if(worker->work.chain == NULL) {
+		snprintf(error, size, "unknown effect chain %s", job->effect);
+		return -1;
+	}
+
+	/* Temporal effects start over with every video, and earlier outputs don't apply. */
+	chain_reset(worker->work.chain);
+	reuse_reset(worker->work.reuse);
+
+	if(configure(worker->context, &options, &worker->work) < 0) {
+		snprintf(error, size, "options don't fit the effect chain %s", job->effect);
+		return -1;
+	}
+
+	video = ctve_context_process(worker->context, job->inFile, job->outFile, process_chain, &worker->work);
+	if(video == NULL) {
+		snprintf(error, size, "%s", ctve_context_error(worker->context));
+		return -1;
+	}
+
+	ctve_free_video(video);
+
+	ctve_context_stats(worker->context, &stats);
+	*frames = stats.frames;
+
+	return 0;
+}
+
+/* Serve jobs on --daemon-jobs workers of their own until killed; every job reports on its own. */
+static int serve(void)
+{
+	int count = conf.daemonJobs > 0 ? conf.daemonJobs : 1;
+	job_worker_t *workers = (job_worker_t*)calloc(count, sizeof(job_worker_t));
+	void **args = (void**)malloc(count * sizeof(void*));
+
+	if(workers == NULL || args == NULL)
+		return -1;
+
+	for(int i = 0; i < count; ++i) {
+		if(work_init(&workers[i].work) < 0)
+			return -1;
+
+		workers[i].context = ctve_context_create(NULL);
+		args[i] = &workers[i];
+	}
+
+	return daemon_serve(conf.daemon, args, count, run_job);
+}
+
 int main(int argc, char **argv)
 {
 	ctve_video_t *video;
-	cvte_algorithm_func effect = NULL;
 
-	if(argc < 4) {
-		printf("Usage: %s <input_file> <output_file> <effect_name> [<arg1> [<arg2> [<arg3..]]\n\n", argv[0]);
+	/* Parse arguments. */
+	if(parse_args(argv, argc, &conf) < 0) {
+		printf("Usage: %s [options] <input_file> <output_file> <effect_chain>\n", argv[0]);
+		printf("   or: %s [options] <input_file> <output_file> <effect_name> [<arg1> [<arg2> [<arg3..]]\n\n", argv[0]);
 		printf("[Available effects]\n");
 		printf("\t1) bw\n");
 		printf("\t2) sepia\n");
-		printf("\t3) blur [<value>] - default values is 5\n");
+		printf("\t3) blur [<value> [<passes>]] - default values are 5 and 1 (3 passes approximate a Gaussian)\n");
 		printf("\t3) saturation <red> <green> <blue> - In range [0..2]\n");
+		printf("\t5) average[:<frames>] - mean of the last frames, a motion blur; default 3\n");
+		printf("\t6) denoise[:<frames>[,<threshold>]] - temporal denoise, defaults 5 and 10\n");
+		printf("\n");
+		printf("[Effect chains]\n");
+		printf("\tEffects joined by '+', arguments after ':' separated by ',', e.g.\n");
+		printf("\tsaturation:1.2,1,1+sepia+blur:7\n");
+		printf("\n");
+		printf("[Options]\n");
+		printf("\t--pipeline - decode, process and encode on separate threads\n");
+		printf("\t-j <threads> - threads sharing each frame's effect work, default is one per core\n");
+		printf("\t--rgb - run effects on RGB even when the chain supports YUV420P, planar GBRP when it can\n");
+		printf("\t--layout rgb24|rgba|gbrp|yuv420p - frame layout the effects run on, default is the chain's pick\n");
+		printf("\t--reuse - skip frames and tiles whose input didn't change, reusing their earlier output\n");
+		printf("\t--stream - process and encode every frame as soon as it is decoded\n");
+		printf("\t--mem-budget <MB> - shrink batches so frames in flight fit in this much memory\n");
+		printf("\t--profile fast|balanced|quality - encoder preset and codec threading, default is balanced\n");
+		printf("\t--preset <name> - H.264 encoder preset, overrides the profile's\n");
+		printf("\t--codec-threads <n> - decoder and encoder threads, 0 (default) is one per core\n");
+		printf("\t--thread-type frame|slice|both - how the codecs thread, default is both\n");
+		printf("\t--size <w>x<h> - scale frames before the effects run, 0 for a side keeps the aspect ratio\n");
+		printf("\t--scale <factor> - scale frames by this factor before the effects run\n");
+		printf("\t--scaler point|fast_bilinear|bilinear|bicubic|area|lanczos - scaling algorithm, default is bicubic\n");
+		printf("\t--pix-fmt <name> - pixel format of the encoders, e.g. yuv444p, default is yuv420p\n");
+		printf("\t--rendition <file>:<w>x<h>[:<kbit/s>[:<preset>]] - also encode the processed frames to this file, repeatable\n");
+		printf("\t--raw-in rgb24|yuv420p|y4m - read raw video instead of a container, '-' for stdin\n");
+		printf("\t--raw-size <w>x<h> --raw-rate <fps> - size and frame rate of raw input without a header, default rate 25\n");
+		printf("\t--raw-out rgb24|yuv420p|y4m - write raw video instead of encoding it, '-' for stdout\n");
+		printf("\t--checkpoint <s> - save where the output stands at a keyframe every <s> seconds of video (.ts and the like)\n");
+		printf("\t--resume - pick up from the output's checkpoint, appending to it; checkpoints every %d s unless told\n", DEFAULT_CHECKPOINT);
+		printf("\t--from <s> --to <s> - apply the effects to this time range only, copying untouched GOPs as they are\n");
+		printf("\t--roi <x>,<y>,<w>,<h>[+...] - apply the effects to these rectangles only\n");
+		printf("\t--roi-file <file> - rectangles changing over time, lines of '<seconds> <x>,<y>,<w>,<h> ...'\n");
+		printf("\t--roi-mask <file.pgm> - apply the effects as much as a greyscale mask says, 255 fully\n");
+		printf("\t--segments <n> - split the input at keyframes into n segments processed in parallel\n");
+		printf("\t--stats[=<file.json>] - time every stage; print a table, or write JSON to the file ('-' for stdout)\n");
+		printf("\t--daemon <socket> - run jobs sent by ctve_client on this socket, with these options\n");
+		printf("\t--daemon-jobs <n> - jobs the daemon runs at once, default is 2\n");
 		printf("\n");
 		return -1;
 	}
 
-	/* Parse arguments. */
-	parse_args(argv, argc, &conf);
-
-	/* Init blur radius. Default is 5 even if other effect is requested. */
-	blur_init((int)conf.value[0]);
-
-	if(strcmp(conf.effect, "bw") == 0) {
-		/* Apply black and white filter. */
-		effect = process_bw;
-		printf("Effect: black and white\n");
-	} else if(strcmp(conf.effect, "sepia") == 0) {
-		/* Apply sepia filter. */
-		effect = process_sepia;
-		printf("Effect: sepia\n");
-	} else if(strcmp(conf.effect, "saturation") == 0) {
-		/* Apply sepia filter. */
-		effect = process_saturation;
-		printf("Effect: saturation, r = %f, g = %f, b = %f\n", conf.value[0], conf.value[1], conf.value[2]);
-	}else if(strcmp(conf.effect, "blur") == 0) {
-		/* Apply blur effect. */
-		effect = process_blur;
-		printf("Effect: blur, %f\n", conf.value[0]);
-	}
-
-	if(effect == NULL) {
+	/* The video goes to stdout: messages go to stderr, from the first one on. */
+	if(conf.rawOut[0] != '\0' && strcmp(conf.outFile, "-") == 0)
+		rawio_claim_stdout();
+
+	/* Worker threads shared by all effect kernels. */
+	pool_init(conf.threads);
+
+	/* Pick vectorized kernels for the colour effects. */
+	effects_init();
+	printf("Kernels: %s\n", effects_kernels_name());
+
+	if(conf.daemon[0] != '\0')
+		return serve();
+
+	/* Effects requested on the command line, handed to process_chain(). */
+	work_t work;
+	if(work_init(&work) < 0)
+		return -1;
+
+	ctve_context_t *context = ctve_context_create(NULL);
+
+	work.chain = chain_parse(conf.effect);
+	if(work.chain == NULL) {
 		printf("Requested effect is not implemented.\n");
 		return -1;
 	}
-	
+
+	printf("Effect: %s\n", conf.effect);
+
+	ctve_options_t options;
+	if(configure(context, &options, &work) < 0)
+		return -1;
+
+	printf("Layout: %s\n", ctve_frame_layout_name(options.pixel_type));
+	printf("Preset: %s\n", options.preset ? options.preset : "default");
+
 	struct timeval begin, end;
 	gettimeofday(&begin, NULL);
 
 	/* Apply effect and write outfile. */
-	video = ctve_load_and_process_video(conf.inFile, conf.outFile, effect);
+	video = ctve_context_process(context, conf.inFile, conf.outFile, process_chain, &work);
 
+	/* Said why already. */
+	if(video == NULL) {
+		chain_free(work.chain);
+		roi_free(work.roi);
+		reuse_free(work.reuse);
+		ctve_context_free(context);
+		pool_shutdown();
+
+		return 1;
+	}
 	
 	gettimeofday(&end, NULL);
 	double elapsed = (end.tv_sec - begin.tv_sec) + 
@@ -68,63 +435,268 @@ int main(int argc, char **argv)
 
 	printf("Time: %lf\n", elapsed);
 
+	ctve_stats_t stats;
+	ctve_context_stats(context, &stats);
+	printf("Copied: %.0lf bytes/frame\n", stats.frames ? (double)stats.bytes_copied / stats.frames : 0.0);
+	printf("Batch: %u frames, first output after %llu\n", stats.batch_frames, (unsigned long long)stats.latency_frames);
+
+	if(work.reuse != NULL)
+		printf("Reused: %llu frames, %.1lf%% of tiles\n", (unsigned long long)stats.frames_reused,
+			stats.tiles_hashed ? 100.0 * stats.tiles_reused / stats.tiles_hashed : 0.0);
+
+	if(conf.stats && conf.statsFile[0] == '\0') {
+		print_stats(stdout, &stats);
+	} else if(conf.stats) {
+		FILE *out = strcmp(conf.statsFile, "-") == 0 ? stdout : fopen(conf.statsFile, "w");
+
+		if(out == NULL) {
+			fprintf(stderr, "Could not open %s\n", conf.statsFile);
+		} else {
+			print_stats_json(out, &stats);
+			if(out != stdout)
+				fclose(out);
+		}
+	}
+
 	ctve_free_video(video);
 
 	/* Free resources. */
-	blur_free();
+	chain_free(work.chain);
+	roi_free(work.roi);
+	reuse_free(work.reuse);
+	ctve_context_free(context);
+	pool_shutdown();
 
 	return 0;
 }
 
 int parse_args(char **argv, int argc, conf_t *conf)
 {
-	conf->value[0] = 5.f;
+	char *args[8];
+	int count = 0;
+
+	conf->pipeline = 0;
+	conf->threads = 0;
+	conf->rgb = 0;
+	conf->layout[0] = '\0';
+	conf->stream = 0;
+	conf->reuse = 0;
+	conf->memBudget = 0;
+	conf->profile[0] = '\0';
+	conf->preset[0] = '\0';
+	conf->codecThreads = -1;
+	conf->threadType = 0;
+	conf->segments = 0;
+	conf->from = 0;
+	conf->to = 0;
+	conf->width = 0;
+	conf->height = 0;
+	conf->scale = 0;
+	conf->scaler[0] = '\0';
+	conf->pixFmt[0] = '\0';
+	conf->renditionCount = 0;
+	conf->rawIn[0] = '\0';
+	conf->rawOut[0] = '\0';
+	conf->rawWidth = 0;
+	conf->rawHeight = 0;
+	conf->rawRate = 0;
+	conf->checkpoint = 0;
+	conf->resume = 0;
+	conf->roi[0] = '\0';
+	conf->roiFile[0] = '\0';
+	conf->roiMask[0] = '\0';
+	conf->daemon[0] = '\0';
+	conf->daemonJobs = 2;
+	conf->stats = 0;
+	conf->statsFile[0] = '\0';
+
+	/* Options may appear anywhere; everything else is positional. */
+	for(int i = 1; i < argc; ++i) {
+		if(strcmp(argv[i], "--pipeline") == 0)
+			conf->pipeline = 1;
+		else if(strcmp(argv[i], "--rgb") == 0)
+			conf->rgb = 1;
+		else if(strcmp(argv[i], "--stream") == 0)
+			conf->stream = 1;
+		else if(strcmp(argv[i], "--reuse") == 0)
+			conf->reuse = 1;
+		else if(strcmp(argv[i], "--resume") == 0)
+			conf->resume = 1;
+		else if(strcmp(argv[i], "--stats") == 0)
+			conf->stats = 1;
+		else if(strncmp(argv[i], "--stats=", 8) == 0) {
+			conf->stats = 1;
+			snprintf(conf->statsFile, sizeof(conf->statsFile), "%s", argv[i] + 8);
+		}
+		else if(strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+			conf->threads = atoi(argv[++i]);
+		else if(strcmp(argv[i], "--layout") == 0 && i + 1 < argc)
+			snprintf(conf->layout, sizeof(conf->layout), "%s", argv[++i]);
+		else if(strcmp(argv[i], "--daemon") == 0 && i + 1 < argc)
+			snprintf(conf->daemon, sizeof(conf->daemon), "%s", argv[++i]);
+		else if(strcmp(argv[i], "--daemon-jobs") == 0 && i + 1 < argc)
+			conf->daemonJobs = atoi(argv[++i]);
+		else if(strcmp(argv[i], "--from") == 0 && i + 1 < argc)
+			conf->from = atof(argv[++i]);
+		else if(strcmp(argv[i], "--to") == 0 && i + 1 < argc)
+			conf->to = atof(argv[++i]);
+		else if(strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+			if(sscanf(argv[++i], "%dx%d", &conf->width, &conf->height) != 2 || conf->width < 0 || conf->height < 0)
+				return -1;
+		}
+		else if(strcmp(argv[i], "--scale") == 0 && i + 1 < argc)
+			conf->scale = atof(argv[++i]);
+		else if(strcmp(argv[i], "--scaler") == 0 && i + 1 < argc)
+			snprintf(conf->scaler, sizeof(conf->scaler), "%s", argv[++i]);
+		else if(strcmp(argv[i], "--pix-fmt") == 0 && i + 1 < argc)
+			snprintf(conf->pixFmt, sizeof(conf->pixFmt), "%s", argv[++i]);
+		else if(strcmp(argv[i], "--rendition") == 0 && i + 1 < argc) {
+			int k = conf->renditionCount;
 
-	memcpy(conf->inFile, argv[1], strlen(argv[1]) + 1);
-	memcpy(conf->outFile, argv[2], strlen(argv[2]) + 1);
-	memcpy(conf->effect, argv[3], strlen(argv[3]) + 1);
+			if(k == CTVE_MAX_RENDITIONS)
+				return -1;
 
-	if(strcmp(conf->effect, "blur") == 0 && argc == 5)
-		sscanf(argv[4], "%f", &conf->value[0]);
-	else if(strcmp(conf->effect, "saturation") == 0 && argc == 7) {
-		sscanf(argv[4], "%f", &conf->value[0]);
-		sscanf(argv[5], "%f", &conf->value[1]);
-		sscanf(argv[6], "%f", &conf->value[2]);
+			snprintf(conf->renditionSpecs[k], sizeof(conf->renditionSpecs[k]), "%s", argv[++i]);
+			if(rendition_parse(conf->renditionSpecs[k], &conf->renditions[k]) < 0)
+				return -1;
+
+			conf->renditionCount++;
+		}
+		else if(strcmp(argv[i], "--raw-in") == 0 && i + 1 < argc)
+			snprintf(conf->rawIn, sizeof(conf->rawIn), "%s", argv[++i]);
+		else if(strcmp(argv[i], "--raw-out") == 0 && i + 1 < argc)
+			snprintf(conf->rawOut, sizeof(conf->rawOut), "%s", argv[++i]);
+		else if(strcmp(argv[i], "--raw-size") == 0 && i + 1 < argc) {
+			if(sscanf(argv[++i], "%dx%d", &conf->rawWidth, &conf->rawHeight) != 2 || conf->rawWidth <= 0 || conf->rawHeight <= 0)
+				return -1;
+		}
+		else if(strcmp(argv[i], "--raw-rate") == 0 && i + 1 < argc)
+			conf->rawRate = atof(argv[++i]);
+		else if(strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc)
+			conf->checkpoint = atof(argv[++i]);
+		else if(strcmp(argv[i], "--roi") == 0 && i + 1 < argc)
+			snprintf(conf->roi, sizeof(conf->roi), "%s", argv[++i]);
+		else if(strcmp(argv[i], "--roi-file") == 0 && i + 1 < argc)
+			snprintf(conf->roiFile, sizeof(conf->roiFile), "%s", argv[++i]);
+		else if(strcmp(argv[i], "--roi-mask") == 0 && i + 1 < argc)
+			snprintf(conf->roiMask, sizeof(conf->roiMask), "%s", argv[++i]);
+		else if(strcmp(argv[i], "--segments") == 0 && i + 1 < argc)
+			conf->segments = atoi(argv[++i]);
+		else if(strcmp(argv[i], "--mem-budget") == 0 && i + 1 < argc)
+			conf->memBudget = atoi(argv[++i]);
+		else if(strcmp(argv[i], "--profile") == 0 && i + 1 < argc)
+			snprintf(conf->profile, sizeof(conf->profile), "%s", argv[++i]);
+		else if(strcmp(argv[i], "--preset") == 0 && i + 1 < argc)
+			snprintf(conf->preset, sizeof(conf->preset), "%s", argv[++i]);
+		else if(strcmp(argv[i], "--codec-threads") == 0 && i + 1 < argc)
+			conf->codecThreads = atoi(argv[++i]);
+		else if(strcmp(argv[i], "--thread-type") == 0 && i + 1 < argc) {
+			i++;
+			if(strcmp(argv[i], "frame") == 0)
+				conf->threadType = FF_THREAD_FRAME;
+			else if(strcmp(argv[i], "slice") == 0)
+				conf->threadType = FF_THREAD_SLICE;
+			else if(strcmp(argv[i], "both") == 0)
+				conf->threadType = FF_THREAD_FRAME | FF_THREAD_SLICE;
+			else
+				return -1;
+		}
+		else if(count < 8)
+			args[count++] = argv[i];
 	}
+
+	/* Jobs come over the socket. */
+	if(conf->daemon[0] != '\0' && count == 0)
+		return 0;
+
+	if(count < 3)
+		return -1;
+
+	snprintf(conf->inFile, sizeof(conf->inFile), "%s", args[0]);
+	snprintf(conf->outFile, sizeof(conf->outFile), "%s", args[1]);
+
+	/* The "<effect> <args..>" form becomes a chain of one effect. */
+	if(strcmp(args[2], "blur") == 0 && count >= 4)
+		snprintf(conf->effect, sizeof(conf->effect), "blur:%s,%s", args[3], count >= 5 ? args[4] : "1");
+	else if(strcmp(args[2], "saturation") == 0 && count == 6)
+		snprintf(conf->effect, sizeof(conf->effect), "saturation:%s,%s,%s", args[3], args[4], args[5]);
+	else
+		snprintf(conf->effect, sizeof(conf->effect), "%s", args[2]);
+
+	return 0;
 }
 
-/**
- * This function gets called after every FRAMES_COUNT frames.
- * They get read and saved into a video structure in RGB format.
- * This function role is to alter the frames - do the processing.
- * The saving is done automatically.
- */
-void process_blur(ctve_video_t *video)
+void print_stats(FILE *out, const ctve_stats_t *stats)
 {
-	static int count = 0;
-	for(int i = 0; i < video->length; ++i) {
-		blur_apply(&video->frames[i]);
+	double fps = stats->seconds > 0 ? stats->frames / stats->seconds : 0;
+
+	fprintf(out, "%-12s %10s %8s %9s %9s %9s %9s\n", "stage", "total s", "frames", "avg ms", "p50 ms", "p99 ms", "max ms");
 
-		if(count < 5)
-			SaveFrame2(video->frames[i].data, video->frames[i].width, video->frames[i].height, count++);
+	for(int i = 0; i < STATS_STAGES; ++i) {
+		const stats_timer_t *t = &stats->stages[i];
+
+		fprintf(out, "%-12s %10.3f %8llu %9.3f %9.3f %9.3f %9.3f\n", stats_stage_name(i),
+			t->total_ns / 1e9, (unsigned long long)t->count,
+			t->count ? t->total_ns / 1e6 / t->count : 0.0,
+			stats_timer_percentile(t, 0.5) / 1e6, stats_timer_percentile(t, 0.99) / 1e6, t->max_ns / 1e6);
 	}
+
+	fprintf(out, "Frames: %llu in %.3lf s, %.2lf fps\n", (unsigned long long)stats->frames, stats->seconds, fps);
+	fprintf(out, "Read: %llu bytes, written: %llu bytes\n", (unsigned long long)stats->bytes_read, (unsigned long long)stats->bytes_written);
+	fprintf(out, "Reused: %llu frames, %llu of %llu tiles\n", (unsigned long long)stats->frames_reused,
+		(unsigned long long)stats->tiles_reused, (unsigned long long)stats->tiles_hashed);
+	fprintf(out, "Peak RSS: %ld kB\n", stats_peak_rss());
 }
 
-void process_bw(ctve_video_t *video)
+void print_stats_json(FILE *out, const ctve_stats_t *stats)
 {
-	static int count = 0;
-	for(int i = 0; i < video->length; ++i)
-		effects_apply_bw(&video->frames[i]);
+	fprintf(out, "{\n  \"frames\": %llu,\n  \"seconds\": %.6f,\n  \"fps\": %.3f,\n",
+		(unsigned long long)stats->frames, stats->seconds, stats->seconds > 0 ? stats->frames / stats->seconds : 0);
+	fprintf(out, "  \"bytes_read\": %llu,\n  \"bytes_written\": %llu,\n  \"bytes_copied\": %llu,\n",
+		(unsigned long long)stats->bytes_read, (unsigned long long)stats->bytes_written, (unsigned long long)stats->bytes_copied);
+	fprintf(out, "  \"frames_reused\": %llu,\n  \"tiles_reused\": %llu,\n  \"tiles_hashed\": %llu,\n",
+		(unsigned long long)stats->frames_reused, (unsigned long long)stats->tiles_reused, (unsigned long long)stats->tiles_hashed);
+	fprintf(out, "  \"batch_frames\": %u,\n  \"latency_frames\": %llu,\n  \"peak_rss_kb\": %ld,\n  \"stages\": {",
+		stats->batch_frames, (unsigned long long)stats->latency_frames, stats_peak_rss());
+
+	for(int i = 0; i < STATS_STAGES; ++i) {
+		const stats_timer_t *t = &stats->stages[i];
+
+		fprintf(out, "%s\n    \"%s\": { \"frames\": %llu, \"total_ms\": %.3f, \"p50_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f,\n      \"histogram_us\": [",
+			i ? "," : "", stats_stage_name(i), (unsigned long long)t->count, t->total_ns / 1e6,
+			stats_timer_percentile(t, 0.5) / 1e6, stats_timer_percentile(t, 0.99) / 1e6, t->max_ns / 1e6);
+
+		for(int b = 0; b < STATS_BUCKETS; ++b)
+			fprintf(out, "%s%llu", b ? ", " : "", (unsigned long long)t->buckets[b]);
+
+		fprintf(out, "] }");
+	}
+
+	fprintf(out, "\n  }\n}\n");
 }
 
-void process_sepia(ctve_video_t *video)
+/* Run the chain on a frame or on the part of it a region or --reuse hands over. */
+static void process_area(ctve_frame_t *frame, void *arg)
 {
-	for(int i = 0; i < video->length; ++i)
-		effects_apply_sepia(&video->frames[i]);
+	chain_apply((chain_t*)arg, frame);
 }
 
-void process_saturation(ctve_video_t *video)
+/**
+ * This function gets called for every batch of frames, see --stream and --mem-budget.
+ * They get read and saved into a video structure in RGB or YUV420P format.
+ * This function role is to alter the frames - do the processing.
+ * The saving is done automatically.
+ */
+void process_chain(ctve_video_t *video, void *user)
 {
-	for(int i = 0; i < video->length; ++i)
-		effects_saturation(&video->frames[i], conf.value[0], conf.value[1], conf.value[2]);
-}
\ No newline at end of file
+	work_t *work = (work_t*)user;
+
+	for(int i = 0; i < video->length; ++i) {
+		if(work->roi != NULL)
+			roi_apply(work->roi, &video->frames[i], chain_halo(work->chain), process_area, work->chain);
+		else if(work->reuse != NULL)
+			reuse_apply(work->reuse, &video->frames[i], chain_halo(work->chain), process_area, work->chain);
+		else
+			chain_apply(work->chain, &video->frames[i]);
+	}
+}
@@ -2,22 +2,106 @@
 #define MAIN_H
 
 #include "ctve.h"
+#include "chain.h"
+#include "roi.h"
+#include "reuse.h"
 #include <math.h>
 
 typedef struct {
 	char inFile[128];
 	char outFile[128];
-	char effect[32];
-	float value[3];
+	/* Effect chain, see chain_parse(). */
+	char effect[256];
+
+	/* Run decode/effect/encode as a threaded pipeline. */
+	int pipeline;
+
+	/* Effect worker threads, 0 means one per core. */
+	int threads;
+
+	/* Force an RGB layout even if the chain can run on YUV420P. */
+	int rgb;
+
+	/* Layout the effects run on, see ctve_frame_layout_name(); empty for the chain's pick. */
+	char layout[16];
+
+	/* Process and encode frame by frame. */
+	int stream;
+
+	/* Skip the work on unchanged frames and tiles, see reuse.h. */
+	int reuse;
+
+	/* Megabytes the batches in flight may take, 0 for the default. */
+	int memBudget;
+
+	/* Speed profile, preset and codec threading; empty or negative for the defaults. */
+	char profile[16];
+	char preset[16];
+	int codecThreads;
+	int threadType;
+
+	/* Keyframe-aligned segments processed in parallel, 0 for a single pass. */
+	int segments;
+
+	/* Seconds the effects apply to, see ctve_options_t; 0 for no bound. */
+	double from;
+	double to;
+
+	/* Size to scale frames to, or factor, see ctve_options_t; 0 keeps the input's. Scaler name, empty for bicubic. */
+	int width;
+	int height;
+	double scale;
+	char scaler[16];
+	/* Encoders' pixel format by FFmpeg's name, empty for yuv420p. */
+	char pixFmt[32];
+
+	/* Extra outputs of the same frames; their paths and presets point into renditionSpecs. */
+	ctve_rendition_t renditions[CTVE_MAX_RENDITIONS];
+	char renditionSpecs[CTVE_MAX_RENDITIONS][160];
+	int renditionCount;
+
+	/* Raw video formats in and out, see rawio.h; empty for containers. Size and rate of raw input without a header. */
+	char rawIn[16];
+	char rawOut[16];
+	int rawWidth;
+	int rawHeight;
+	double rawRate;
+
+	/* Seconds of video between checkpoints, 0 for none; pick up from the output's checkpoint. */
+	double checkpoint;
+	int resume;
+
+	/* Region the effects are limited to, see roi.h; all empty for the whole frame. */
+	char roi[256];
+	char roiFile[128];
+	char roiMask[128];
+
+	/* Socket to serve jobs on, see daemon.h; empty to run the one job of the command line. Jobs it runs at once. */
+	char daemon[108];
+	int daemonJobs;
+
+	/* Print per-stage timings; with statsFile, dump them there as JSON ("-" for stdout). */
+	int stats;
+	char statsFile[128];
 } conf_t;
 
 /* Grab user's configuration. */
 int parse_args(char **argv, int argc, conf_t *conf);
 
-/* Process some frames. */
-void process_blur(ctve_video_t *video);
-void process_bw(ctve_video_t *video);
-void process_sepia(ctve_video_t *video);
-void process_saturation(ctve_video_t *video);
+/* Per-stage report of a run, as a table or as JSON. */
+void print_stats(FILE *out, const ctve_stats_t *stats);
+void print_stats_json(FILE *out, const ctve_stats_t *stats);
+
+/* What process_chain() does to the frames of a video. */
+typedef struct {
+	chain_t *chain;
+	/* Region the chain is limited to, or NULL for whole frames. */
+	roi_t *roi;
+	/* Outputs of earlier frames, with --reuse; NULL otherwise. */
+	reuse_t *reuse;
+} work_t;
+
+/* Process some frames: run the work_t's effect chain on each of them. */
+void process_chain(ctve_video_t *video, void *user);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,162 @@
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+static pool_t *shared = NULL;
+
+/* Drop a job from the pending list once all its tasks are handed out. */
+static void pool_unlink(pool_t *pool, pool_job_t *job)
+{
+	pool_job_t **p = &pool->jobs;
+
+	while(*p != NULL && *p != job)
+		p = &(*p)->next_job;
+
+	if(*p != NULL)
+		*p = job->next_job;
+}
+
+/* Take the next task of a job. Called with the lock held. */
+static int pool_take(pool_t *pool, pool_job_t *job)
+{
+	int task = job->next++;
+
+	if(job->next == job->tasks)
+		pool_unlink(pool, job);
+
+	return task;
+}
+
+/* Run a task outside the lock and account for it. Called with the lock held. */
+static void pool_execute(pool_t *pool, pool_job_t *job, int task)
+{
+	pthread_mutex_unlock(&pool->lock);
+	job->func(job->arg, task);
+	pthread_mutex_lock(&pool->lock);
+
+	if(++job->done == job->tasks)
+		pthread_cond_broadcast(&pool->done);
+}
+
+static void *pool_worker(void *arg)
+{
+	pool_t *pool = (pool_t*)arg;
+
+	pthread_mutex_lock(&pool->lock);
+
+	for(;;) {
+		while(pool->jobs == NULL && !pool->quit)
+			pthread_cond_wait(&pool->work, &pool->lock);
+
+		if(pool->quit)
+			break;
+
+		pool_job_t *job = pool->jobs;
+		pool_execute(pool, job, pool_take(pool, job));
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+pool_t *pool_create(int threads)
+{
+	pool_t *pool = (pool_t*)malloc(sizeof(pool_t));
+
+	pool->count = threads > 1 ? threads - 1 : 0;
+	pool->threads = (pthread_t*)malloc((pool->count + 1) * sizeof(pthread_t));
+	pool->jobs = NULL;
+	pool->quit = 0;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	for(int i = 0; i < pool->count; ++i)
+		pthread_create(&pool->threads[i], NULL, pool_worker, pool);
+
+	return pool;
+}
+
+void pool_free(pool_t *pool)
+{
+	if(pool == NULL)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	for(int i = 0; i < pool->count; ++i)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->work);
+	pthread_cond_destroy(&pool->done);
+
+	free(pool->threads);
+	free(pool);
+}
+
+void pool_run(pool_t *pool, int tasks, pool_task_func func, void *arg)
+{
+	if(tasks <= 0)
+		return;
+
+	if(pool == NULL || pool->count == 0 || tasks == 1) {
+		for(int i = 0; i < tasks; ++i)
+			func(arg, i);
+		return;
+	}
+
+	pool_job_t job = { func, arg, tasks, 0, 0, NULL };
+
+	pthread_mutex_lock(&pool->lock);
+
+	/* Append, so jobs submitted earlier get served first. */
+	pool_job_t **p = &pool->jobs;
+	while(*p != NULL)
+		p = &(*p)->next_job;
+	*p = &job;
+
+	pthread_cond_broadcast(&pool->work);
+
+	/* Help out with our own job rather than sit idle. */
+	while(job.next < job.tasks)
+		pool_execute(pool, &job, pool_take(pool, &job));
+
+	while(job.done < job.tasks)
+		pthread_cond_wait(&pool->done, &pool->lock);
+
+	pthread_mutex_unlock(&pool->lock);
+}
+
+int pool_threads(pool_t *pool)
+{
+	return pool == NULL ? 1 : pool->count + 1;
+}
+
+void pool_init(int threads)
+{
+	if(threads <= 0)
+		threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+	pool_shutdown();
+
+	if(threads > 1)
+		shared = pool_create(threads);
+}
+
+void pool_shutdown(void)
+{
+	pool_free(shared);
+	shared = NULL;
+}
+
+pool_t *pool_get(void)
+{
+	return shared;
+}
@@ -0,0 +1,61 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+
+/**
+ * Persistent worker pool. pool_run() splits a job into independent
+ * tasks; the calling thread helps out and returns once all are done.
+ * Several threads may submit jobs at the same time.
+ */
+typedef void (*pool_task_func)(void *arg, int task);
+
+typedef struct pool_job
+{
+	pool_task_func func;
+	void *arg;
+
+	/* Task counters: handed out so far and completed so far. */
+	int tasks;
+	int next;
+	int done;
+
+	struct pool_job *next_job;
+} pool_job_t;
+
+typedef struct
+{
+	pthread_t *threads;
+	int count;
+
+	/* Jobs that still have tasks to hand out. */
+	pool_job_t *jobs;
+	int quit;
+
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+} pool_t;
+
+/* Create a pool where `threads` threads (the caller included) do the work. */
+pool_t *pool_create(int threads);
+
+/* Stop the workers and release the pool. */
+void pool_free(pool_t *pool);
+
+/* Run func(arg, 0..tasks-1) on the pool and wait. A NULL pool runs inline. */
+void pool_run(pool_t *pool, int tasks, pool_task_func func, void *arg);
+
+/* How many threads take part in a job, the caller included. */
+int pool_threads(pool_t *pool);
+
+/* Shared pool used by the effect kernels. threads <= 0 means one per core. */
+void pool_init(int threads);
+
+/* Release the shared pool. */
+void pool_shutdown(void);
+
+/* The shared pool, or NULL when effects run single-threaded. */
+pool_t *pool_get(void);
+
+#endif
@@ -0,0 +1,79 @@
+#include <stdlib.h>
+
+#include "queue.h"
+
+queue_t *queue_create(int capacity)
+{
+	queue_t *queue = (queue_t*)malloc(sizeof(queue_t));
+
+	queue->items = (void**)malloc(capacity * sizeof(void*));
+	queue->capacity = capacity;
+	queue->head = 0;
+	queue->length = 0;
+	queue->closed = 0;
+
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->not_empty, NULL);
+	pthread_cond_init(&queue->not_full, NULL);
+
+	return queue;
+}
+
+void queue_free(queue_t *queue)
+{
+	if(queue == NULL)
+		return;
+
+	pthread_mutex_destroy(&queue->lock);
+	pthread_cond_destroy(&queue->not_empty);
+	pthread_cond_destroy(&queue->not_full);
+
+	free(queue->items);
+	free(queue);
+}
+
+void queue_push(queue_t *queue, void *item)
+{
+	pthread_mutex_lock(&queue->lock);
+
+	while(queue->length == queue->capacity)
+		pthread_cond_wait(&queue->not_full, &queue->lock);
+
+	queue->items[(queue->head + queue->length) % queue->capacity] = item;
+	queue->length++;
+
+	pthread_cond_signal(&queue->not_empty);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+void *queue_pop(queue_t *queue)
+{
+	void *item = NULL;
+
+	pthread_mutex_lock(&queue->lock);
+
+	while(queue->length == 0 && !queue->closed)
+		pthread_cond_wait(&queue->not_empty, &queue->lock);
+
+	if(queue->length > 0) {
+		item = queue->items[queue->head];
+		queue->head = (queue->head + 1) % queue->capacity;
+		queue->length--;
+
+		pthread_cond_signal(&queue->not_full);
+	}
+
+	pthread_mutex_unlock(&queue->lock);
+
+	return item;
+}
+
+void queue_close(queue_t *queue)
+{
+	pthread_mutex_lock(&queue->lock);
+
+	queue->closed = 1;
+	pthread_cond_broadcast(&queue->not_empty);
+
+	pthread_mutex_unlock(&queue->lock);
+}
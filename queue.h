@@ -0,0 +1,40 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <pthread.h>
+
+/**
+ * Bounded blocking FIFO of pointers, used to join pipeline stages.
+ * A full queue blocks the producer, which gives back-pressure.
+ */
+typedef struct
+{
+	void **items;
+	int capacity;
+	int head;
+	int length;
+
+	/* Set once the producer is done; pop() then drains and returns NULL. */
+	int closed;
+
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+} queue_t;
+
+/* Create a queue holding at most capacity items. */
+queue_t *queue_create(int capacity);
+
+/* Release the queue. Items still inside are not touched. */
+void queue_free(queue_t *queue);
+
+/* Append an item, waiting while the queue is full. */
+void queue_push(queue_t *queue, void *item);
+
+/* Remove the oldest item, waiting while empty. NULL once closed and drained. */
+void *queue_pop(queue_t *queue);
+
+/* Mark end of stream and wake up every waiting consumer. */
+void queue_close(queue_t *queue);
+
+#endif
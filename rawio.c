@@ -0,0 +1,373 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "rawio.h"
+#include "util.h"
+
+/* The real stdout, once rawio_claim_stdout() moved the messages off it; -1 before. */
+static int stdoutFd = -1;
+
+rawio_format_t rawio_parse_format(const char *name)
+{
+	if(strcmp(name, "rgb24") == 0)
+		return RAWIO_RGB24;
+	if(strcmp(name, "yuv420p") == 0)
+		return RAWIO_YUV420P;
+	if(strcmp(name, "y4m") == 0)
+		return RAWIO_Y4M;
+
+	return RAWIO_NONE;
+}
+
+ctve_frame_pixel_t rawio_pixel_type(rawio_format_t format)
+{
+	return format == RAWIO_RGB24 ? RGB : YUV420P;
+}
+
+void rawio_claim_stdout(void)
+{
+	if(stdoutFd >= 0)
+		return;
+
+	fflush(stdout);
+	stdoutFd = dup(STDOUT_FILENO);
+	dup2(STDERR_FILENO, STDOUT_FILENO);
+}
+
+/* Bytes in a row of a plane of the pictures, and how many rows it has. */
+static void rawio_plane(rawio_t *raw, int plane, int *bytes, int *rows)
+{
+	if(raw->pixel_type == RGB) {
+		*bytes = 3 * raw->width;
+		*rows = raw->height;
+	} else {
+		*bytes = plane == 0 ? raw->width : (raw->width + 1) / 2;
+		*rows = plane == 0 ? raw->height : (raw->height + 1) / 2;
+	}
+}
+
+/* Size and layout of the pictures, once the format and the size are known. */
+static void rawio_geometry(rawio_t *raw)
+{
+	raw->pixel_type = rawio_pixel_type(raw->format);
+	raw->frameSize = 0;
+
+	for(int p = 0; p < ctve_frame_planes(raw->pixel_type); ++p) {
+		int bytes, rows;
+
+		rawio_plane(raw, p, &bytes, &rows);
+		raw->frameSize += (size_t)bytes * rows;
+	}
+}
+
+/**
+ * Read a line of text, without its '\n', into buf (cut to size - 1 bytes).
+ * Returns its length, or -1 if the input ended before it.
+ */
+static int rawio_line(rawio_t *raw, char *buf, int size)
+{
+	int length = 0, c;
+
+	for(;;) {
+		if(raw->map != NULL)
+			c = raw->offset < raw->size ? raw->map[raw->offset++] : EOF;
+		else
+			c = fgetc(raw->file);
+
+		if(c == EOF && length == 0)
+			return -1;
+		if(c == EOF || c == '\n')
+			break;
+
+		raw->bytes++;
+		if(length < size - 1)
+			buf[length++] = (char)c;
+	}
+
+	if(c == '\n')
+		raw->bytes++;
+
+	buf[length] = '\0';
+
+	return length;
+}
+
+/* Read the YUV4MPEG2 header: the size and rate. Returns -1 for what isn't 8-bit 4:2:0. */
+static int rawio_y4m_header(rawio_t *raw)
+{
+	/* 4:2:0 with its chroma sited one way or another; C420p10 and the like have deeper samples. */
+	static const char *spaces[] = { "C420", "C420jpeg", "C420paldv", "C420mpeg2" };
+	char line[1024];
+	char *save = NULL;
+
+	if(rawio_line(raw, line, sizeof(line)) < 0 || strncmp(line, "YUV4MPEG2 ", 10) != 0) {
+		fprintf(stderr, "Not a YUV4MPEG2 stream\n");
+		return -1;
+	}
+
+	for(char *tag = strtok_r(line + 10, " ", &save); tag != NULL; tag = strtok_r(NULL, " ", &save)) {
+		if(tag[0] == 'W')
+			raw->width = atoi(tag + 1);
+		else if(tag[0] == 'H')
+			raw->height = atoi(tag + 1);
+		else if(tag[0] == 'F')
+			sscanf(tag + 1, "%d:%d", &raw->rateNum, &raw->rateDen);
+		else if(tag[0] == 'C') {
+			int known = 0;
+
+			for(int i = 0; i < sizeof(spaces) / sizeof(spaces[0]); ++i)
+				known |= strcmp(tag, spaces[i]) == 0;
+
+			if(!known) {
+				fprintf(stderr, "YUV4MPEG2 colour space %s isn't supported, only 8-bit 4:2:0\n", tag + 1);
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+rawio_t *rawio_open_input(const char *path, rawio_format_t format, int width, int height, double rate)
+{
+	rawio_t *raw = (rawio_t*)calloc(1, sizeof(rawio_t));
+	AVRational q = av_d2q(rate > 0 ? rate : 25, 1001000);
+	struct stat st;
+
+	raw->format = format;
+	raw->width = width;
+	raw->height = height;
+	raw->rateNum = q.num;
+	raw->rateDen = q.den;
+
+	if(strcmp(path, "-") == 0) {
+		raw->file = stdin;
+	} else {
+		int fd = open(path, O_RDONLY);
+
+		if(fd < 0 || fstat(fd, &st) < 0) {
+			fprintf(stderr, "Could not open %s\n", path);
+			if(fd >= 0)
+				close(fd);
+			free(raw);
+			return NULL;
+		}
+
+		/* A regular file is mapped; a fifo or a device is read like a pipe. */
+		if(S_ISREG(st.st_mode) && st.st_size > 0) {
+			raw->map = (uint8_t*)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+
+			if(raw->map == MAP_FAILED) {
+				fprintf(stderr, "Could not map %s\n", path);
+				close(fd);
+				free(raw);
+				return NULL;
+			}
+
+			raw->size = st.st_size;
+			madvise(raw->map, raw->size, MADV_SEQUENTIAL);
+			close(fd);
+		} else {
+			raw->file = fdopen(fd, "rb");
+		}
+	}
+
+	if((format == RAWIO_Y4M && rawio_y4m_header(raw) < 0) || raw->width <= 0 || raw->height <= 0 ||
+		raw->width > 65534 || raw->height > 65534 || raw->rateNum <= 0 || raw->rateDen <= 0) {
+		if(format != RAWIO_Y4M)
+			fprintf(stderr, "Raw video needs a size\n");
+		rawio_close(raw);
+		return NULL;
+	}
+
+	rawio_geometry(raw);
+
+	/* Rows without padding past what a pooled frame has, e.g. 1280 or 1920 wide. */
+	raw->inPlace = raw->map != NULL &&
+		ctve_frame_size(raw->width, raw->height, raw->pixel_type) == raw->frameSize;
+
+	return raw;
+}
+
+/* Skip the FRAME line before a YUV4MPEG2 picture. Returns 1, 0 at the end, -1 on garbage. */
+static int rawio_y4m_frame(rawio_t *raw)
+{
+	char line[256];
+
+	if(rawio_line(raw, line, sizeof(line)) < 0)
+		return 0;
+
+	if(strncmp(line, "FRAME", 5) != 0) {
+		fprintf(stderr, "YUV4MPEG2 frame %llu has no FRAME line\n", (unsigned long long)raw->frames);
+		return -1;
+	}
+
+	return 1;
+}
+
+int rawio_read(rawio_t *raw, ctve_frame_t *frame)
+{
+	int ret;
+
+	if(raw->format == RAWIO_Y4M && (ret = rawio_y4m_frame(raw)) <= 0)
+		return ret;
+
+	if(raw->map != NULL && raw->size - raw->offset < raw->frameSize) {
+		if(raw->offset < raw->size)
+			fprintf(stderr, "Dropping a partial frame at the end of the input\n");
+		return 0;
+	}
+
+	frame->width = raw->width;
+	frame->height = raw->height;
+	frame->pixel_type = raw->pixel_type;
+
+	/* FRAME lines of YUV4MPEG2 may leave a picture off the alignment the kernels count on. */
+	if(raw->inPlace && (uintptr_t)(raw->map + raw->offset) % CTVE_FRAME_ALIGN == 0) {
+		/* The picture is the frame: no buffer of the pool. */
+		ctve_frame_unref(frame);
+
+		frame->data = raw->map + raw->offset;
+		frame->rows = 0;
+		frame->stride = ctve_frame_stride(frame->width, frame->pixel_type);
+		frame->length = raw->frameSize;
+	} else {
+		/* Someone still holds on to the last frame here, or it pointed into the map. */
+		if(frame->buf == NULL || !av_buffer_is_writable(frame->buf)) {
+			ctve_frame_unref(frame);
+
+			if(ctve_frame_alloc(frame) < 0) {
+				fprintf(stderr, "Could not allocate frame buffer\n");
+				return -1;
+			}
+		}
+
+		/* Row by row, onto the padded rows of the frame. */
+		const uint8_t *src = raw->map != NULL ? raw->map + raw->offset : NULL;
+
+		for(int p = 0; p < ctve_frame_planes(frame->pixel_type); ++p) {
+			uint8_t *dst = ctve_frame_plane(frame, p);
+			int bytes, rows;
+
+			rawio_plane(raw, p, &bytes, &rows);
+
+			for(int i = 0; i < rows; ++i, dst += ctve_frame_linesize(frame, p)) {
+				if(src != NULL) {
+					memcpy(dst, src, bytes);
+					src += bytes;
+				} else if(fread(dst, 1, bytes, raw->file) != bytes) {
+					if(i > 0 || p > 0)
+						fprintf(stderr, "Dropping a partial frame at the end of the input\n");
+					return ferror(raw->file) ? -1 : 0;
+				}
+			}
+		}
+
+		if(src != NULL)
+			ctve_count_copy(frame->counters, raw->frameSize);
+	}
+
+	if(raw->map != NULL)
+		raw->offset += raw->frameSize;
+
+	raw->frames++;
+	raw->bytes += raw->frameSize;
+
+	return 1;
+}
+
+void rawio_release(rawio_t *raw)
+{
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	size_t end;
+
+	if(raw == NULL || raw->map == NULL)
+		return;
+
+	/* The page the next frame starts in stays. */
+	end = raw->offset / page * page;
+
+	if(end > raw->released) {
+		madvise(raw->map + raw->released, end - raw->released, MADV_DONTNEED);
+		raw->released = end;
+	}
+}
+
+rawio_t *rawio_open_output(const char *path, rawio_format_t format, int width, int height, int rateNum, int rateDen)
+{
+	rawio_t *raw = (rawio_t*)calloc(1, sizeof(rawio_t));
+
+	raw->format = format;
+	raw->width = width;
+	raw->height = height;
+	raw->rateNum = rateNum;
+	raw->rateDen = rateDen;
+	rawio_geometry(raw);
+
+	/* Nothing else may go to stdout then. */
+	if(strcmp(path, "-") == 0) {
+		rawio_claim_stdout();
+		raw->file = fdopen(dup(stdoutFd), "wb");
+	} else
+		raw->file = fopen(path, "wb");
+
+	if(raw->file == NULL) {
+		fprintf(stderr, "Could not open %s\n", path);
+		free(raw);
+		return NULL;
+	}
+
+	if(format == RAWIO_Y4M) {
+		int n = fprintf(raw->file, "YUV4MPEG2 W%d H%d F%d:%d Ip A1:1 C420jpeg\n", width, height, rateNum, rateDen);
+
+		raw->bytes += MAX(n, 0);
+	}
+
+	return raw;
+}
+
+int rawio_write(rawio_t *raw, uint8_t *const data[3], const int linesize[3])
+{
+	if(raw->format == RAWIO_Y4M) {
+		if(fputs("FRAME\n", raw->file) < 0)
+			return -1;
+
+		raw->bytes += 6;
+	}
+
+	for(int p = 0; p < ctve_frame_planes(raw->pixel_type); ++p) {
+		int bytes, rows;
+
+		rawio_plane(raw, p, &bytes, &rows);
+
+		for(int i = 0; i < rows; ++i) {
+			if(fwrite(data[p] + (size_t)i * linesize[p], 1, bytes, raw->file) != bytes)
+				return -1;
+		}
+	}
+
+	raw->frames++;
+	raw->bytes += raw->frameSize;
+
+	return 0;
+}
+
+int64_t rawio_close(rawio_t *raw)
+{
+	int64_t bytes;
+
+	if(raw == NULL)
+		return 0;
+
+	if(raw->map != NULL)
+		munmap(raw->map, raw->size);
+	if(raw->file != NULL && raw->file != stdin)
+		fclose(raw->file);
+
+	bytes = raw->bytes;
+	free(raw);
+
+	return bytes;
+}
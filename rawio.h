@@ -0,0 +1,104 @@
+#ifndef RAWIO_H
+#define RAWIO_H
+
+#include <stdio.h>
+
+#include "ctve.h"
+
+/* Raw video formats, see ctve_options_t. */
+typedef enum
+{
+	RAWIO_NONE = 0,
+	/* Packed RGB24 pictures back to back. */
+	RAWIO_RGB24,
+	/* Planar YUV 4:2:0 pictures back to back, Y then U then V. */
+	RAWIO_YUV420P,
+	/* YUV4MPEG2: a header with the size and rate, then "FRAME" and a 4:2:0 picture each. */
+	RAWIO_Y4M,
+} rawio_format_t;
+
+/**
+ * Raw video read or written without a codec, frame by frame. "-" is
+ * stdin or stdout; regular input files are mapped, so frames whose rows
+ * are laid out like a pooled frame's can point straight into the file.
+ */
+typedef struct
+{
+	rawio_format_t format;
+	/* Pipe or output file; NULL for a mapped input. */
+	FILE *file;
+
+	/**
+	 * Mapped input: private and writable, so effects work on it in place
+	 * (the kernel copies the pages they write to). Bytes up to offset are
+	 * read, bytes up to released given back, see rawio_release().
+	 */
+	uint8_t *map;
+	size_t size;
+	size_t offset;
+	size_t released;
+	/**
+	 * Frames point into the map rather than get copied out of it, those
+	 * that start CTVE_FRAME_ALIGN aligned in it.
+	 */
+	int inPlace;
+
+	uint16_t width;
+	uint16_t height;
+	/* RGB or YUV420P, the layout of the pictures. */
+	ctve_frame_pixel_t pixel_type;
+	int rateNum;
+	int rateDen;
+	/* Bytes of a picture, without the FRAME line of YUV4MPEG2. */
+	size_t frameSize;
+
+	/* Frames and bytes read or written so far. */
+	uint64_t frames;
+	uint64_t bytes;
+} rawio_t;
+
+/* Format by name: "rgb24", "yuv420p" or "y4m"; RAWIO_NONE for any other. */
+rawio_format_t rawio_parse_format(const char *name);
+
+/* Layout of a format's pictures: RGB or YUV420P. */
+ctve_frame_pixel_t rawio_pixel_type(rawio_format_t format);
+
+/**
+ * Keep stdout for the video written to "-", and send everything else
+ * printed there to stderr from now on. rawio_open_output() does it for
+ * "-"; call it before printing anything to keep that off the video too.
+ */
+void rawio_claim_stdout(void);
+
+/**
+ * Open raw input, "-" for stdin. YUV4MPEG2 has the size and rate in its
+ * header; the others take width x height and rate frames per second (25
+ * if 0). Returns NULL, having said why, if it can't be read.
+ */
+rawio_t *rawio_open_input(const char *path, rawio_format_t format, int width, int height, double rate);
+
+/**
+ * Read the next picture into frame: pointed into the map when it can
+ * be, its pooled buffer released; else copied into a writable pooled
+ * buffer. Returns 1, 0 at the end of the input, or -1 on an error.
+ * Frames pointed into the map have no buffer to share with later ones.
+ */
+int rawio_read(rawio_t *raw, ctve_frame_t *frame);
+
+/**
+ * Give back the pages of the frames read so far, once they are written:
+ * memory stays flat on long inputs, and in-place effects don't leave
+ * copied pages behind. Frames read before must not be used any more.
+ */
+void rawio_release(rawio_t *raw);
+
+/* Open raw output, "-" for stdout. Returns NULL if it can't be created. */
+rawio_t *rawio_open_output(const char *path, rawio_format_t format, int width, int height, int rateNum, int rateDen);
+
+/* Write a picture given plane by plane, with the bytes between two rows. Returns 0, or -1 on an error. */
+int rawio_write(rawio_t *raw, uint8_t *const data[3], const int linesize[3]);
+
+/* Close input or output. Returns the bytes read or written. */
+int64_t rawio_close(rawio_t *raw);
+
+#endif
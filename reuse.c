@@ -0,0 +1,288 @@
+#include "reuse.h"
+#include "pool.h"
+#include "util.h"
+
+/* Tile rows of a frame to hash, one per task. */
+typedef struct
+{
+	reuse_t *reuse;
+	ctve_frame_t *frame;
+} reuse_job_t;
+
+reuse_t *reuse_create(void)
+{
+	reuse_t *reuse = (reuse_t*)calloc(1, sizeof(reuse_t));
+
+	reuse->last = -1;
+
+	return reuse;
+}
+
+void reuse_reset(reuse_t *reuse)
+{
+	if(reuse == NULL)
+		return;
+
+	for(int i = 0; i < REUSE_FRAMES; ++i) {
+		if(reuse->entries[i].hash != 0)
+			ctve_frame_unref(&reuse->entries[i].output);
+
+		reuse->entries[i].hash = 0;
+	}
+
+	reuse->last = -1;
+	reuse->next = 0;
+}
+
+void reuse_free(reuse_t *reuse)
+{
+	if(reuse == NULL)
+		return;
+
+	reuse_reset(reuse);
+
+	for(int i = 0; i < REUSE_FRAMES; ++i)
+		free(reuse->entries[i].tiles);
+
+	free(reuse->tiles);
+	free(reuse->dirty);
+	free(reuse->rects);
+	free(reuse);
+}
+
+/* Start over with buffers for frames of another size or layout. */
+static void reuse_geometry(reuse_t *reuse, const ctve_frame_t *frame)
+{
+	if(reuse->tiles != NULL && reuse->width == frame->width && reuse->height == frame->height &&
+		reuse->pixel_type == frame->pixel_type)
+		return;
+
+	reuse_reset(reuse);
+
+	reuse->width = frame->width;
+	reuse->height = frame->height;
+	reuse->pixel_type = frame->pixel_type;
+	reuse->cols = (frame->width + REUSE_TILE - 1) / REUSE_TILE;
+	reuse->rows = (frame->height + REUSE_TILE - 1) / REUSE_TILE;
+
+	int count = reuse->cols * reuse->rows;
+
+	for(int i = 0; i < REUSE_FRAMES; ++i)
+		reuse->entries[i].tiles = (uint64_t*)realloc(reuse->entries[i].tiles, count * sizeof(uint64_t));
+
+	reuse->tiles = (uint64_t*)realloc(reuse->tiles, count * sizeof(uint64_t));
+	reuse->dirty = (uint8_t*)realloc(reuse->dirty, count);
+	reuse->rects = (roi_rect_t*)realloc(reuse->rects, count * sizeof(roi_rect_t));
+}
+
+static inline uint64_t reuse_mix(uint64_t h, uint64_t v)
+{
+	h ^= v * 0x9e3779b97f4a7c15ULL;
+
+	return (h << 27 | h >> 37) * 0xc2b2ae3d27d4eb4fULL;
+}
+
+/* Hash len bytes into h, eight at a time. */
+static uint64_t reuse_hash_bytes(uint64_t h, const uint8_t *p, int len)
+{
+	uint64_t v;
+	int i = 0;
+
+	for(; i + 8 <= len; i += 8) {
+		memcpy(&v, p + i, 8);
+		h = reuse_mix(h, v);
+	}
+
+	v = len;
+	for(; i < len; ++i)
+		v = v << 8 | p[i];
+
+	return reuse_mix(h, v);
+}
+
+/* Hash of the samples of a tile, every plane's. */
+static uint64_t reuse_tile_hash(ctve_frame_t *frame, int r, int c)
+{
+	int bytes = roi_pixel_bytes(frame);
+	uint64_t h = 0;
+
+	for(int p = 0; p < ctve_frame_planes(frame->pixel_type); ++p) {
+		int shift = p > 0 && frame->pixel_type == YUV420P;
+		int x0 = (c * REUSE_TILE) >> shift;
+		int x1 = MIN(ctve_frame_plane_width(frame, p) / bytes, ((c + 1) * REUSE_TILE) >> shift);
+		int y0 = (r * REUSE_TILE) >> shift;
+		int y1 = MIN(ctve_frame_plane_height(frame, p), ((r + 1) * REUSE_TILE) >> shift);
+		const uint8_t *plane = ctve_frame_plane(frame, p);
+		int linesize = ctve_frame_linesize(frame, p);
+
+		for(int y = y0; y < y1; ++y)
+			h = reuse_hash_bytes(h, plane + y * linesize + x0 * bytes, (x1 - x0) * bytes);
+	}
+
+	/* Final avalanche, so that nearby tiles don't end up with nearby hashes. */
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+
+	return h ^ (h >> 33);
+}
+
+static void reuse_hash_row(void *arg, int task)
+{
+	reuse_job_t *job = (reuse_job_t*)arg;
+	reuse_t *reuse = job->reuse;
+
+	for(int c = 0; c < reuse->cols; ++c)
+		reuse->tiles[task * reuse->cols + c] = reuse_tile_hash(job->frame, task, c);
+}
+
+/**
+ * Mark the tiles whose output may change: those whose input differs from
+ * the previous frame's, and every tile within `reach` tiles of one.
+ * Returns how many there are.
+ */
+static int reuse_mark(reuse_t *reuse, const reuse_entry_t *prev, int reach)
+{
+	int cols = reuse->cols, rows = reuse->rows;
+	int count = 0;
+
+	memset(reuse->dirty, 0, cols * rows);
+
+	for(int r = 0; r < rows; ++r) {
+		for(int c = 0; c < cols; ++c) {
+			if(prev != NULL && prev->tiles[r * cols + c] == reuse->tiles[r * cols + c])
+				continue;
+
+			for(int y = MAX(0, r - reach); y <= MIN(rows - 1, r + reach); ++y)
+				memset(reuse->dirty + y * cols + MAX(0, c - reach), 1, MIN(cols - 1, c + reach) - MAX(0, c - reach) + 1);
+		}
+	}
+
+	for(int i = 0; i < cols * rows; ++i)
+		count += reuse->dirty[i];
+
+	return count;
+}
+
+/* Runs of tiles of a row with this dirty state, as rectangles in pixels clipped to the frame. */
+static int reuse_runs(reuse_t *reuse, int r, int dirty, roi_rect_t *rects)
+{
+	const uint8_t *tiles = reuse->dirty + r * reuse->cols;
+	int count = 0;
+
+	for(int c = 0; c < reuse->cols; ) {
+		int end = c;
+
+		while(end < reuse->cols && tiles[end] == dirty)
+			end++;
+
+		if(end > c) {
+			int x = c * REUSE_TILE, y = r * REUSE_TILE;
+
+			rects[count++] = (roi_rect_t){ x, y, MIN(reuse->width, end * REUSE_TILE) - x, MIN(reuse->height, y + REUSE_TILE) - y };
+		}
+
+		c = MAX(end, c + 1);
+	}
+
+	return count;
+}
+
+/* Remember the frame's output under its hashes, in place of the oldest entry. */
+static void reuse_store(reuse_t *reuse, ctve_frame_t *frame, uint64_t hash)
+{
+	reuse_entry_t *entry = &reuse->entries[reuse->next];
+
+	if(entry->hash != 0)
+		ctve_frame_unref(&entry->output);
+
+	entry->output = *frame;
+	entry->output.buf = av_buffer_ref(frame->buf);
+	entry->hash = entry->output.buf != NULL ? hash : 0;
+	memcpy(entry->tiles, reuse->tiles, reuse->cols * reuse->rows * sizeof(uint64_t));
+
+	reuse->last = entry->hash != 0 ? reuse->next : -1;
+	reuse->next = (reuse->next + 1) % REUSE_FRAMES;
+}
+
+void reuse_apply(reuse_t *reuse, ctve_frame_t *frame, int halo, roi_apply_func apply, void *arg)
+{
+	if(!reuse || !frame)
+		return;
+
+	/* Nothing to hold on to. */
+	if(frame->buf == NULL) {
+		apply(frame, arg);
+		return;
+	}
+
+	reuse_geometry(reuse, frame);
+
+	reuse_job_t job = { reuse, frame };
+	int count = reuse->cols * reuse->rows;
+	uint64_t hash = 0;
+
+	pool_run(pool_get(), reuse->rows, reuse_hash_row, &job);
+
+	for(int i = 0; i < count; ++i)
+		hash = reuse_mix(hash, reuse->tiles[i]);
+	hash |= 1;
+
+	/* A frame seen before: its output as it is, the buffer shared. */
+	for(int i = 0; i < REUSE_FRAMES; ++i) {
+		reuse_entry_t *entry = &reuse->entries[i];
+		AVBufferRef *buf;
+
+		if(entry->hash != hash || memcmp(entry->tiles, reuse->tiles, count * sizeof(uint64_t)) != 0)
+			continue;
+
+		if((buf = av_buffer_ref(entry->output.buf)) == NULL)
+			break;
+
+		ctve_frame_unref(frame);
+		frame->buf = buf;
+		frame->data = buf->data;
+		frame->rows = entry->output.rows;
+		frame->length = entry->output.length;
+
+		reuse->last = i;
+		ctve_count_reuse(frame->counters, 1, count, count);
+		return;
+	}
+
+	reuse_entry_t *prev = reuse->last >= 0 ? &reuse->entries[reuse->last] : NULL;
+	int dirty = reuse_mark(reuse, prev, (halo + REUSE_TILE - 1) / REUSE_TILE);
+
+	if(dirty == count) {
+		apply(frame, arg);
+	} else {
+		int rects = 0;
+
+		for(int r = 0; r < reuse->rows; ++r)
+			rects += reuse_runs(reuse, r, 1, reuse->rects + rects);
+
+		/* Changed tiles, processed from the input with their halo. */
+		if(rects > 0) {
+			roi_t *roi = roi_from_rects(reuse->rects, rects);
+
+			roi_apply(roi, frame, halo, apply, arg);
+			roi_free(roi);
+		}
+
+		/* The others come out as last time. */
+		for(int r = 0; r < reuse->rows; ++r) {
+			int runs = reuse_runs(reuse, r, 0, reuse->rects);
+
+			for(int i = 0; i < runs; ++i) {
+				roi_rect_t *run = &reuse->rects[i];
+
+				roi_copy(frame, run->x, run->y, &prev->output, run->x, run->y, run->width, run->height);
+			}
+		}
+	}
+
+	ctve_count_reuse(frame->counters, 0, count - dirty, count);
+
+	/* The frame's buffer may have been swapped by apply. */
+	if(frame->buf != NULL)
+		reuse_store(reuse, frame, hash);
+}
@@ -0,0 +1,70 @@
+#ifndef REUSE_H
+#define REUSE_H
+
+#include "ctve.h"
+#include "roi.h"
+
+/* Side of the square tiles inputs are compared in, in pixels; the same as a region's. */
+#define REUSE_TILE	ROI_TILE
+
+/* Distinct frames remembered, so that a slideshow going back to a slide finds it. */
+#define REUSE_FRAMES	4
+
+/* Output of a frame seen before, with the hashes of its input. */
+typedef struct
+{
+	/* Hash of the whole input, 0 for an empty entry. */
+	uint64_t hash;
+	/* Hash of every tile of the input, row by row. */
+	uint64_t *tiles;
+	/* Processed frame, a reference to its pooled buffer. */
+	ctve_frame_t output;
+} reuse_entry_t;
+
+/**
+ * Skips the work on inputs that didn't change. Every frame gets a 64-bit
+ * hash per tile and one over those. A frame hashing like one of the last
+ * REUSE_FRAMES distinct ones takes its output as it is. Otherwise only the
+ * tiles that differ from the previous frame are processed, along with the
+ * tiles within halo pixels of them, and the others keep the previous
+ * output. The work must only depend on the frame's own pixels, which rules
+ * out temporal effects: the result is then the same as processing every
+ * frame whole, short of a 64-bit hash collision.
+ */
+typedef struct
+{
+	reuse_entry_t entries[REUSE_FRAMES];
+	/* Entry of the previous frame, -1 if none; entry replaced next. */
+	int last;
+	int next;
+
+	/* Geometry the entries are for. */
+	uint16_t width;
+	uint16_t height;
+	ctve_frame_pixel_t pixel_type;
+	int cols;
+	int rows;
+
+	/* Hashes of the current frame, and the tiles to process. */
+	uint64_t *tiles;
+	uint8_t *dirty;
+	roi_rect_t *rects;
+} reuse_t;
+
+/* Create an empty cache. */
+reuse_t *reuse_create(void);
+
+/* Release it, along with the outputs it holds. */
+void reuse_free(reuse_t *reuse);
+
+/* Forget every frame, e.g. when the work changes. */
+void reuse_reset(reuse_t *reuse);
+
+/**
+ * Run apply on what changed of the frame, with halo pixels of input
+ * around it, and fill the rest from earlier outputs. apply works as for
+ * roi_apply(). Frames whose buffer isn't pooled are processed whole.
+ */
+void reuse_apply(reuse_t *reuse, ctve_frame_t *frame, int halo, roi_apply_func apply, void *arg);
+
+#endif
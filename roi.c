@@ -0,0 +1,618 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "roi.h"
+#include "util.h"
+
+/* How much of a tile the region covers. */
+enum
+{
+	ROI_OUT,
+	ROI_PARTIAL,
+	ROI_FULL,
+};
+
+/* The region on one frame. */
+typedef struct
+{
+	int width;
+	int height;
+	int cols;
+	int rows;
+	/* State of every tile, row by row. */
+	uint8_t *tiles;
+	/* Rectangles in effect, or NULL for the mask. */
+	const roi_key_t *key;
+	const uint8_t *mask;
+} roi_region_t;
+
+static roi_t *roi_create(void)
+{
+	roi_t *roi = (roi_t*)calloc(1, sizeof(roi_t));
+
+	pthread_mutex_init(&roi->lock, NULL);
+
+	return roi;
+}
+
+void roi_free(roi_t *roi)
+{
+	if(roi == NULL)
+		return;
+
+	for(int i = 0; i < roi->count; ++i)
+		free(roi->keys[i].rects);
+
+	free(roi->keys);
+	free(roi->mask);
+	free(roi->scaled);
+	free(roi->tiles);
+	pthread_mutex_destroy(&roi->lock);
+	free(roi);
+}
+
+/* Append the rectangles of text, separated by any of sep, to a new key. */
+static int roi_parse_key(roi_t *roi, double time, char *text, const char *sep)
+{
+	roi_key_t *key;
+	char *save = NULL;
+
+	roi->keys = (roi_key_t*)realloc(roi->keys, (roi->count + 1) * sizeof(roi_key_t));
+	key = &roi->keys[roi->count++];
+	key->time = time;
+	key->rects = NULL;
+	key->count = 0;
+
+	for(char *token = strtok_r(text, sep, &save); token != NULL; token = strtok_r(NULL, sep, &save)) {
+		roi_rect_t rect;
+		char end;
+
+		if(sscanf(token, "%d,%d,%d,%d%c", &rect.x, &rect.y, &rect.width, &rect.height, &end) != 4 ||
+			rect.x < 0 || rect.y < 0 || rect.width <= 0 || rect.height <= 0) {
+			fprintf(stderr, "Invalid rectangle '%s', expected <x>,<y>,<width>,<height>\n", token);
+			return -1;
+		}
+
+		key->rects = (roi_rect_t*)realloc(key->rects, (key->count + 1) * sizeof(roi_rect_t));
+		key->rects[key->count++] = rect;
+	}
+
+	return 0;
+}
+
+roi_t *roi_parse_rects(const char *spec)
+{
+	roi_t *roi = roi_create();
+	char *copy = strdup(spec);
+	int ret = roi_parse_key(roi, 0, copy, "+");
+
+	free(copy);
+
+	if(ret < 0 || roi->keys[0].count == 0) {
+		if(ret == 0)
+			fprintf(stderr, "No rectangle in '%s'\n", spec);
+
+		roi_free(roi);
+		return NULL;
+	}
+
+	return roi;
+}
+
+roi_t *roi_from_rects(const roi_rect_t *rects, int count)
+{
+	roi_t *roi = roi_create();
+
+	roi->keys = (roi_key_t*)malloc(sizeof(roi_key_t));
+	roi->keys[0].time = 0;
+	roi->keys[0].rects = (roi_rect_t*)malloc(MAX(1, count) * sizeof(roi_rect_t));
+	roi->keys[0].count = count;
+	roi->count = 1;
+
+	memcpy(roi->keys[0].rects, rects, count * sizeof(roi_rect_t));
+
+	return roi;
+}
+
+static int roi_key_compare(const void *a, const void *b)
+{
+	double ta = ((const roi_key_t*)a)->time;
+	double tb = ((const roi_key_t*)b)->time;
+
+	return ta < tb ? -1 : ta > tb;
+}
+
+roi_t *roi_load_sidecar(const char *path)
+{
+	FILE *file = fopen(path, "r");
+	char line[4096];
+	int number = 0;
+
+	if(file == NULL) {
+		perror(path);
+		return NULL;
+	}
+
+	roi_t *roi = roi_create();
+
+	while(fgets(line, sizeof(line), file) != NULL) {
+		char *text = line;
+		double time;
+		int used;
+
+		number++;
+
+		while(isspace((unsigned char)*text))
+			text++;
+
+		if(*text == '\0' || *text == '#')
+			continue;
+
+		if(sscanf(text, "%lf%n", &time, &used) != 1 || time < 0 || roi_parse_key(roi, time, text + used, " \t\r\n") < 0) {
+			fprintf(stderr, "%s:%d: expected <seconds> <x>,<y>,<width>,<height> ...\n", path, number);
+			fclose(file);
+			roi_free(roi);
+			return NULL;
+		}
+	}
+
+	fclose(file);
+
+	if(roi->count == 0) {
+		fprintf(stderr, "%s: no region in there\n", path);
+		roi_free(roi);
+		return NULL;
+	}
+
+	qsort(roi->keys, roi->count, sizeof(roi_key_t), roi_key_compare);
+
+	return roi;
+}
+
+/* Next number of a PGM header, past blanks and comments. */
+static int roi_pgm_value(FILE *file, int *value)
+{
+	int c = fgetc(file);
+
+	while(c == '#' || isspace(c)) {
+		if(c == '#') {
+			while(c != '\n' && c != EOF)
+				c = fgetc(file);
+		}
+
+		c = fgetc(file);
+	}
+
+	if(c == EOF)
+		return -1;
+
+	ungetc(c, file);
+
+	return fscanf(file, "%d", value) == 1 ? 0 : -1;
+}
+
+roi_t *roi_load_mask(const char *path)
+{
+	FILE *file = fopen(path, "rb");
+	int width, height, maxval;
+
+	if(file == NULL) {
+		perror(path);
+		return NULL;
+	}
+
+	/* One whitespace byte ends the header. */
+	if(fgetc(file) != 'P' || fgetc(file) != '5' || roi_pgm_value(file, &width) < 0 || roi_pgm_value(file, &height) < 0 ||
+		roi_pgm_value(file, &maxval) < 0 || !isspace(fgetc(file)) ||
+		width <= 0 || height <= 0 || maxval <= 0 || maxval > 255) {
+		fprintf(stderr, "%s: not an 8-bit binary PGM (P5) file\n", path);
+		fclose(file);
+		return NULL;
+	}
+
+	roi_t *roi = roi_create();
+
+	roi->mask = (uint8_t*)malloc(width * height);
+	roi->maskWidth = width;
+	roi->maskHeight = height;
+
+	if(fread(roi->mask, 1, width * height, file) != (size_t)(width * height)) {
+		fprintf(stderr, "%s: truncated\n", path);
+		fclose(file);
+		roi_free(roi);
+		return NULL;
+	}
+
+	fclose(file);
+
+	/* Full scale is 255, whatever the file's is. */
+	for(int i = 0; maxval != 255 && i < width * height; ++i)
+		roi->mask[i] = MIN(roi->mask[i], maxval) * 255 / maxval;
+
+	return roi;
+}
+
+/**
+ * Stretch the mask to width x height and sort its tiles, unless already
+ * done for that size. Frames of one run all have the same size, so the
+ * scaled mask stays put once there.
+ */
+static void roi_scale_mask(roi_t *roi, int width, int height, int cols, int rows)
+{
+	pthread_mutex_lock(&roi->lock);
+
+	if(roi->scaledWidth != width || roi->scaledHeight != height) {
+		free(roi->scaled);
+		free(roi->tiles);
+
+		roi->scaled = (uint8_t*)malloc(width * height);
+		roi->tiles = (uint8_t*)malloc(cols * rows);
+
+		for(int y = 0; y < height; ++y) {
+			const uint8_t *src = roi->mask + (int64_t)y * roi->maskHeight / height * roi->maskWidth;
+
+			for(int x = 0; x < width; ++x)
+				roi->scaled[y * width + x] = src[(int64_t)x * roi->maskWidth / width];
+		}
+
+		for(int r = 0; r < rows; ++r) {
+			for(int c = 0; c < cols; ++c) {
+				int any = 0, all = 1;
+
+				for(int y = r * ROI_TILE; y < MIN(height, (r + 1) * ROI_TILE); ++y) {
+					for(int x = c * ROI_TILE; x < MIN(width, (c + 1) * ROI_TILE); ++x) {
+						any |= roi->scaled[y * width + x] != 0;
+						all &= roi->scaled[y * width + x] == 255;
+					}
+				}
+
+				roi->tiles[r * cols + c] = all ? ROI_FULL : (any ? ROI_PARTIAL : ROI_OUT);
+			}
+		}
+
+		roi->scaledWidth = width;
+		roi->scaledHeight = height;
+	}
+
+	pthread_mutex_unlock(&roi->lock);
+}
+
+/* Key in effect at a time, NULL before the first one. */
+static const roi_key_t *roi_key(roi_t *roi, double time)
+{
+	const roi_key_t *key = NULL;
+	int lo = 0, hi = roi->count;
+
+	/* Frames of an unknown time count as the first one. */
+	time = MAX(0, time);
+
+	while(lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		if(roi->keys[mid].time <= time) {
+			key = &roi->keys[mid];
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return key;
+}
+
+/* Tiles of the region on a frame. Returns -1 if it has none. */
+static int roi_region(roi_t *roi, const ctve_frame_t *frame, roi_region_t *region)
+{
+	region->width = frame->width;
+	region->height = frame->height;
+	region->cols = (frame->width + ROI_TILE - 1) / ROI_TILE;
+	region->rows = (frame->height + ROI_TILE - 1) / ROI_TILE;
+	region->key = NULL;
+	region->mask = NULL;
+
+	if(roi->mask != NULL) {
+		roi_scale_mask(roi, frame->width, frame->height, region->cols, region->rows);
+		region->mask = roi->scaled;
+		region->tiles = roi->tiles;
+		return 0;
+	}
+
+	region->key = roi_key(roi, frame->time);
+	if(region->key == NULL || region->key->count == 0)
+		return -1;
+
+	region->tiles = (uint8_t*)calloc(region->cols * region->rows, 1);
+
+	for(int i = 0; i < region->key->count; ++i) {
+		const roi_rect_t *rect = &region->key->rects[i];
+		int x1 = MIN(frame->width, rect->x + rect->width);
+		int y1 = MIN(frame->height, rect->y + rect->height);
+
+		for(int r = rect->y / ROI_TILE; r * ROI_TILE < y1; ++r) {
+			for(int c = rect->x / ROI_TILE; c * ROI_TILE < x1; ++c) {
+				int full = rect->x <= c * ROI_TILE && rect->y <= r * ROI_TILE &&
+					x1 >= MIN(frame->width, (c + 1) * ROI_TILE) && y1 >= MIN(frame->height, (r + 1) * ROI_TILE);
+				uint8_t *tile = &region->tiles[r * region->cols + c];
+
+				*tile = MAX(*tile, full ? ROI_FULL : ROI_PARTIAL);
+			}
+		}
+	}
+
+	return 0;
+}
+
+static void roi_region_free(roi_region_t *region)
+{
+	/* A mask's tiles belong to the roi. */
+	if(region->mask == NULL)
+		free(region->tiles);
+}
+
+/**
+ * Areas to work on, in tiles: runs of touched tiles on a tile row, merged
+ * with the run right above when it spans the same columns. A rectangle
+ * makes a single area whatever its size.
+ */
+static roi_rect_t *roi_areas(const roi_region_t *region, int *count)
+{
+	roi_rect_t *areas = NULL;
+	int size = 0;
+
+	*count = 0;
+
+	for(int r = 0; r < region->rows; ++r) {
+		const uint8_t *tiles = region->tiles + r * region->cols;
+
+		for(int c = 0; c < region->cols; ) {
+			int end = c;
+
+			while(end < region->cols && tiles[end] != ROI_OUT)
+				end++;
+
+			if(end == c) {
+				c++;
+				continue;
+			}
+
+			int merged = 0;
+
+			for(int i = 0; i < *count && !merged; ++i) {
+				roi_rect_t *area = &areas[i];
+
+				if(area->x == c && area->width == end - c && area->y + area->height == r) {
+					area->height++;
+					merged = 1;
+				}
+			}
+
+			if(!merged) {
+				if(*count == size) {
+					size = MAX(8, 2 * size);
+					areas = (roi_rect_t*)realloc(areas, size * sizeof(roi_rect_t));
+				}
+
+				areas[(*count)++] = (roi_rect_t){ c, r, end - c, 1 };
+			}
+
+			c = end;
+		}
+	}
+
+	return areas;
+}
+
+int roi_pixel_bytes(const ctve_frame_t *frame)
+{
+	return frame->pixel_type == YUV420P || frame->pixel_type == GBRP ? 1 : (int)frame->pixel_type;
+}
+
+void roi_copy(ctve_frame_t *dst, int dx, int dy, ctve_frame_t *src, int sx, int sy, int width, int height)
+{
+	int bytes = roi_pixel_bytes(dst);
+
+	for(int p = 0; p < ctve_frame_planes(dst->pixel_type); ++p) {
+		int shift = p > 0 && dst->pixel_type == YUV420P;
+		/* Chroma of odd edges rounds up, like the planes themselves. */
+		int len = ((sx + width + shift) >> shift) - (sx >> shift);
+		int rows = ((sy + height + shift) >> shift) - (sy >> shift);
+		uint8_t *d = ctve_frame_plane(dst, p) + (dy >> shift) * ctve_frame_linesize(dst, p) + (dx >> shift) * bytes;
+		const uint8_t *s = ctve_frame_plane(src, p) + (sy >> shift) * ctve_frame_linesize(src, p) + (sx >> shift) * bytes;
+
+		for(int i = 0; i < rows; ++i)
+			memcpy(d + i * ctve_frame_linesize(dst, p), s + i * ctve_frame_linesize(src, p), len * bytes);
+
+		ctve_count_copy(dst->counters, len * rows * bytes);
+	}
+}
+
+/* How much of the effect pixels [x, x + width) of row y take, 0 to 255. */
+static void roi_alpha(const roi_region_t *region, int x, int y, int width, uint8_t *alpha)
+{
+	if(region->mask != NULL) {
+		memcpy(alpha, region->mask + y * region->width + x, width);
+		return;
+	}
+
+	memset(alpha, 0, width);
+
+	for(int i = 0; i < region->key->count; ++i) {
+		const roi_rect_t *rect = &region->key->rects[i];
+		int from = MAX(x, rect->x);
+		int to = MIN(x + width, rect->x + rect->width);
+
+		if(y >= rect->y && y < rect->y + rect->height && from < to)
+			memset(alpha + from - x, 255, to - from);
+	}
+}
+
+static uint8_t roi_mix(uint8_t effect, uint8_t input, int alpha)
+{
+	return (effect * alpha + input * (255 - alpha) + 127) / 255;
+}
+
+/**
+ * Mix the processed block at (sx, sy) of src into the block of the frame
+ * at (x, y), as much as the region covers each pixel. YUV420P chroma
+ * samples take the mean cover of their 2x2 luma block.
+ */
+static void roi_blend(const roi_region_t *region, ctve_frame_t *frame, int x, int y, ctve_frame_t *src, int sx, int sy, int width, int height)
+{
+	uint8_t alpha[2][ROI_TILE * ROI_TILE];
+	int bytes = roi_pixel_bytes(frame);
+	int fs = ctve_frame_linesize(frame, 0);
+	int ss = ctve_frame_linesize(src, 0);
+	/* GBRP planes are all full size and take the same cover. */
+	int planes = frame->pixel_type == GBRP ? 3 : 1;
+
+	/* Blocks are a tile wide at most. */
+	for(int i = 0; i < height; ++i) {
+		uint8_t *a = alpha[i & 1] + (i / 2) * ROI_TILE;
+
+		roi_alpha(region, x, y + i, width, a);
+
+		for(int p = 0; p < planes; ++p) {
+			uint8_t *d = ctve_frame_plane(frame, p) + (y + i) * fs + x * bytes;
+			const uint8_t *s = ctve_frame_plane(src, p) + (sy + i) * ss + sx * bytes;
+
+			for(int j = 0; j < width * bytes; ++j)
+				d[j] = roi_mix(s[j], d[j], a[j / bytes]);
+		}
+	}
+
+	if(frame->pixel_type != YUV420P)
+		return;
+
+	for(int p = 1; p < 3; ++p) {
+		int cs = ctve_frame_linesize(frame, p);
+		int css = ctve_frame_linesize(src, p);
+		int rows = (height + 1) / 2;
+		int cols = (width + 1) / 2;
+
+		for(int i = 0; i < rows; ++i) {
+			uint8_t *d = ctve_frame_plane(frame, p) + (y / 2 + i) * cs + x / 2;
+			const uint8_t *s = ctve_frame_plane(src, p) + (sy / 2 + i) * css + sx / 2;
+			const uint8_t *a0 = alpha[0] + i * ROI_TILE;
+			const uint8_t *a1 = 2 * i + 1 < height ? alpha[1] + i * ROI_TILE : a0;
+
+			for(int j = 0; j < cols; ++j) {
+				int k = MIN(2 * j + 1, width - 1);
+				int cover = (a0[2 * j] + a0[k] + a1[2 * j] + a1[k] + 2) / 4;
+
+				d[j] = roi_mix(s[j], d[j], cover);
+			}
+		}
+	}
+
+	ctve_count_copy(frame->counters, width * height * bytes);
+}
+
+/**
+ * Take an area of tiles out of the frame with its halo around, and
+ * process it into sub. Areas come in any size and last for one frame,
+ * so sub gets memory of its own rather than a buffer of the frame pools,
+ * which are kept for the sizes every frame has: buf stays NULL, and
+ * effects work on it in place. That memory is left in block, for
+ * roi_apply() to free whatever buffer sub ends up with.
+ */
+static int roi_process_area(ctve_frame_t *frame, const roi_rect_t *area, int halo, roi_apply_func apply, void *arg, ctve_frame_t *sub, uint8_t **block, int *left, int *top)
+{
+	int x1 = MIN(frame->width, (area->x + area->width) * ROI_TILE);
+	int y1 = MIN(frame->height, (area->y + area->height) * ROI_TILE);
+
+	/* An even halo keeps the chroma of YUV420P on whole samples. */
+	halo = (halo + 1) & ~1;
+
+	*sub = *frame;
+	*left = MAX(0, area->x * ROI_TILE - halo);
+	*top = MAX(0, area->y * ROI_TILE - halo);
+
+	sub->width = MIN(frame->width, x1 + halo) - *left;
+	sub->height = MIN(frame->height, y1 + halo) - *top;
+	sub->stride = ctve_frame_stride(sub->width, sub->pixel_type);
+	sub->length = ctve_frame_size(sub->width, sub->height, sub->pixel_type);
+	sub->rows = 0;
+	sub->buf = NULL;
+
+	if(posix_memalign((void**)&sub->data, CTVE_FRAME_ALIGN, sub->length) != 0) {
+		fprintf(stderr, "Could not allocate frame buffer\n");
+		return -1;
+	}
+
+	*block = sub->data;
+	roi_copy(sub, 0, 0, frame, *left, *top, sub->width, sub->height);
+	apply(sub, arg);
+
+	return 0;
+}
+
+/* Store the tiles of a processed area back into the frame. */
+static void roi_store_area(const roi_region_t *region, ctve_frame_t *frame, const roi_rect_t *area, ctve_frame_t *sub, int left, int top)
+{
+	for(int r = area->y; r < area->y + area->height; ++r) {
+		const uint8_t *tiles = region->tiles + r * region->cols;
+		int y = r * ROI_TILE;
+		int height = MIN(frame->height, y + ROI_TILE) - y;
+
+		for(int c = area->x; c < area->x + area->width; ++c) {
+			int x = c * ROI_TILE;
+			int width = MIN(frame->width, x + ROI_TILE) - x;
+
+			/* Runs of whole tiles go back in one copy per row. */
+			if(tiles[c] == ROI_FULL) {
+				int end = c;
+
+				while(end + 1 < area->x + area->width && tiles[end + 1] == ROI_FULL)
+					end++;
+
+				width = MIN(frame->width, (end + 1) * ROI_TILE) - x;
+				roi_copy(frame, x, y, sub, x - left, y - top, width, height);
+				c = end;
+			} else if(tiles[c] == ROI_PARTIAL) {
+				roi_blend(region, frame, x, y, sub, x - left, y - top, width, height);
+			}
+		}
+	}
+}
+
+void roi_apply(roi_t *roi, ctve_frame_t *frame, int halo, roi_apply_func apply, void *arg)
+{
+	roi_region_t region;
+	roi_rect_t *areas;
+	int count;
+
+	if(!roi || !frame || roi_region(roi, frame, &region) < 0)
+		return;
+
+	areas = roi_areas(&region, &count);
+
+	/* Halos overlap other areas: every one is read before any is stored. */
+	ctve_frame_t *subs = (ctve_frame_t*)malloc(count * sizeof(ctve_frame_t));
+	uint8_t **blocks = (uint8_t**)malloc(count * sizeof(uint8_t*));
+	int *origins = (int*)malloc(2 * count * sizeof(int));
+
+	for(int i = 0; i < count; ++i) {
+		if(roi_process_area(frame, &areas[i], halo, apply, arg, &subs[i], &blocks[i], &origins[2 * i], &origins[2 * i + 1]) < 0)
+			subs[i].data = NULL;
+	}
+
+	for(int i = 0; i < count; ++i) {
+		if(subs[i].data == NULL)
+			continue;
+
+		roi_store_area(&region, frame, &areas[i], &subs[i], origins[2 * i], origins[2 * i + 1]);
+
+		/* apply may have swapped in a pooled buffer: that goes back to its pool, ours is freed. */
+		if(subs[i].buf != NULL)
+			ctve_frame_unref(&subs[i]);
+		free(blocks[i]);
+	}
+
+	free(subs);
+	free(blocks);
+	free(origins);
+	free(areas);
+	roi_region_free(&region);
+}
@@ -0,0 +1,109 @@
+#ifndef ROI_H
+#define ROI_H
+
+#include "ctve.h"
+
+/* Side of the square tiles a region is worked in, in pixels; even for YUV420P chroma. */
+#define ROI_TILE	32
+
+typedef struct
+{
+	int x;
+	int y;
+	int width;
+	int height;
+} roi_rect_t;
+
+/* Rectangles in effect from a time on, up to the next key. */
+typedef struct
+{
+	double time;
+	roi_rect_t *rects;
+	int count;
+} roi_key_t;
+
+/**
+ * Where the effects apply: rectangles, the same on every frame or
+ * changing over time, or a greyscale mask where 255 takes the effect,
+ * 0 keeps the input and values in between mix both.
+ *
+ * Frames are cut into ROI_TILE tiles. Only the tiles the region touches
+ * get processed, in as few areas as possible, each with a halo around it
+ * so that a blur comes out at the region's edge as it would on the whole
+ * frame. Tiles half in the region are mixed back pixel by pixel. The cost
+ * follows the region's area rather than the frame's.
+ */
+typedef struct
+{
+	/* Sorted by time; a single key at 0 for static rectangles. */
+	roi_key_t *keys;
+	int count;
+
+	/* Mask as loaded, or NULL. */
+	uint8_t *mask;
+	int maskWidth;
+	int maskHeight;
+
+	/* Mask scaled to the frames on first use, and the state of its tiles. */
+	uint8_t *scaled;
+	uint8_t *tiles;
+	int scaledWidth;
+	int scaledHeight;
+	pthread_mutex_t lock;
+} roi_t;
+
+/**
+ * Static rectangles, "<x>,<y>,<width>,<height>" joined by '+'.
+ * Returns NULL and prints why on a malformed one.
+ */
+roi_t *roi_parse_rects(const char *spec);
+
+/* Static rectangles, copied from an array. */
+roi_t *roi_from_rects(const roi_rect_t *rects, int count);
+
+/**
+ * Rectangles over time from a text file, one line per change:
+ *
+ *	<seconds> <x>,<y>,<width>,<height> [<x>,<y>,<width>,<height> ...]
+ *
+ * A line holds from its time up to the next one; a line with no
+ * rectangle ends the region. Empty lines and lines starting with '#' are
+ * skipped. Returns NULL and prints why on a malformed file.
+ */
+roi_t *roi_load_sidecar(const char *path);
+
+/**
+ * Mask from a binary greyscale PGM (P5) file, stretched to the frame size
+ * when it differs. Returns NULL and prints why on a malformed file.
+ */
+roi_t *roi_load_mask(const char *path);
+
+/* Release a region. */
+void roi_free(roi_t *roi);
+
+/* Bytes per pixel of a plane of the frame's layout. */
+int roi_pixel_bytes(const ctve_frame_t *frame);
+
+/**
+ * Copy a width x height block, in pixels of the first plane, from src at
+ * (sx, sy) to dst at (dx, dy), every plane of it: YUV420P chroma of odd
+ * edges rounds up, like the planes themselves.
+ */
+void roi_copy(ctve_frame_t *dst, int dx, int dy, ctve_frame_t *src, int sx, int sy, int width, int height);
+
+/**
+ * Work on one area: a frame of its own, of the same layout, that holds
+ * the area and its halo. It may get a new buffer, see blur_kernel_apply():
+ * roi_apply() releases that and the one it gave alike.
+ */
+typedef void (*roi_apply_func)(ctve_frame_t *frame, void *arg);
+
+/**
+ * Run apply on the part of a frame of any layout in the region, with
+ * halo pixels of the frame around it on every side; the region's
+ * rectangles are picked by the frame's time. Pixels out of the region
+ * are left alone.
+ */
+void roi_apply(roi_t *roi, ctve_frame_t *frame, int halo, roi_apply_func apply, void *arg);
+
+#endif
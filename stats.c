@@ -0,0 +1,69 @@
+#include <time.h>
+#include <sys/resource.h>
+
+#include "stats.h"
+
+static const char *stageNames[STATS_STAGES] = {
+	"read", "decode", "convert_in", "effect", "convert_out", "encode", "write", "latency",
+};
+
+uint64_t stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void stats_timer_add(stats_timer_t *timer, uint64_t ns, int count)
+{
+	if(count < 1)
+		return;
+
+	uint64_t each = ns / count;
+	uint64_t us = each / 1000;
+	int bucket = 0;
+
+	while(us > 1 && bucket < STATS_BUCKETS - 1) {
+		us >>= 1;
+		bucket++;
+	}
+
+	timer->count += count;
+	timer->total_ns += ns;
+	timer->buckets[bucket] += count;
+
+	if(each > timer->max_ns)
+		timer->max_ns = each;
+}
+
+uint64_t stats_timer_percentile(const stats_timer_t *timer, double p)
+{
+	uint64_t seen = 0;
+
+	for(int i = 0; i < STATS_BUCKETS; ++i) {
+		seen += timer->buckets[i];
+
+		if(seen > 0 && seen >= p * timer->count)
+			return (2000ull << i) < timer->max_ns ? (2000ull << i) : timer->max_ns;
+	}
+
+	return timer->max_ns;
+}
+
+const char *stats_stage_name(stats_stage_t stage)
+{
+	return stage < STATS_STAGES ? stageNames[stage] : "?";
+}
+
+long stats_peak_rss(void)
+{
+	struct rusage usage;
+
+	if(getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+
+	/* Linux reports kB. */
+	return usage.ru_maxrss;
+}
@@ -0,0 +1,53 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Where the time of a frame goes, in processing order. */
+typedef enum
+{
+	STATS_READ,
+	STATS_DECODE,
+	STATS_CONVERT_IN,
+	STATS_EFFECT,
+	STATS_CONVERT_OUT,
+	STATS_ENCODE,
+	STATS_WRITE,
+	/* From decoded to handed to the encoder, waiting included. */
+	STATS_LATENCY,
+	STATS_STAGES,
+} stats_stage_t;
+
+/* Histogram buckets: [2^i, 2^(i+1)) microseconds, the first one from 0. */
+#define STATS_BUCKETS 24
+
+/**
+ * Time spent in a stage. Every sample counts as `count` frames, so a
+ * stage running on whole batches still gives a per-frame histogram.
+ * A timer is only updated by one thread at a time.
+ */
+typedef struct
+{
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint64_t buckets[STATS_BUCKETS];
+} stats_timer_t;
+
+/* Monotonic clock, in nanoseconds. */
+uint64_t stats_now(void);
+
+/* Account ns spent on count frames. */
+void stats_timer_add(stats_timer_t *timer, uint64_t ns, int count);
+
+/* Upper bound of the per-frame time below which a fraction p of the frames fall, in ns. */
+uint64_t stats_timer_percentile(const stats_timer_t *timer, double p);
+
+/* Name of a stage, as used in reports. */
+const char *stats_stage_name(stats_stage_t stage);
+
+/* Peak resident set size of the process so far, in kB. */
+long stats_peak_rss(void);
+
+#endif
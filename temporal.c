@@ -0,0 +1,169 @@
+#include "temporal.h"
+#include "pool.h"
+#include "util.h"
+
+/* Band split of a temporal_apply() call, over the rows of every plane. */
+typedef struct
+{
+	temporal_t *temporal;
+	ctve_frame_t *frame;
+	const uint8_t *in;
+	/* Frame leaving the window, or NULL while it fills up. */
+	const uint8_t *old;
+	uint8_t *out;
+	int bands;
+} temporal_job_t;
+
+temporal_t *temporal_create(temporal_mode_t mode, int window, int threshold)
+{
+	if(window < 1 || window > TEMPORAL_MAX)
+		return NULL;
+
+	temporal_t *temporal = (temporal_t*)malloc(sizeof(temporal_t));
+
+	temporal->mode = mode;
+	temporal->window = window;
+	temporal->threshold = MAX(0, threshold);
+	temporal->history = history_create(window);
+	temporal->sum = NULL;
+	temporal->length = 0;
+	temporal->div = (uint8_t*)malloc(255 * TEMPORAL_MAX + 1);
+	temporal->divCount = 0;
+
+	return temporal;
+}
+
+void temporal_free(temporal_t *temporal)
+{
+	if(temporal == NULL)
+		return;
+
+	history_free(temporal->history);
+	free(temporal->sum);
+	free(temporal->div);
+	free(temporal);
+}
+
+void temporal_reset(temporal_t *temporal)
+{
+	/* With no last frame, the next temporal_apply() clears the sums too. */
+	if(temporal != NULL)
+		history_reset(temporal->history);
+}
+
+/* Samples [from, to) of the frame, all in one row. */
+static void temporal_samples(temporal_job_t *job, uint32_t from, uint32_t to)
+{
+	temporal_t *temporal = job->temporal;
+	uint16_t *sum = temporal->sum;
+	const uint8_t *div = temporal->div;
+	const uint8_t *in = job->in;
+	uint8_t *out = job->out;
+
+	if(job->old != NULL) {
+		for(uint32_t i = from; i < to; ++i)
+			sum[i] += in[i] - job->old[i];
+	} else {
+		for(uint32_t i = from; i < to; ++i)
+			sum[i] += in[i];
+	}
+
+	if(temporal->mode == TEMPORAL_AVERAGE) {
+		for(uint32_t i = from; i < to; ++i)
+			out[i] = div[sum[i]];
+	} else {
+		int threshold = temporal->threshold;
+
+		for(uint32_t i = from; i < to; ++i) {
+			int mean = div[sum[i]];
+			int diff = in[i] - mean;
+
+			out[i] = diff <= threshold && diff >= -threshold ? mean : in[i];
+		}
+	}
+}
+
+/* A band of rows of each plane; the padding past the pixels of a row is never read. */
+static void temporal_band(void *arg, int task)
+{
+	temporal_job_t *job = (temporal_job_t*)arg;
+	ctve_frame_t *frame = job->frame;
+
+	for(int p = 0; p < ctve_frame_planes(frame->pixel_type); ++p) {
+		uint32_t start = ctve_frame_plane(frame, p) - frame->data;
+		int linesize = ctve_frame_linesize(frame, p);
+		int width = ctve_frame_plane_width(frame, p);
+		int height = ctve_frame_plane_height(frame, p);
+
+		for(int i = height * task / job->bands; i < height * (task + 1) / job->bands; ++i)
+			temporal_samples(job, start + i * linesize, start + i * linesize + width);
+	}
+}
+
+/* Start over when frames change size or layout. */
+static void temporal_restart(temporal_t *temporal, ctve_frame_t *frame)
+{
+	ctve_frame_t *last = history_get(temporal->history, 0);
+
+	if(last != NULL && last->length == frame->length && last->width == frame->width &&
+		last->height == frame->height && last->pixel_type == frame->pixel_type)
+		return;
+
+	history_reset(temporal->history);
+
+	if(temporal->length != frame->length) {
+		free(temporal->sum);
+		temporal->sum = (uint16_t*)malloc(frame->length * sizeof(uint16_t));
+		temporal->length = frame->length;
+	}
+
+	memset(temporal->sum, 0, temporal->length * sizeof(uint16_t));
+}
+
+void temporal_apply(temporal_t *temporal, ctve_frame_t *frame)
+{
+	ctve_frame_t out = *frame;
+	ctve_frame_t evicted;
+
+	if(!temporal || !frame)
+		return;
+
+	temporal_restart(temporal, frame);
+
+	/**
+	 * A pooled frame is shared with the history from now on: write the
+	 * result elsewhere. Otherwise the history made its own copy and the
+	 * result can go in place, every byte only depends on itself.
+	 */
+	int swap = frame->buf != NULL;
+	if(swap && ctve_frame_alloc(&out) < 0)
+		return;
+
+	int evict = history_push(temporal->history, frame, &evicted);
+	if(evict < 0) {
+		if(swap)
+			ctve_frame_unref(&out);
+		return;
+	}
+
+	int count = temporal->history->length;
+	if(temporal->divCount != count) {
+		for(int sum = 0; sum <= 255 * count; ++sum)
+			temporal->div[sum] = (sum + count / 2) / count;
+		temporal->divCount = count;
+	}
+
+	pool_t *pool = pool_get();
+	int bands = MAX(pool_threads(pool), (int)(temporal->length * sizeof(uint16_t) / L2_TILE_BYTES));
+	temporal_job_t job = { temporal, frame, frame->data, evict ? evicted.data : NULL, out.data, MIN(bands, frame->height) };
+
+	pool_run(pool, job.bands, temporal_band, &job);
+
+	if(evict)
+		ctve_frame_unref(&evicted);
+
+	if(swap) {
+		ctve_frame_unref(frame);
+		*frame = out;
+	}
+}
@@ -0,0 +1,59 @@
+#ifndef TEMPORAL_H
+#define TEMPORAL_H
+
+#include "ctve.h"
+#include "history.h"
+
+/* Longest window, so that window sums fit in 16 bits. */
+#define TEMPORAL_MAX 128
+
+typedef enum
+{
+	/* Every sample becomes the mean of the window: motion blur. */
+	TEMPORAL_AVERAGE,
+	/* Samples within threshold of the window mean become the mean, others are kept. */
+	TEMPORAL_DENOISE,
+} temporal_mode_t;
+
+/**
+ * An effect over the last `window` frames, current one included. Each
+ * sample keeps a running sum over the window, so the cost per frame
+ * does not depend on the window length: add the new frame, subtract
+ * the one leaving the history.
+ */
+typedef struct
+{
+	temporal_mode_t mode;
+	int window;
+	int threshold;
+
+	/* Input frames, by reference. */
+	history_t *history;
+
+	/* Window sum of every sample, at its offset in the frame; row padding stays unused. */
+	uint16_t *sum;
+	uint32_t length;
+
+	/* Division table for the current frame count: div[sum] = round(sum / n). */
+	uint8_t *div;
+	int divCount;
+} temporal_t;
+
+/* Create a temporal effect. NULL if window is not in [1, TEMPORAL_MAX]. */
+temporal_t *temporal_create(temporal_mode_t mode, int window, int threshold);
+
+/* Release it, along with the frames it holds. */
+void temporal_free(temporal_t *temporal);
+
+/* Forget the frames so far: the next one starts a new sequence. */
+void temporal_reset(temporal_t *temporal);
+
+/**
+ * Apply the effect on the next frame of the sequence, in any layout.
+ * The result goes to a fresh pooled buffer that replaces the frame's,
+ * so the history keeps the input untouched. A frame of another size or
+ * layout starts the sequence over.
+ */
+void temporal_apply(temporal_t *temporal, ctve_frame_t *frame);
+
+#endif
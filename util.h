@@ -4,4 +4,7 @@
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 
+/* Working-set size kernels aim for, so a tile stays in L2 while in use. */
+#define L2_TILE_BYTES (256 * 1024)
+
 #endif